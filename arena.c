@@ -0,0 +1,555 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "probes.h"
+#include "wrap_mmap.h"
+
+#ifdef SUPPORT_THREADS
+#include <pthread.h>
+
+/* the trylock lets the probe see lock waits. */
+#define ARENA_LOCK(arena) do { \
+	if(pthread_mutex_trylock(&((arena)->lock)) != 0) { \
+		LOWMEM_PROBE1(arena_lock_wait, (arena)); \
+		pthread_mutex_lock(&((arena)->lock)); \
+	} \
+	span_cache_count_lock(); \
+} while(0)
+#define ARENA_UNLOCK(arena) pthread_mutex_unlock(&((arena)->lock))
+#else
+#define ARENA_LOCK(arena) do { } while(0)
+#define ARENA_UNLOCK(arena) do { } while(0)
+#endif
+
+/* don't split the managed range into arenas smaller than this. */
+#define ARENA_MIN_SIZE ((size_t)64 * 1024 * 1024)
+
+#define CACHE_LINE 64
+
+typedef struct Arena {
+#ifdef SUPPORT_THREADS
+	pthread_mutex_t lock;
+#endif
+	PageAlloc *palloc;
+	uint8_t   *start;
+	uint8_t   *end;
+} __attribute__((aligned(CACHE_LINE))) Arena;
+
+struct ArenaSet {
+	uint8_t   *start;
+	uint8_t   *end;
+	size_t    arena_len;
+	size_t    cell_bytes;  /* bytes covered by one free-space map cell. */
+	int       count;
+	/* free bytes per cell, kept off the cache line of the fields above. */
+	uint64_t  cell_free[ARENA_FREE_CELLS] __attribute__((aligned(CACHE_LINE)));
+	Arena     arena[];
+};
+
+#ifdef SUPPORT_THREADS
+static __thread int arena_home __attribute__((tls_model("initial-exec"))) = -1;
+static int arena_next_home = 0;
+
+/* threads are handed home arenas round-robin. */
+static inline int arena_home_index(ArenaSet *set) {
+	int home = arena_home;
+	if(L_UNLIKELY(home < 0)) {
+		home = __atomic_fetch_add(&arena_next_home, 1, __ATOMIC_RELAXED);
+		arena_home = home;
+	}
+	return home % set->count;
+}
+#else
+#define arena_home_index(set) 0
+#endif
+
+static inline int arena_index(ArenaSet *set, uint8_t *addr) {
+	size_t idx = (size_t)(addr - set->start) / set->arena_len;
+	return (idx < (size_t)set->count) ? (int)idx : (set->count - 1);
+}
+
+static inline int arena_in_range(ArenaSet *set, uint8_t *addr, size_t len) {
+	return (addr >= set->start) && (addr < set->end) && (len <= (size_t)(set->end - addr));
+}
+
+ArenaSet *arena_set_new(PageAllocEngine engine, uint8_t *addr, size_t len, size_t page_size, int count) {
+	ArenaSet *set;
+	size_t size;
+	int i;
+
+	if(count > ARENA_MAX) count = ARENA_MAX;
+	if((size_t)count > (len / ARENA_MIN_SIZE)) count = len / ARENA_MIN_SIZE;
+	if(count < 1) count = 1;
+
+	size = sizeof(ArenaSet) + count * sizeof(Arena);
+	size = (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+	/* allocate directly from the system, this runs inside the first mmap call and can't use malloc. */
+	set = (ArenaSet *)SYS_MMAP(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(set == MAP_FAILED) return NULL;
+	set->start = addr;
+	set->end = addr + len;
+	set->arena_len = (len / count) & ~(page_size - 1);
+	set->count = count;
+	set->cell_bytes = (len + ARENA_FREE_CELLS - 1) / ARENA_FREE_CELLS;
+	for(i = 0; i < ARENA_FREE_CELLS; i++) {
+		size_t cell_end = (i + 1) * set->cell_bytes;
+		size_t cell_start = i * set->cell_bytes;
+		if(cell_end > len) cell_end = len;
+		set->cell_free[i] = (cell_end > cell_start) ? (cell_end - cell_start) : 0;
+	}
+	for(i = 0; i < count; i++) {
+		Arena *arena = set->arena + i;
+#ifdef SUPPORT_THREADS
+		pthread_mutex_init(&(arena->lock), NULL);
+#endif
+		arena->start = addr + (i * set->arena_len);
+		/* last arena gets any left over space. */
+		arena->end = (i == (count - 1)) ? set->end : (arena->start + set->arena_len);
+		arena->palloc = page_alloc_new_engine(engine, arena->start, arena->end - arena->start);
+		if(arena->palloc == NULL) {
+			/* no memory for the allocator's metadata. */
+			while(i-- > 0) {
+				page_alloc_free(set->arena[i].palloc);
+			}
+			SYS_MUNMAP(set, size);
+			return NULL;
+		}
+	}
+	return set;
+}
+
+/* keep the free-space map up to date, 'freed' is set for released ranges. */
+static void arena_count(ArenaSet *set, uint8_t *addr, size_t len, int freed) {
+	size_t off = addr - set->start;
+	size_t end = off + len;
+	size_t cell = off / set->cell_bytes;
+	size_t cell_end;
+
+	for(; off < end; cell++) {
+		cell_end = (cell + 1) * set->cell_bytes;
+		if(cell_end > end) cell_end = end;
+		if(freed) {
+			__atomic_fetch_add(&(set->cell_free[cell]), cell_end - off, __ATOMIC_RELAXED);
+		} else {
+			__atomic_fetch_sub(&(set->cell_free[cell]), cell_end - off, __ATOMIC_RELAXED);
+		}
+		off = cell_end;
+	}
+}
+
+int arena_set_count(ArenaSet *set) {
+	return set->count;
+}
+
+void arena_set_split(ArenaSet *set, size_t threshold) {
+	int i;
+
+	for(i = 0; i < set->count; i++) {
+		Arena *arena = set->arena + i;
+		ARENA_LOCK(arena);
+		page_alloc_set_split(arena->palloc, threshold);
+		ARENA_UNLOCK(arena);
+	}
+}
+
+/* check that every part of a range is free, the arenas must be locked. */
+static int arena_range_is_free(ArenaSet *set, uint8_t *addr, size_t len) {
+	int i = arena_index(set, addr);
+	uint8_t *end = addr + len;
+
+	for(; addr < end; i++) {
+		Arena *arena = set->arena + i;
+		uint8_t *part_end = (end < arena->end) ? end : arena->end;
+		if(page_alloc_free_at(arena->palloc, addr) < (size_t)(part_end - addr)) return 0;
+		addr = part_end;
+	}
+	return 1;
+}
+
+/* reserve a free range that may span arenas, the arenas must be locked. */
+static void arena_range_reserve(ArenaSet *set, uint8_t *addr, size_t len) {
+	int i = arena_index(set, addr);
+	uint8_t *end = addr + len;
+
+	for(; addr < end; i++) {
+		Arena *arena = set->arena + i;
+		uint8_t *part_end = (end < arena->end) ? end : arena->end;
+		page_alloc_reserve_segment(arena->palloc, addr, part_end - addr);
+		addr = part_end;
+	}
+}
+
+static void arena_lock_range(ArenaSet *set, int first, int last) {
+	int i;
+	/* always lock in address order. */
+	for(i = first; i <= last; i++) {
+		ARENA_LOCK(set->arena + i);
+	}
+}
+
+static void arena_unlock_range(ArenaSet *set, int first, int last) {
+	int i;
+	for(i = last; i >= first; i--) {
+		ARENA_UNLOCK(set->arena + i);
+	}
+}
+
+/* find free space that spans arena boundaries. */
+static uint8_t *arena_get_spanning(ArenaSet *set, size_t len) {
+	uint8_t *start = NULL;
+	uint8_t *mem = NULL;
+	size_t run = 0;
+	int i;
+
+	arena_lock_range(set, 0, set->count - 1);
+	for(i = 0; i < set->count; i++) {
+		Arena *arena = set->arena + i;
+		size_t arena_len = arena->end - arena->start;
+		size_t head = page_alloc_free_at(arena->palloc, arena->start);
+		if(run > 0 && (run + head) >= len) {
+			mem = start;
+			break;
+		}
+		if(head == arena_len) {
+			/* whole arena is free, extend the current run. */
+			if(run == 0) start = arena->start;
+			run += head;
+			continue;
+		}
+		/* start a new run from the free space at the end of this arena. */
+		run = page_alloc_free_before(arena->palloc, arena->end);
+		start = arena->end - run;
+	}
+	if(mem != NULL) {
+		arena_range_reserve(set, mem, len);
+		arena_count(set, mem, len, 0);
+	}
+	arena_unlock_range(set, 0, set->count - 1);
+	return mem;
+}
+
+uint8_t *arena_get_segment(ArenaSet *set, uint8_t *addr, size_t len) {
+	Arena *arena;
+	uint8_t *mem;
+	int home;
+	int i;
+
+	if(addr != NULL && arena_in_range(set, addr, len)) {
+		arena = set->arena + arena_index(set, addr);
+		if(len <= (size_t)(arena->end - addr)) {
+			/* let the arena that owns the hinted address handle it. */
+			ARENA_LOCK(arena);
+			mem = page_alloc_get_segment(arena->palloc, addr, len);
+			ARENA_UNLOCK(arena);
+			if(mem != NULL) {
+				arena_count(set, mem, len, 0);
+				return mem;
+			}
+		} else if(arena_reserve_segment(set, addr, len) == 0) {
+			return addr;
+		}
+	}
+	/* try home arena first, then steal from the others. */
+	home = arena_home_index(set);
+	for(i = 0; i < set->count; i++) {
+		arena = set->arena + ((home + i) % set->count);
+		ARENA_LOCK(arena);
+		mem = page_alloc_get_segment(arena->palloc, NULL, len);
+		ARENA_UNLOCK(arena);
+		if(mem != NULL) {
+			arena_count(set, mem, len, 0);
+			return mem;
+		}
+	}
+	if(set->count > 1) {
+		return arena_get_spanning(set, len);
+	}
+	return NULL;
+}
+
+int arena_get_segments(ArenaSet *set, Span *spans, int count) {
+	Arena *arena;
+	int i;
+
+	arena = set->arena + arena_home_index(set);
+	ARENA_LOCK(arena);
+	for(i = 0; i < count; i++) {
+		spans[i].addr = page_alloc_get_segment(arena->palloc, NULL, spans[i].len);
+		if(spans[i].addr == NULL) break;
+		arena_count(set, spans[i].addr, spans[i].len, 0);
+	}
+	ARENA_UNLOCK(arena);
+	/* home arena is full, steal the rest one at a time. */
+	for(; i < count; i++) {
+		spans[i].addr = arena_get_segment(set, NULL, spans[i].len);
+		if(spans[i].addr == NULL) {
+			arena_release_spans(set, spans, i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+uint8_t *arena_get_aligned_segment(ArenaSet *set, size_t len, size_t align) {
+	Arena *arena;
+	uint8_t *mem;
+	int home;
+	int i;
+
+	/* aligned segments never span arenas. */
+	home = arena_home_index(set);
+	for(i = 0; i < set->count; i++) {
+		arena = set->arena + ((home + i) % set->count);
+		ARENA_LOCK(arena);
+		mem = page_alloc_get_aligned_segment(arena->palloc, len, align);
+		ARENA_UNLOCK(arena);
+		if(mem != NULL) {
+			arena_count(set, mem, len, 0);
+			return mem;
+		}
+	}
+	return NULL;
+}
+
+uint8_t *arena_resize_segment(ArenaSet *set, uint8_t *addr, size_t len, size_t new_len) {
+	if(new_len < len) {
+		/* shrink allocated segment */
+		if(arena_release_segment(set, addr + new_len, len - new_len) != 0) return NULL;
+		return addr;
+	}
+	if(new_len == len) return addr;
+	if(arena_reserve_segment(set, addr + len, new_len - len) != 0) {
+		/* can't expand segment. */
+		return NULL;
+	}
+	return addr;
+}
+
+int arena_reserve_segment(ArenaSet *set, uint8_t *addr, size_t len) {
+	int first;
+	int last;
+	int rc = -1;
+
+	if(len == 0 || !arena_in_range(set, addr, len)) return -1;
+	first = arena_index(set, addr);
+	last = arena_index(set, addr + len - 1);
+	arena_lock_range(set, first, last);
+	if(arena_range_is_free(set, addr, len)) {
+		arena_range_reserve(set, addr, len);
+		arena_count(set, addr, len, 0);
+		rc = 0;
+	}
+	arena_unlock_range(set, first, last);
+	return rc;
+}
+
+int arena_release_segment(ArenaSet *set, uint8_t *addr, size_t len) {
+	uint8_t *end = addr + len;
+	int rc = 0;
+	int i;
+
+	if(!arena_in_range(set, addr, len)) return -1;
+	for(i = arena_index(set, addr); addr < end; i++) {
+		Arena *arena = set->arena + i;
+		uint8_t *part_end = (end < arena->end) ? end : arena->end;
+		ARENA_LOCK(arena);
+		if(page_alloc_release_segment(arena->palloc, addr, part_end - addr) != 0) {
+			rc = -1;
+		} else {
+			arena_count(set, addr, part_end - addr, 1);
+		}
+		ARENA_UNLOCK(arena);
+		addr = part_end;
+	}
+	return rc;
+}
+
+int arena_is_free(ArenaSet *set, uint8_t *addr, size_t len) {
+	int first;
+	int last;
+	int rc;
+
+	if(len == 0 || !arena_in_range(set, addr, len)) return 0;
+	first = arena_index(set, addr);
+	last = arena_index(set, addr + len - 1);
+	arena_lock_range(set, first, last);
+	rc = arena_range_is_free(set, addr, len);
+	arena_unlock_range(set, first, last);
+	return rc;
+}
+
+size_t arena_free_at(ArenaSet *set, uint8_t *addr) {
+	Arena *arena;
+	size_t len;
+
+	if(!arena_in_range(set, addr, 1)) return 0;
+	arena = set->arena + arena_index(set, addr);
+	ARENA_LOCK(arena);
+	len = page_alloc_free_at(arena->palloc, addr);
+	ARENA_UNLOCK(arena);
+	return len;
+}
+
+size_t arena_used_at(ArenaSet *set, uint8_t *addr) {
+	Arena *arena;
+	size_t len;
+
+	if(!arena_in_range(set, addr, 1)) return 0;
+	arena = set->arena + arena_index(set, addr);
+	ARENA_LOCK(arena);
+	len = page_alloc_used_at(arena->palloc, addr);
+	ARENA_UNLOCK(arena);
+	return len;
+}
+
+int arena_claim_segment(ArenaSet *set, uint8_t *addr, size_t len, PageAllocClaim *claim) {
+	uint8_t *end = addr + len;
+	PageAllocClaim local;
+	size_t first;
+	size_t n;
+	int rc = 0;
+	int i;
+
+	if(len == 0 || !arena_in_range(set, addr, len)) return -1;
+	/* the ranges taken are needed for the free-space map. */
+	if(claim == NULL) {
+		page_alloc_claim_init(&local);
+	}
+	first = (claim != NULL) ? claim->count : 0;
+	for(i = arena_index(set, addr); addr < end && rc == 0; i++) {
+		Arena *arena = set->arena + i;
+		uint8_t *part_end = (end < arena->end) ? end : arena->end;
+		ARENA_LOCK(arena);
+		rc = page_alloc_claim(arena->palloc, addr, part_end - addr, (claim != NULL) ? claim : &local);
+		ARENA_UNLOCK(arena);
+		addr = part_end;
+	}
+	if(claim == NULL) {
+		claim = &local;
+	}
+	for(n = first; n < claim->count; n++) {
+		arena_count(set, claim->range[n].addr, claim->range[n].len, 0);
+	}
+	if(claim == &local) {
+		page_alloc_claim_free(&local);
+	}
+	return rc;
+}
+
+void arena_release_spans(ArenaSet *set, Span *spans, int count) {
+	int i;
+	int n;
+
+	/* release spans with one lock acquisition per arena. */
+	for(i = 0; i < set->count; i++) {
+		Arena *arena = set->arena + i;
+		int locked = 0;
+		for(n = 0; n < count; n++) {
+			Span *span = spans + n;
+			if(span->addr < arena->start || span->addr >= arena->end) continue;
+			if(span->len > (size_t)(arena->end - span->addr)) continue;
+			if(!locked) {
+				ARENA_LOCK(arena);
+				locked = 1;
+			}
+			if(page_alloc_release_segment(arena->palloc, span->addr, span->len) == 0) {
+				arena_count(set, span->addr, span->len, 1);
+			}
+		}
+		if(locked) {
+			ARENA_UNLOCK(arena);
+		}
+	}
+	/* spans that cross arena boundaries. */
+	for(n = 0; n < count; n++) {
+		Span *span = spans + n;
+		Arena *arena = set->arena + arena_index(set, span->addr);
+		if(span->len > (size_t)(arena->end - span->addr)) {
+			arena_release_segment(set, span->addr, span->len);
+		}
+	}
+}
+
+void arena_get_stats(ArenaSet *set, PageAllocStats *stats) {
+	int i;
+
+	stats->free_bytes = 0;
+	stats->free_segs = 0;
+	stats->largest_free = 0;
+	for(i = 0; i < set->count; i++) {
+		Arena *arena = set->arena + i;
+		PageAllocStats part;
+		ARENA_LOCK(arena);
+		page_alloc_get_stats(arena->palloc, &part);
+		ARENA_UNLOCK(arena);
+		stats->free_bytes += part.free_bytes;
+		stats->free_segs += part.free_segs;
+		if(part.largest_free > stats->largest_free) {
+			stats->largest_free = part.largest_free;
+		}
+	}
+}
+
+void arena_get_summary(ArenaSet *set, PageAllocStats *stats) {
+	size_t largest;
+	int i;
+
+	stats->free_bytes = 0;
+	stats->free_segs = 0;
+	stats->largest_free = 0;
+	for(i = 0; i < ARENA_FREE_CELLS; i++) {
+		stats->free_bytes += __atomic_load_n(&(set->cell_free[i]), __ATOMIC_RELAXED);
+	}
+	for(i = 0; i < set->count; i++) {
+		Arena *arena = set->arena + i;
+		ARENA_LOCK(arena);
+		stats->free_segs += page_alloc_free_segs(arena->palloc);
+		largest = page_alloc_largest_free(arena->palloc);
+		ARENA_UNLOCK(arena);
+		if(largest > stats->largest_free) {
+			stats->largest_free = largest;
+		}
+	}
+}
+
+size_t arena_free_map(ArenaSet *set, uint64_t *cell_free) {
+	int i;
+
+	for(i = 0; i < ARENA_FREE_CELLS; i++) {
+		cell_free[i] = __atomic_load_n(&(set->cell_free[i]), __ATOMIC_RELAXED);
+	}
+	return set->cell_bytes;
+}
+
+void arena_walk_free(ArenaSet *set, PageAllocWalkFn fn, void *data) {
+	int i;
+
+	for(i = 0; i < set->count; i++) {
+		Arena *arena = set->arena + i;
+		ARENA_LOCK(arena);
+		page_alloc_walk_free(arena->palloc, fn, data);
+		ARENA_UNLOCK(arena);
+	}
+}
+
+void arena_dump_stats(ArenaSet *set) {
+	int i;
+
+	for(i = 0; i < set->count; i++) {
+		Arena *arena = set->arena + i;
+		ARENA_LOCK(arena);
+		printf("arena[%d] %p-%p: ", i, arena->start, arena->end);
+		page_alloc_dump_stats(arena->palloc);
+		ARENA_UNLOCK(arena);
+	}
+}
+
@@ -0,0 +1,78 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__ARENA_H__)
+#define __ARENA_H__
+
+#include "lcommon.h"
+#include "page_alloc.h"
+#include "span_cache.h"
+
+/*
+ * A managed range split into arenas, each with its own PageAlloc and lock.
+ *
+ * Threads allocate from a home arena and only steal from the other arenas
+ * when it is exhausted.  Requests that don't fit in any single arena are
+ * served from free space that spans arena boundaries.
+ */
+typedef struct ArenaSet ArenaSet;
+
+/* upper limit for the number of arenas. */
+#define ARENA_MAX 64
+
+L_LIB_API ArenaSet *arena_set_new(PageAllocEngine engine, uint8_t *addr, size_t len, size_t page_size, int count);
+
+L_LIB_API int arena_set_count(ArenaSet *set);
+
+/* two-ended placement inside each arena, see page_alloc_set_split(). */
+L_LIB_API void arena_set_split(ArenaSet *set, size_t threshold);
+
+L_LIB_API uint8_t *arena_get_segment(ArenaSet *set, uint8_t *addr, size_t len);
+
+/* allocate every span's 'len' into its 'addr', taking the home arena's lock once
+ * for the whole batch.  returns -1 and releases them all if any can't be allocated. */
+L_LIB_API int arena_get_segments(ArenaSet *set, Span *spans, int count);
+
+L_LIB_API uint8_t *arena_get_aligned_segment(ArenaSet *set, size_t len, size_t align);
+
+L_LIB_API uint8_t *arena_resize_segment(ArenaSet *set, uint8_t *addr, size_t len, size_t new_len);
+
+L_LIB_API int arena_reserve_segment(ArenaSet *set, uint8_t *addr, size_t len);
+
+L_LIB_API int arena_release_segment(ArenaSet *set, uint8_t *addr, size_t len);
+
+/* every page in the range is free. */
+L_LIB_API int arena_is_free(ArenaSet *set, uint8_t *addr, size_t len);
+
+/* free/allocated bytes starting at 'addr', up to the end of its arena. */
+L_LIB_API size_t arena_free_at(ArenaSet *set, uint8_t *addr);
+
+L_LIB_API size_t arena_used_at(ArenaSet *set, uint8_t *addr);
+
+/* allocate every free page in a range that is partly allocated already, see page_alloc_claim(). */
+L_LIB_API int arena_claim_segment(ArenaSet *set, uint8_t *addr, size_t len, PageAllocClaim *claim);
+
+L_LIB_API void arena_release_spans(ArenaSet *set, Span *spans, int count);
+
+/* free space summary of all arenas. */
+L_LIB_API void arena_get_stats(ArenaSet *set, PageAllocStats *stats);
+
+/* the free-space map splits the arenas' range into this many cells. */
+#define ARENA_FREE_CELLS 256
+
+/*
+ * same as arena_get_stats() without walking the free space, each lock is only held
+ * for O(1).  largest_free is 0 if the engine can't tell without a walk.
+ */
+L_LIB_API void arena_get_summary(ArenaSet *set, PageAllocStats *stats);
+
+/* copy the free bytes of each cell, they are counted as segments are taken and released.  Returns the cell size. */
+L_LIB_API size_t arena_free_map(ArenaSet *set, uint64_t *cell_free);
+
+/* call 'fn' for each free segment, one arena locked at a time. */
+L_LIB_API void arena_walk_free(ArenaSet *set, PageAllocWalkFn fn, void *data);
+
+L_LIB_API void arena_dump_stats(ArenaSet *set);
+
+#endif /* __ARENA_H__ */
@@ -0,0 +1,106 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__BENCH_H__)
+#define __BENCH_H__
+
+#include "lcommon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Helpers shared by the benchmarks.
+ *
+ * Every result is printed as one line of space separated key=value pairs, so
+ * runs can be diffed or loaded into a spreadsheet to track regressions.
+ */
+
+/* per-call latencies of one operation. */
+typedef struct BenchSamples {
+	uint64_t  *ns;
+	size_t    count;
+	size_t    size;
+	uint64_t  total_ns;
+} BenchSamples;
+
+L_INLINE uint64_t bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/* xorshift64*, the same sequence on every run. */
+L_INLINE uint64_t bench_rand(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+L_INLINE void bench_samples_init(BenchSamples *s, size_t size) {
+	s->ns = (uint64_t *)malloc(size * sizeof(uint64_t));
+	s->count = 0;
+	s->size = size;
+	s->total_ns = 0;
+}
+
+L_INLINE void bench_samples_free(BenchSamples *s) {
+	free(s->ns);
+	s->ns = NULL;
+}
+
+L_INLINE void bench_sample_ns(BenchSamples *s, uint64_t ns) {
+	s->total_ns += ns;
+	if(s->count < s->size) {
+		s->ns[s->count] = ns;
+	}
+	s->count++;
+}
+
+L_INLINE void bench_sample(BenchSamples *s, uint64_t start) {
+	bench_sample_ns(s, bench_now() - start);
+}
+
+/* append all of 'src' to 'dst'. */
+L_INLINE void bench_samples_merge(BenchSamples *dst, const BenchSamples *src) {
+	size_t n = (src->count < src->size) ? src->count : src->size;
+	if(dst->count + n > dst->size) {
+		dst->size = dst->count + n;
+		dst->ns = (uint64_t *)realloc(dst->ns, dst->size * sizeof(uint64_t));
+	}
+	memcpy(dst->ns + dst->count, src->ns, n * sizeof(uint64_t));
+	dst->count += n;
+	dst->total_ns += src->total_ns;
+}
+
+static int bench_cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* sorts the samples. */
+L_INLINE uint64_t bench_pct(BenchSamples *s, int pct) {
+	size_t n = (s->count < s->size) ? s->count : s->size;
+	if(n == 0) return 0;
+	qsort(s->ns, n, sizeof(uint64_t), bench_cmp_u64);
+	return s->ns[((n - 1) * pct) / 100];
+}
+
+/* print the common part of a result line, the caller adds extra fields and the newline. */
+L_INLINE void bench_report(const char *prefix, const char *op, BenchSamples *s, uint64_t wall_ns) {
+	double secs = (double)(wall_ns ? wall_ns : s->total_ns) / 1e9;
+	uint64_t p50 = bench_pct(s, 50);
+	uint64_t p99 = bench_pct(s, 99);
+	printf("%s op=%s ops=%zu ops_s=%.0f p50_ns=%llu p99_ns=%llu", prefix, op, s->count,
+		(secs > 0.0) ? (double)s->count / secs : 0.0,
+		(unsigned long long)p50, (unsigned long long)p99);
+}
+
+#endif /* __BENCH_H__ */
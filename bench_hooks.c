@@ -0,0 +1,187 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * End-to-end benchmark of mmap/munmap/mremap with MAP_32BIT.
+ *
+ *   bench_hooks [-l label] [-t threads] [-n ops per thread]
+ *
+ * Run it as-is for the plain glibc/kernel numbers, and with one of the
+ * libraries in LD_PRELOAD to measure the hooks.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+#include "bench.h"
+
+#define PAGE_SIZE  ((size_t)4096)
+
+/* live mappings per thread. */
+#define SLOTS      256
+#define MAX_PAGES  64
+
+typedef struct Slot {
+	uint8_t   *addr;
+	size_t    len;
+} Slot;
+
+typedef struct Worker {
+	pthread_t     thread;
+	size_t        ops;
+	uint64_t      seed;
+	BenchSamples  op[STATS_OPS];
+	size_t        failed[STATS_OPS];
+	Slot          slot[SLOTS];
+} Worker;
+
+static pthread_barrier_t start_barrier;
+
+static const char *op_names[STATS_OPS] = { "mmap", "munmap", "mremap" };
+
+static size_t random_len(Worker *w) {
+	return ((bench_rand(&(w->seed)) % MAX_PAGES) + 1) * PAGE_SIZE;
+}
+
+static void *worker_run(void *data) {
+	Worker *w = (Worker *)data;
+	size_t i;
+
+	pthread_barrier_wait(&start_barrier);
+	for(i = 0; i < w->ops; i++) {
+		Slot *slot = w->slot + (bench_rand(&(w->seed)) % SLOTS);
+		uint64_t start;
+		void *mem;
+		size_t len;
+		if(slot->addr == NULL) {
+			len = random_len(w);
+			start = bench_now();
+			mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_32BIT, -1, 0);
+			bench_sample(w->op + STATS_MMAP, start);
+			if(mem == MAP_FAILED) {
+				w->failed[STATS_MMAP]++;
+				continue;
+			}
+			slot->addr = (uint8_t *)mem;
+			slot->len = len;
+		} else if((bench_rand(&(w->seed)) & 3) == 0) {
+			len = random_len(w);
+			start = bench_now();
+			mem = mremap(slot->addr, slot->len, len, MREMAP_MAYMOVE);
+			bench_sample(w->op + STATS_MREMAP, start);
+			if(mem == MAP_FAILED) {
+				w->failed[STATS_MREMAP]++;
+				continue;
+			}
+			slot->addr = (uint8_t *)mem;
+			slot->len = len;
+		} else {
+			start = bench_now();
+			if(munmap(slot->addr, slot->len) != 0) {
+				w->failed[STATS_MUNMAP]++;
+			}
+			bench_sample(w->op + STATS_MUNMAP, start);
+			slot->addr = NULL;
+		}
+	}
+	return NULL;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-l label] [-t threads] [-n ops per thread]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	int (*get_stats)(LowmemStats *stats);
+	const char *label = "glibc";
+	LowmemStats stats;
+	Worker *workers;
+	size_t ops = 200000;
+	int threads = 1;
+	uint64_t start;
+	uint64_t wall;
+	char prefix[128];
+	int opt;
+	int t;
+	int op;
+	int i;
+
+	while((opt = getopt(argc, argv, "l:t:n:h")) != -1) {
+		switch(opt) {
+		case 'l':
+			label = optarg;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'n':
+			ops = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(threads < 1) usage(argv[0]);
+
+	workers = (Worker *)calloc(threads, sizeof(Worker));
+	pthread_barrier_init(&start_barrier, NULL, threads + 1);
+	for(t = 0; t < threads; t++) {
+		Worker *w = workers + t;
+		w->ops = ops;
+		w->seed = 0x9E3779B97F4A7C15ULL + t;
+		for(op = 0; op < STATS_OPS; op++) {
+			bench_samples_init(w->op + op, ops);
+		}
+		pthread_create(&(w->thread), NULL, worker_run, w);
+	}
+	pthread_barrier_wait(&start_barrier);
+	start = bench_now();
+	for(t = 0; t < threads; t++) {
+		pthread_join(workers[t].thread, NULL);
+	}
+	wall = bench_now() - start;
+
+	/* fragmentation is only known when one of the libraries is preloaded. */
+	memset(&stats, 0, sizeof(stats));
+	get_stats = (int (*)(LowmemStats *))dlsym(RTLD_DEFAULT, "mmap_lowmem_get_stats");
+	if(get_stats != NULL) get_stats(&stats);
+	for(t = 0; t < threads; t++) {
+		for(i = 0; i < SLOTS; i++) {
+			Slot *slot = workers[t].slot + i;
+			if(slot->addr != NULL) munmap(slot->addr, slot->len);
+		}
+	}
+
+	snprintf(prefix, sizeof(prefix), "bench=hooks lib=%s threads=%d", label, threads);
+	for(op = 0; op < STATS_OPS; op++) {
+		BenchSamples all;
+		size_t failed = 0;
+		bench_samples_init(&all, 0);
+		for(t = 0; t < threads; t++) {
+			bench_samples_merge(&all, workers[t].op + op);
+			failed += workers[t].failed[op];
+			bench_samples_free(workers[t].op + op);
+		}
+		bench_report(prefix, op_names[op], &all, wall);
+		printf(" failed=%zu", failed);
+		if(get_stats != NULL) {
+			printf(" free_segs=%zu largest_free=%zu", stats.free_segs, stats.largest_free);
+		}
+		printf("\n");
+		bench_samples_free(&all);
+	}
+	free(workers);
+	return 0;
+}
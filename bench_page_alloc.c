@@ -0,0 +1,236 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Microbenchmarks of the page allocator engines.
+ *
+ *   bench_page_alloc [-e tree|bitmap] [-n ops] [-S split_threshold]
+ *
+ * The allocator only hands out addresses, nothing is mapped, so the numbers
+ * are the cost of the free space bookkeeping alone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "page_alloc.h"
+#include "bench.h"
+
+#define PAGE_SIZE  ((size_t)4096)
+#define KBYTE      ((size_t)1024)
+#define MBYTE      (1024 * KBYTE)
+
+/* same layout as the low region. */
+#define REGION_START ((uint8_t *)(64 * KBYTE))
+#define REGION_LEN   (((size_t)4 << 30) - (64 * KBYTE))
+
+#define MAX_LIVE 4096
+
+typedef struct Block {
+	uint8_t   *addr;
+	size_t    len;
+} Block;
+
+typedef struct Bench {
+	PageAllocEngine engine;
+	size_t        split;
+	PageAlloc     *palloc;
+	Block         live[MAX_LIVE];
+	BenchSamples  get;
+	BenchSamples  release;
+	BenchSamples  resize;
+	uint64_t      seed;
+	size_t        failed;
+} Bench;
+
+typedef size_t (*SizeFn)(Bench *b);
+
+static const char *engine_name(PageAllocEngine engine) {
+	return (engine == PAGE_ALLOC_BITMAP) ? "bitmap" : "tree";
+}
+
+static void bench_start(Bench *b, size_t ops) {
+	b->palloc = page_alloc_new_engine(b->engine, REGION_START, REGION_LEN);
+	page_alloc_set_split(b->palloc, b->split);
+	memset(b->live, 0, sizeof(b->live));
+	bench_samples_init(&(b->get), ops);
+	bench_samples_init(&(b->release), ops);
+	bench_samples_init(&(b->resize), ops);
+	b->seed = 0x9E3779B97F4A7C15ULL;
+	b->failed = 0;
+}
+
+static void bench_finish(Bench *b, const char *workload) {
+	PageAllocStats stats;
+	char prefix[128];
+
+	page_alloc_get_stats(b->palloc, &stats);
+	snprintf(prefix, sizeof(prefix), "bench=page_alloc engine=%s split=%zu workload=%s",
+		engine_name(b->engine), b->split, workload);
+	if(b->get.count > 0) {
+		bench_report(prefix, "get", &(b->get), 0);
+		printf(" failed=%zu free_segs=%zu largest_free=%zu frag=%.3f\n", b->failed, stats.free_segs,
+			stats.largest_free, page_alloc_fragmentation(stats.largest_free, stats.free_bytes));
+	}
+	if(b->release.count > 0) {
+		bench_report(prefix, "release", &(b->release), 0);
+		printf(" free_segs=%zu largest_free=%zu\n", stats.free_segs, stats.largest_free);
+	}
+	if(b->resize.count > 0) {
+		bench_report(prefix, "resize", &(b->resize), 0);
+		printf(" free_segs=%zu largest_free=%zu\n", stats.free_segs, stats.largest_free);
+	}
+	bench_samples_free(&(b->get));
+	bench_samples_free(&(b->release));
+	bench_samples_free(&(b->resize));
+	page_alloc_free(b->palloc);
+}
+
+static int bench_get(Bench *b, Block *blk, size_t len) {
+	uint64_t start = bench_now();
+	uint8_t *addr = page_alloc_get_segment(b->palloc, NULL, len);
+	bench_sample(&(b->get), start);
+	if(addr == NULL) {
+		b->failed++;
+		return -1;
+	}
+	blk->addr = addr;
+	blk->len = len;
+	return 0;
+}
+
+static void bench_release(Bench *b, Block *blk) {
+	uint64_t start = bench_now();
+	page_alloc_release_segment(b->palloc, blk->addr, blk->len);
+	bench_sample(&(b->release), start);
+	blk->addr = NULL;
+}
+
+/* LuaJIT's GC: mostly 64K-256K chunks, with the odd large string/table buffer. */
+static size_t luajit_size(Bench *b) {
+	uint64_t r = bench_rand(&(b->seed));
+	if((r % 100) < 90) return (64 * KBYTE) << ((r >> 8) % 3);
+	return (1 * MBYTE) << ((r >> 8) % 5);
+}
+
+/* uniform page count from 1 page to 16M. */
+static size_t random_size(Bench *b) {
+	return ((bench_rand(&(b->seed)) % ((16 * MBYTE) / PAGE_SIZE)) + 1) * PAGE_SIZE;
+}
+
+/* replace a random live block on each step. */
+static void run_churn(Bench *b, const char *workload, SizeFn size_fn, size_t live, size_t ops) {
+	size_t i;
+
+	bench_start(b, ops);
+	for(i = 0; i < live; i++) {
+		bench_get(b, b->live + i, size_fn(b));
+	}
+	for(i = 0; i < ops; i++) {
+		Block *blk = b->live + (bench_rand(&(b->seed)) % live);
+		if(blk->addr != NULL) bench_release(b, blk);
+		bench_get(b, blk, size_fn(b));
+	}
+	bench_finish(b, workload);
+}
+
+/* grow and shrink live blocks in-place, moving them when the neighbour is taken. */
+static void run_resize(Bench *b, size_t live, size_t ops) {
+	size_t i;
+
+	bench_start(b, ops);
+	for(i = 0; i < live; i++) {
+		bench_get(b, b->live + i, luajit_size(b));
+	}
+	for(i = 0; i < ops; i++) {
+		Block *blk = b->live + (bench_rand(&(b->seed)) % live);
+		size_t new_len;
+		uint64_t start;
+		uint8_t *addr;
+		if(blk->addr == NULL) continue;
+		new_len = (bench_rand(&(b->seed)) & 1) ? blk->len * 2 : blk->len / 2;
+		if(new_len < PAGE_SIZE) new_len = PAGE_SIZE;
+		/* keep the live set well below the region size. */
+		if(new_len > (4 * MBYTE)) new_len = 64 * KBYTE;
+		start = bench_now();
+		addr = page_alloc_resize_segment(b->palloc, blk->addr, blk->len, new_len);
+		bench_sample(&(b->resize), start);
+		if(addr != NULL) {
+			blk->len = new_len;
+			continue;
+		}
+		/* like mremap(MREMAP_MAYMOVE). */
+		bench_release(b, blk);
+		bench_get(b, blk, new_len);
+	}
+	bench_finish(b, "resize");
+}
+
+/*
+ * Fill the region with small blocks, free every other one, then ask for
+ * blocks that are one page bigger than every hole, so first-fit has to look
+ * past all the holes.
+ */
+static void run_fragment(Bench *b, size_t ops) {
+	size_t holes = 0;
+	Block blk;
+	size_t i;
+
+	bench_start(b, ops);
+	while(page_alloc_get_segment(b->palloc, NULL, PAGE_SIZE) != NULL) {
+		/* fill. */
+	}
+	for(i = 0; i < (REGION_LEN / PAGE_SIZE) && holes < ops; i += 2) {
+		bench_release(b, &((Block){ REGION_START + (i * PAGE_SIZE), PAGE_SIZE }));
+		holes++;
+	}
+	/* free space at the top so the requests can be met. */
+	page_alloc_release_segment(b->palloc, REGION_START + REGION_LEN - (1024 * MBYTE), 1024 * MBYTE);
+	for(i = 0; i < ops; i++) {
+		if(bench_get(b, &blk, 2 * PAGE_SIZE) != 0) break;
+	}
+	bench_finish(b, "fragment");
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-e tree|bitmap] [-n ops] [-S split_threshold]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	static Bench b;
+	const char *engine = NULL;
+	size_t ops = 200000;
+	int opt;
+	int e;
+
+	while((opt = getopt(argc, argv, "e:n:S:h")) != -1) {
+		switch(opt) {
+		case 'e':
+			engine = optarg;
+			break;
+		case 'n':
+			ops = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			b.split = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	for(e = PAGE_ALLOC_TREE; e <= PAGE_ALLOC_BITMAP; e++) {
+		if(engine != NULL && page_alloc_engine_by_name(engine, -1) != (PageAllocEngine)e) continue;
+		b.engine = (PageAllocEngine)e;
+		run_churn(&b, "luajit", luajit_size, 2048, ops);
+		run_churn(&b, "random", random_size, 256, ops);
+		run_resize(&b, 2048, ops);
+		run_fragment(&b, (ops < 65536) ? ops : 65536);
+	}
+	return 0;
+}
@@ -0,0 +1,57 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "bg_thread.h"
+
+#ifdef SUPPORT_THREADS
+
+#include <signal.h>
+#include <pthread.h>
+
+static int bg_thread_start(BgThread *thread) {
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t all;
+	sigset_t old;
+	int rc;
+
+	/* the thread must not handle signals meant for the program. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&tid, &attr, thread->run, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return rc;
+}
+
+void bg_thread_init(BgThread *thread, BgThreadFn run, BgForkFn prepare, BgForkFn parent, BgForkFn child) {
+	thread->run = run;
+	thread->state = 0;
+	pthread_atfork(prepare, parent, child);
+}
+
+int bg_thread_ensure(BgThread *thread, pthread_mutex_t *lock) {
+	int state = __atomic_load_n(&(thread->state), __ATOMIC_ACQUIRE);
+
+	if(L_LIKELY(state > 0)) return 0;
+	if(state < 0) return -1;
+	pthread_mutex_lock(lock);
+	if(thread->state == 0) {
+		__atomic_store_n(&(thread->state), (bg_thread_start(thread) == 0) ? 1 : -1, __ATOMIC_RELEASE);
+	}
+	state = thread->state;
+	pthread_mutex_unlock(lock);
+	return (state > 0) ? 0 : -1;
+}
+
+void bg_thread_forked(BgThread *thread) {
+	if(thread->state > 0) {
+		thread->state = 0;
+	}
+}
+
+#endif
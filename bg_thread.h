@@ -0,0 +1,43 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__BG_THREAD_H__)
+#define __BG_THREAD_H__
+
+#include "lcommon.h"
+
+/*
+ * Background threads of the reclaim queue and the prefaulter.
+ *
+ * A thread is started by the first call that needs it, with every signal
+ * blocked so it never handles signals meant for the program.  Threads don't
+ * survive fork(), the owner's child handler calls bg_thread_forked() so the
+ * child starts its own.  Only used by the thread-safe build.
+ */
+
+#ifdef SUPPORT_THREADS
+
+#include <pthread.h>
+
+typedef void *(*BgThreadFn)(void *data);
+
+typedef void (*BgForkFn)();
+
+typedef struct BgThread {
+	BgThreadFn run;
+	int       state;  /* 0 = not started, 1 = running, -1 = failed to start. */
+} BgThread;
+
+/* 'prepare' and 'parent' can be NULL, 'child' must call bg_thread_forked(). */
+L_LIB_API void bg_thread_init(BgThread *thread, BgThreadFn run, BgForkFn prepare, BgForkFn parent, BgForkFn child);
+
+/* start the thread if it isn't running yet, 'lock' is the owner's lock.  returns -1 if it can't be started. */
+L_LIB_API int bg_thread_ensure(BgThread *thread, pthread_mutex_t *lock);
+
+/* the thread doesn't exist in a forked child. */
+L_LIB_API void bg_thread_forked(BgThread *thread);
+
+#endif
+
+#endif /* __BG_THREAD_H__ */
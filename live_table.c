@@ -0,0 +1,394 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "live_table.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "wrap_mmap.h"
+
+/* pages per leaf of the radix table. */
+#define LIVE_LEAF_BITS 10
+#define LIVE_LEAF_SIZE ((size_t)1 << LIVE_LEAF_BITS)
+/* enough leaves to cover the low 4Gbytes with 4Kbyte pages. */
+#define LIVE_LEAVES_BITS (32 - 12 - LIVE_LEAF_BITS)
+#define LIVE_LEAVES ((size_t)1 << LIVE_LEAVES_BITS)
+
+/* a LiveBits set holds one bit per page of a leaf, or one bit per leaf. */
+#define LIVE_BITS_WORDS ((size_t)1 << (LIVE_LEAF_BITS - 6))
+#if (LIVE_LEAVES_BITS > LIVE_LEAF_BITS)
+#error "LiveBits is too small for the leaf index."
+#endif
+
+/* boundary tag layout. */
+#define LIVE_START        0x1
+#define LIVE_END          0x2
+#define LIVE_PROT_SHIFT   2
+#define LIVE_PROT_MASK    0x7
+#define LIVE_FLAGS_SHIFT  5
+#define LIVE_FLAGS_MASK   0x7FFFF
+#define LIVE_PAGES_SHIFT  32
+
+#define LIVE_TAG_PAGES(tag) ((size_t)((tag) >> LIVE_PAGES_SHIFT))
+
+#define NO_PAGE ((size_t)-1)
+
+/*
+ * bitmap with a summary word of the non-empty words, so the closest set bit is
+ * found with two bit scans.  A summary bit can only be clear while its word is
+ * being changed by another thread.
+ */
+typedef struct LiveBits {
+	uint64_t  summary;
+	uint64_t  word[LIVE_BITS_WORDS];
+} LiveBits;
+
+typedef struct LiveLeaf {
+	uint64_t  tag[LIVE_LEAF_SIZE];
+	LiveBits  tagged;  /* pages with a tag. */
+} LiveLeaf;
+
+static size_t live_page_shift = 12;
+
+static size_t live_bytes = 0;
+
+/* leaves are allocated on first use. */
+static LiveLeaf *live_leaf[LIVE_LEAVES];
+/* leaves with a tag. */
+static LiveBits live_tagged;
+
+static void live_bits_set(LiveBits *bits, size_t i) {
+	size_t w = i >> 6;
+	uint64_t sum_bit = (uint64_t)1 << w;
+
+	__atomic_fetch_or(&(bits->word[w]), (uint64_t)1 << (i & 63), __ATOMIC_SEQ_CST);
+	if(!(__atomic_load_n(&(bits->summary), __ATOMIC_SEQ_CST) & sum_bit)) {
+		__atomic_fetch_or(&(bits->summary), sum_bit, __ATOMIC_SEQ_CST);
+	}
+}
+
+/* returns 1 if the set is empty now. */
+static int live_bits_clear(LiveBits *bits, size_t i) {
+	size_t w = i >> 6;
+	uint64_t sum_bit = (uint64_t)1 << w;
+
+	if(__atomic_and_fetch(&(bits->word[w]), ~((uint64_t)1 << (i & 63)), __ATOMIC_SEQ_CST) != 0) return 0;
+	__atomic_fetch_and(&(bits->summary), ~sum_bit, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&(bits->word[w]), __ATOMIC_SEQ_CST) != 0) {
+		/* another thread set a bit in the word while it looked empty. */
+		__atomic_fetch_or(&(bits->summary), sum_bit, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+	return __atomic_load_n(&(bits->summary), __ATOMIC_SEQ_CST) == 0;
+}
+
+/* highest set bit below 'i', -1 if none. */
+static int live_bits_prev(LiveBits *bits, size_t i) {
+	size_t w = i >> 6;
+	uint64_t word;
+	uint64_t sum;
+
+	if(i & 63) {
+		word = __atomic_load_n(&(bits->word[w]), __ATOMIC_ACQUIRE) & (((uint64_t)1 << (i & 63)) - 1);
+		if(word != 0) return (int)((w << 6) + 63 - __builtin_clzll(word));
+	}
+	sum = __atomic_load_n(&(bits->summary), __ATOMIC_ACQUIRE) & (((uint64_t)1 << w) - 1);
+	while(sum != 0) {
+		w = 63 - __builtin_clzll(sum);
+		word = __atomic_load_n(&(bits->word[w]), __ATOMIC_ACQUIRE);
+		if(word != 0) return (int)((w << 6) + 63 - __builtin_clzll(word));
+		sum &= ~((uint64_t)1 << w);
+	}
+	return -1;
+}
+
+/* lowest set bit at or after 'i', -1 if none. */
+static int live_bits_next(LiveBits *bits, size_t i) {
+	size_t w = i >> 6;
+	uint64_t word;
+	uint64_t sum;
+
+	if(w >= LIVE_BITS_WORDS) return -1;
+	word = __atomic_load_n(&(bits->word[w]), __ATOMIC_ACQUIRE) & (~(uint64_t)0 << (i & 63));
+	if(word != 0) return (int)((w << 6) + __builtin_ctzll(word));
+	sum = __atomic_load_n(&(bits->summary), __ATOMIC_ACQUIRE) & (~(uint64_t)0 << (w + 1));
+	while(sum != 0) {
+		w = __builtin_ctzll(sum);
+		word = __atomic_load_n(&(bits->word[w]), __ATOMIC_ACQUIRE);
+		if(word != 0) return (int)((w << 6) + __builtin_ctzll(word));
+		sum &= sum - 1;
+	}
+	return -1;
+}
+
+static inline size_t live_page(uint8_t *addr) {
+	return (uintptr_t)addr >> live_page_shift;
+}
+
+static inline uint8_t *live_addr(size_t page) {
+	return (uint8_t *)(page << live_page_shift);
+}
+
+static LiveLeaf *live_get_leaf(size_t page, int create) {
+	size_t idx = page >> LIVE_LEAF_BITS;
+	LiveLeaf *leaf;
+	LiveLeaf *expect = NULL;
+
+	if(idx >= LIVE_LEAVES) return NULL;
+	leaf = __atomic_load_n(&(live_leaf[idx]), __ATOMIC_ACQUIRE);
+	if(leaf != NULL || !create) return leaf;
+	/* allocate leaf directly from the system, we can't call malloc from inside mmap. */
+	leaf = (LiveLeaf *)SYS_MMAP(NULL, sizeof(LiveLeaf), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(leaf == MAP_FAILED) return NULL;
+	if(!__atomic_compare_exchange_n(&(live_leaf[idx]), &expect, leaf, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		/* another thread added the leaf first. */
+		SYS_MUNMAP(leaf, sizeof(LiveLeaf));
+		leaf = expect;
+	}
+	return leaf;
+}
+
+static inline uint64_t live_get(size_t page) {
+	LiveLeaf *leaf = live_get_leaf(page, 0);
+	if(leaf == NULL) return 0;
+	return __atomic_load_n(leaf->tag + (page & (LIVE_LEAF_SIZE - 1)), __ATOMIC_RELAXED);
+}
+
+static inline void live_put(size_t page, uint64_t tag) {
+	LiveLeaf *leaf = live_get_leaf(page, tag != 0);
+	size_t idx = page >> LIVE_LEAF_BITS;
+	size_t off = page & (LIVE_LEAF_SIZE - 1);
+
+	if(leaf == NULL) return;
+	__atomic_store_n(leaf->tag + off, tag, __ATOMIC_RELAXED);
+	if(tag != 0) {
+		live_bits_set(&(leaf->tagged), off);
+		live_bits_set(&live_tagged, idx);
+	} else if(live_bits_clear(&(leaf->tagged), off)) {
+		live_bits_clear(&live_tagged, idx);
+		if(__atomic_load_n(&(leaf->tagged.summary), __ATOMIC_SEQ_CST) != 0) {
+			/* another thread tagged a page of the leaf while it looked empty. */
+			live_bits_set(&live_tagged, idx);
+		}
+	}
+}
+
+/* same protection and flags, different length. */
+static inline uint64_t live_retag(uint64_t tag, size_t pages) {
+	tag &= ((LIVE_FLAGS_MASK << LIVE_FLAGS_SHIFT) | (LIVE_PROT_MASK << LIVE_PROT_SHIFT));
+	return tag | ((uint64_t)pages << LIVE_PAGES_SHIFT);
+}
+
+static void live_set(size_t first, size_t pages, uint64_t tag) {
+	if(pages == 1) {
+		live_put(first, tag | LIVE_START | LIVE_END);
+		return;
+	}
+	live_put(first, tag | LIVE_START);
+	live_put(first + pages - 1, tag | LIVE_END);
+}
+
+static void live_clear(size_t first, size_t pages) {
+	live_put(first, 0);
+	live_put(first + pages - 1, 0);
+}
+
+static void live_decode(size_t first, uint64_t tag, LiveMap *map) {
+	map->addr = live_addr(first);
+	map->len = LIVE_TAG_PAGES(tag) << live_page_shift;
+	map->prot = (int)((tag >> LIVE_PROT_SHIFT) & LIVE_PROT_MASK);
+	map->flags = (int)((tag >> LIVE_FLAGS_SHIFT) & LIVE_FLAGS_MASK);
+}
+
+/* closest tagged page before 'page'. */
+static size_t live_prev_tag(size_t page) {
+	size_t idx = page >> LIVE_LEAF_BITS;
+	LiveLeaf *leaf;
+	int i;
+	int n;
+
+	if(idx >= LIVE_LEAVES) {
+		idx = LIVE_LEAVES;
+	} else if((leaf = live_get_leaf(page, 0)) != NULL) {
+		n = live_bits_prev(&(leaf->tagged), page & (LIVE_LEAF_SIZE - 1));
+		if(n >= 0) return (idx << LIVE_LEAF_BITS) + n;
+	}
+	for(i = live_bits_prev(&live_tagged, idx); i >= 0; i = live_bits_prev(&live_tagged, i)) {
+		leaf = __atomic_load_n(&(live_leaf[i]), __ATOMIC_ACQUIRE);
+		if(leaf == NULL) continue;
+		n = live_bits_prev(&(leaf->tagged), LIVE_LEAF_SIZE);
+		if(n >= 0) return ((size_t)i << LIVE_LEAF_BITS) + n;
+	}
+	return NO_PAGE;
+}
+
+/* first tagged page in [page, end). */
+static size_t live_next_tag(size_t page, size_t end) {
+	size_t idx = page >> LIVE_LEAF_BITS;
+	LiveLeaf *leaf;
+	size_t found;
+	int i;
+	int n;
+
+	if(page >= end || idx >= LIVE_LEAVES) return NO_PAGE;
+	if((leaf = live_get_leaf(page, 0)) != NULL) {
+		n = live_bits_next(&(leaf->tagged), page & (LIVE_LEAF_SIZE - 1));
+		if(n >= 0) {
+			found = (idx << LIVE_LEAF_BITS) + n;
+			return (found < end) ? found : NO_PAGE;
+		}
+	}
+	for(i = live_bits_next(&live_tagged, idx + 1); i >= 0; i = live_bits_next(&live_tagged, i + 1)) {
+		if(((size_t)i << LIVE_LEAF_BITS) >= end) break;
+		leaf = __atomic_load_n(&(live_leaf[i]), __ATOMIC_ACQUIRE);
+		if(leaf == NULL) continue;
+		n = live_bits_next(&(leaf->tagged), 0);
+		if(n >= 0) {
+			found = ((size_t)i << LIVE_LEAF_BITS) + n;
+			return (found < end) ? found : NO_PAGE;
+		}
+	}
+	return NO_PAGE;
+}
+
+/* find the first start tag in [page, end). */
+static size_t live_next_start(size_t page, size_t end) {
+	size_t next = live_next_tag(page, end);
+
+	/* at most one end tag, of a mapping that started before 'page', comes first. */
+	if(next != NO_PAGE && !(live_get(next) & LIVE_START)) {
+		next = live_next_tag(next + 1, end);
+	}
+	return next;
+}
+
+/* find the first page of the mapping around 'page'. */
+static size_t live_find_start(size_t page) {
+	uint64_t tag = live_get(page);
+	size_t first;
+
+	if(tag & LIVE_START) return page;
+	if(tag & LIVE_END) return page + 1 - LIVE_TAG_PAGES(tag);
+	/* the closest tag before 'page' is either the start of the mapping around it, or the end of another one. */
+	first = live_prev_tag(page);
+	if(first == NO_PAGE) return NO_PAGE;
+	tag = live_get(first);
+	if(!(tag & LIVE_START)) return NO_PAGE;
+	return ((first + LIVE_TAG_PAGES(tag)) > page) ? first : NO_PAGE;
+}
+
+void live_table_init(size_t page_size) {
+	live_page_shift = __builtin_ctzll(page_size);
+}
+
+void live_table_insert(uint8_t *addr, size_t len, int prot, int flags) {
+	size_t pages = len >> live_page_shift;
+	uint64_t tag;
+
+	if(pages == 0) return;
+	tag = ((uint64_t)pages << LIVE_PAGES_SHIFT) |
+		((uint64_t)(flags & LIVE_FLAGS_MASK) << LIVE_FLAGS_SHIFT) |
+		((uint64_t)(prot & LIVE_PROT_MASK) << LIVE_PROT_SHIFT);
+	live_set(live_page(addr), pages, tag);
+	__atomic_fetch_add(&live_bytes, len, __ATOMIC_RELAXED);
+}
+
+int live_table_lookup(uint8_t *addr, LiveMap *map) {
+	size_t page = live_page(addr);
+	uint64_t tag = live_get(page);
+
+	if(!(tag & LIVE_START)) return -1;
+	live_decode(page, tag, map);
+	return 0;
+}
+
+int live_table_prev(uint8_t *addr, LiveMap *map) {
+	size_t page = live_page(addr);
+	uint64_t tag;
+
+	if(page == 0) return -1;
+	tag = live_get(page - 1);
+	if(!(tag & LIVE_END)) return -1;
+	live_decode(page - LIVE_TAG_PAGES(tag), tag, map);
+	return 0;
+}
+
+int live_table_find(uint8_t *addr, LiveMap *map) {
+	size_t first = live_find_start(live_page(addr));
+
+	if(first == NO_PAGE) return -1;
+	live_decode(first, live_get(first), map);
+	return 0;
+}
+
+size_t live_table_remove(uint8_t *addr, size_t len, LiveRangeFn fn) {
+	size_t start = live_page(addr);
+	size_t end = start + (len >> live_page_shift);
+	size_t first;
+	size_t removed = 0;
+
+	first = live_find_start(start);
+	if(first == NO_PAGE) {
+		first = live_next_start(start, end);
+	}
+	while(first != NO_PAGE && first < end) {
+		uint64_t tag = live_get(first);
+		size_t last = first + LIVE_TAG_PAGES(tag);
+		size_t cut_start = (first > start) ? first : start;
+		size_t cut_end = (last < end) ? last : end;
+
+		live_clear(first, last - first);
+		if(first < cut_start) {
+			/* keep the head of the mapping. */
+			live_set(first, cut_start - first, live_retag(tag, cut_start - first));
+		}
+		if(cut_end < last) {
+			/* keep the tail of the mapping. */
+			live_set(cut_end, last - cut_end, live_retag(tag, last - cut_end));
+		}
+		removed += (cut_end - cut_start) << live_page_shift;
+		if(fn != NULL) {
+			fn(live_addr(cut_start), (cut_end - cut_start) << live_page_shift);
+		}
+		first = live_next_start(last, end);
+	}
+	__atomic_fetch_sub(&live_bytes, removed, __ATOMIC_RELAXED);
+	return removed;
+}
+
+size_t live_table_gaps(uint8_t *addr, size_t len, LiveGapFn fn, void *data) {
+	size_t page = live_page(addr);
+	size_t end = page + (len >> live_page_shift);
+	size_t first;
+	size_t gaps = 0;
+
+	first = live_find_start(page);
+	if(first == NO_PAGE) {
+		first = live_next_start(page, end);
+	}
+	while(page < end) {
+		size_t gap_end = (first == NO_PAGE) ? end : first;
+		if(gap_end > page) {
+			gaps += (gap_end - page) << live_page_shift;
+			if(fn != NULL) {
+				fn(data, live_addr(page), (gap_end - page) << live_page_shift);
+			}
+		}
+		if(first == NO_PAGE) break;
+		/* skip over the mapping. */
+		page = first + LIVE_TAG_PAGES(live_get(first));
+		first = live_next_start(page, end);
+	}
+	return gaps;
+}
+
+size_t live_table_bytes() {
+	return __atomic_load_n(&live_bytes, __ATOMIC_RELAXED);
+}
+
@@ -0,0 +1,62 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__LIVE_TABLE_H__)
+#define __LIVE_TABLE_H__
+
+#include "lcommon.h"
+
+#include <stddef.h>
+
+/*
+ * Table of live mappings in the low 4Gbytes.
+ *
+ * A radix table keyed by page number holds boundary tags: the first and last
+ * page of each mapping record its length, protection and flags.  Finding the
+ * mapping that starts at an address, or the mappings right before and after
+ * a range, is O(1).  A bitmap of the tagged pages in each leaf, and one of the
+ * leaves with tags, find the closest tag before or after any address with a
+ * few bit scans, so the mapping around an address in the middle of it, or the
+ * next mapping after a gap, is found without walking the pages in between.
+ *
+ * The allocator hands every range to only one thread, so the tags of a mapping
+ * are only written by the thread that owns it and the table needs no lock.
+ */
+typedef struct LiveMap {
+	uint8_t   *addr;
+	size_t    len;
+	int       prot;
+	int       flags;  /* mmap() flags, zero if unknown. */
+} LiveMap;
+
+/* called for each live part of a range that is removed. */
+typedef void (*LiveRangeFn)(uint8_t *addr, size_t len);
+
+L_LIB_API void live_table_init(size_t page_size);
+
+/* record a new mapping, any mappings it replaces must have been removed. */
+L_LIB_API void live_table_insert(uint8_t *addr, size_t len, int prot, int flags);
+
+/* find the mapping that starts at 'addr'. */
+L_LIB_API int live_table_lookup(uint8_t *addr, LiveMap *map);
+
+/* find the mapping that ends right before 'addr'. */
+L_LIB_API int live_table_prev(uint8_t *addr, LiveMap *map);
+
+/* find the mapping that contains 'addr'. */
+L_LIB_API int live_table_find(uint8_t *addr, LiveMap *map);
+
+/* remove a range, mappings that only partly overlap it are split.  Returns the live bytes removed. */
+L_LIB_API size_t live_table_remove(uint8_t *addr, size_t len, LiveRangeFn fn);
+
+/* called for each part of a range that no live mapping covers. */
+typedef void (*LiveGapFn)(void *data, uint8_t *addr, size_t len);
+
+/* call 'fn' (can be NULL) for each gap in a range, returns the bytes in gaps. */
+L_LIB_API size_t live_table_gaps(uint8_t *addr, size_t len, LiveGapFn fn, void *data);
+
+/* bytes in live mappings. */
+L_LIB_API size_t live_table_bytes();
+
+#endif /* __LIVE_TABLE_H__ */
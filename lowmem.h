@@ -0,0 +1,85 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__LOWMEM_H__)
+#define __LOWMEM_H__
+
+#include "lcommon.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Direct calls into the low region, for programs linked against the library.
+ *
+ * They skip the mmap/munmap/mremap hooks and their flag checks, but otherwise
+ * behave like the hooked calls: memory is private anonymous, stats, tracing,
+ * the span/retain caches and populate/prefault apply the same way.  Memory
+ * from lowmem_map() can be freed with munmap() and the other way around.
+ *
+ * The batch calls take the allocator lock once for the whole batch instead of
+ * once per range.
+ */
+
+typedef struct LowmemRange {
+	void      *addr;
+	size_t    len;
+} LowmemRange;
+
+/* returns NULL (and sets errno) if the low region is full or not in use. */
+L_LIB_API void *lowmem_map(size_t len, int prot);
+
+/* 'align' is a power of two, at least the page size. */
+L_LIB_API void *lowmem_map_aligned(size_t len, size_t align, int prot);
+
+/* 'flags' is 0 or MREMAP_MAYMOVE, returns NULL on failure. */
+L_LIB_API void *lowmem_remap(void *addr, size_t len, size_t new_len, int flags);
+
+L_LIB_API int lowmem_unmap(void *addr, size_t len);
+
+/* map every range's 'len' into its 'addr'.  all or nothing, returns -1 if any
+ * range can't be mapped. */
+L_LIB_API int lowmem_map_batch(LowmemRange *ranges, int count, int prot);
+
+/* returns -1 if any of the ranges isn't in the low region, the others are still unmapped. */
+L_LIB_API int lowmem_unmap_batch(LowmemRange *ranges, int count);
+
+/*
+ * malloc for small objects that must live in the low region.
+ *
+ * Requests up to 4Kbytes are rounded up to one of 28 size classes and carved
+ * from 64Kbyte slabs, each thread keeps a free list per class so most calls
+ * take no lock and make no syscall.  Objects freed by another thread join
+ * that thread's free list.  Slab pages stay mapped for reuse.  Larger
+ * requests get their own mapping, which free() unmaps.
+ *
+ * Memory is 16 byte aligned and only valid with these calls, not with libc's
+ * free()/realloc().  Pointers that didn't come from lowmem_malloc() are
+ * ignored by lowmem_free() and have a usable size of 0.
+ */
+L_LIB_API void *lowmem_malloc(size_t size);
+
+L_LIB_API void *lowmem_realloc(void *ptr, size_t size);
+
+L_LIB_API void lowmem_free(void *ptr);
+
+L_LIB_API size_t lowmem_malloc_usable_size(void *ptr);
+
+typedef struct LowmemMallocStats {
+	uint64_t  slabs;        /* slabs mapped for small objects. */
+	uint64_t  large;        /* live large allocations. */
+	uint64_t  large_bytes;  /* bytes mapped for them. */
+} LowmemMallocStats;
+
+L_LIB_API void lowmem_malloc_get_stats(LowmemMallocStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LOWMEM_H__ */
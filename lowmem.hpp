@@ -0,0 +1,112 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__LOWMEM_HPP__)
+#define __LOWMEM_HPP__
+
+#include "lowmem.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <stdexcept>
+
+/*
+ * C++ access to the low region, from liblowmem_cxx.so.
+ *
+ * lowmem::resource() is a std::pmr::memory_resource, small requests come from
+ * lowmem_malloc(), requests aligned to more than 16 bytes get their own
+ * aligned mapping.  lowmem::allocator<T> is the same memory for STL
+ * containers that don't use std::pmr.
+ *
+ * Anything allocated there has an address below 4Gbytes, so it can be stored
+ * in a lowmem::ptr32<T>: a 32-bit pointer that converts back to T* with a
+ * zero extension, no base to add.
+ */
+namespace lowmem {
+
+class memory_resource : public std::pmr::memory_resource {
+protected:
+	void *do_allocate(std::size_t bytes, std::size_t align) override;
+	void do_deallocate(void *p, std::size_t bytes, std::size_t align) override;
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+};
+
+/* the process-wide resource, never destroyed. */
+memory_resource *resource() noexcept;
+
+template<typename T>
+class ptr32 {
+public:
+	using element_type = T;
+
+	ptr32() noexcept : m_raw(0) { }
+	ptr32(std::nullptr_t) noexcept : m_raw(0) { }
+	/* throws std::out_of_range if 'p' isn't below 4Gbytes. */
+	ptr32(T *p) : m_raw(encode(p)) { }
+	template<typename U>
+	ptr32(const ptr32<U> &other) : m_raw(encode(static_cast<T *>(other.get()))) { }
+
+	static ptr32 from_raw(std::uint32_t raw) noexcept {
+		ptr32 p;
+		p.m_raw = raw;
+		return p;
+	}
+
+	std::uint32_t raw() const noexcept { return m_raw; }
+	T *get() const noexcept { return reinterpret_cast<T *>(static_cast<std::uintptr_t>(m_raw)); }
+
+	T &operator*() const noexcept { return *get(); }
+	T *operator->() const noexcept { return get(); }
+	T &operator[](std::size_t idx) const noexcept { return get()[idx]; }
+	explicit operator bool() const noexcept { return m_raw != 0; }
+
+	friend bool operator==(ptr32 a, ptr32 b) noexcept { return a.m_raw == b.m_raw; }
+	friend bool operator!=(ptr32 a, ptr32 b) noexcept { return a.m_raw != b.m_raw; }
+
+private:
+	static std::uint32_t encode(T *p) {
+		std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(p);
+		if(addr > std::numeric_limits<std::uint32_t>::max()) {
+			throw std::out_of_range("lowmem::ptr32: pointer is above 4Gbytes");
+		}
+		return static_cast<std::uint32_t>(addr);
+	}
+
+	std::uint32_t m_raw;
+};
+
+static_assert(sizeof(ptr32<int>) == 4, "ptr32 must be 32 bits");
+
+template<typename T>
+class allocator {
+public:
+	using value_type = T;
+
+	allocator() noexcept = default;
+	template<typename U>
+	allocator(const allocator<U> &) noexcept { }
+
+	T *allocate(std::size_t n) {
+		if(n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+			throw std::bad_array_new_length();
+		}
+		return static_cast<T *>(resource()->allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T *p, std::size_t n) noexcept {
+		resource()->deallocate(p, n * sizeof(T), alignof(T));
+	}
+
+	template<typename U>
+	bool operator==(const allocator<U> &) const noexcept { return true; }
+	template<typename U>
+	bool operator!=(const allocator<U> &) const noexcept { return false; }
+};
+
+} /* namespace lowmem */
+
+#endif /* __LOWMEM_HPP__ */
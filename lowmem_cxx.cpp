@@ -0,0 +1,49 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "lowmem.hpp"
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace lowmem {
+
+/* lowmem_malloc() only promises 16 byte alignment. */
+static const std::size_t MALLOC_ALIGN = 16;
+
+void *memory_resource::do_allocate(std::size_t bytes, std::size_t align) {
+	void *p;
+
+	if(align <= MALLOC_ALIGN) {
+		p = lowmem_malloc(bytes);
+	} else {
+		/* gets its own mapping, aligned to at least a page. */
+		std::size_t page_size = sysconf(_SC_PAGE_SIZE);
+		p = lowmem_map_aligned(bytes, (align < page_size) ? page_size : align, PROT_READ|PROT_WRITE);
+	}
+	if(p == NULL) throw std::bad_alloc();
+	return p;
+}
+
+void memory_resource::do_deallocate(void *p, std::size_t bytes, std::size_t align) {
+	if(align <= MALLOC_ALIGN) {
+		lowmem_free(p);
+	} else {
+		lowmem_unmap(p, bytes);
+	}
+}
+
+bool memory_resource::do_is_equal(const std::pmr::memory_resource &other) const noexcept {
+	/* every instance hands out the same memory. */
+	return dynamic_cast<const memory_resource *>(&other) != NULL;
+}
+
+memory_resource *resource() noexcept {
+	/* leaked on purpose, containers may still free into it from static destructors. */
+	static memory_resource *res = new memory_resource();
+	return res;
+}
+
+} /* namespace lowmem */
@@ -0,0 +1,368 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "lowmem.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef SUPPORT_THREADS
+#include <pthread.h>
+#endif
+
+#include "wrap_mmap.h"
+#include "live_table.h"
+
+#ifdef SUPPORT_THREADS
+#define CLASS_LOCK(cls) pthread_mutex_lock(&((cls)->lock))
+#define CLASS_UNLOCK(cls) pthread_mutex_unlock(&((cls)->lock))
+#else
+#define CLASS_LOCK(cls) do { } while(0)
+#define CLASS_UNLOCK(cls) do { } while(0)
+#endif
+
+/* slabs are aligned to their size, so an object's slab is found by masking its address. */
+#define SLAB_SIZE ((size_t)64 * 1024)
+/*
+ * header at the start of every slab and large allocation.  Large allocations are 64 byte
+ * aligned, small objects only as far as their class size allows, e.g. 32 bytes for the
+ * 160 byte class, never less than 16 bytes.
+ */
+#define SLAB_HEADER 64
+#define SLAB_MAGIC 0x4c4d4c53  /* "SLML" */
+
+/* 16 byte steps up to 128 bytes, then four classes per power of two up to 4Kbytes. */
+#define SMALL_CLASSES 8
+#define SMALL_STEP_SHIFT 4
+#define MALLOC_CLASSES (SMALL_CLASSES + 5 * 4)
+#define MALLOC_SMALL_MAX 4096
+/* Slab.cls of a large allocation. */
+#define LARGE_CLASS 0xFFFFFFFF
+
+/* objects moved between a thread cache and its class at a time. */
+#define BATCH_MIN 4
+#define BATCH_MAX 64
+
+typedef struct Slab {
+	uint32_t  magic;
+	uint32_t  cls;
+	size_t    len;    /* mapped bytes of a large allocation. */
+} Slab;
+
+typedef struct FreeObj FreeObj;
+
+struct FreeObj {
+	FreeObj   *next;
+};
+
+typedef struct MallocClass {
+#ifdef SUPPORT_THREADS
+	pthread_mutex_t lock;
+#endif
+	FreeObj   *free;      /* objects flushed from thread caches. */
+	uint8_t   *bump;      /* uncarved part of the newest slab. */
+	uint8_t   *bump_end;
+} __attribute__((aligned(64))) MallocClass;
+
+typedef struct CacheClass {
+	FreeObj   *head;
+	uint32_t  count;
+} CacheClass;
+
+typedef struct MallocCache {
+	CacheClass cls[MALLOC_CLASSES];
+} MallocCache;
+
+static MallocClass malloc_classes[MALLOC_CLASSES];
+
+static LowmemMallocStats malloc_stats;
+
+#ifdef SUPPORT_THREADS
+static pthread_once_t malloc_once = PTHREAD_ONCE_INIT;
+static pthread_key_t malloc_key;
+
+/* initial-exec, so looking up the cache never calls into the dynamic linker/malloc. */
+static __thread MallocCache *thread_mcache __attribute__((tls_model("initial-exec"))) = NULL;
+#else
+static MallocCache *thread_mcache = NULL;
+#endif
+
+static inline int malloc_class(size_t size) {
+	int shift;
+
+	if(size <= (SMALL_CLASSES << SMALL_STEP_SHIFT)) {
+		return (size == 0) ? 0 : (int)((size - 1) >> SMALL_STEP_SHIFT);
+	}
+	/* size is in (2^shift, 2^(shift + 1)]. */
+	shift = 63 - __builtin_clzll(size - 1);
+	return SMALL_CLASSES + (shift - 7) * 4 + (int)(((size - 1) - ((size_t)1 << shift)) >> (shift - 2));
+}
+
+static inline size_t malloc_class_size(int idx) {
+	int shift;
+
+	if(idx < SMALL_CLASSES) return (size_t)(idx + 1) << SMALL_STEP_SHIFT;
+	shift = 7 + (idx - SMALL_CLASSES) / 4;
+	return ((size_t)1 << shift) + (size_t)((idx - SMALL_CLASSES) % 4 + 1) * ((size_t)1 << (shift - 2));
+}
+
+static inline uint32_t malloc_batch(int idx) {
+	size_t count = (SLAB_SIZE - SLAB_HEADER) / malloc_class_size(idx) / 8;
+	if(count < BATCH_MIN) return BATCH_MIN;
+	if(count > BATCH_MAX) return BATCH_MAX;
+	return count;
+}
+
+static inline Slab *malloc_slab(void *ptr) {
+	return (Slab *)((uintptr_t)ptr & ~(SLAB_SIZE - 1));
+}
+
+/* the slab of a pointer we handed out, NULL for foreign pointers.  Only the live table is
+ * looked at until the slab is known to be mapped. */
+static inline Slab *malloc_owner(void *ptr) {
+	Slab *slab = malloc_slab(ptr);
+	LiveMap map;
+
+	if(live_table_lookup((uint8_t *)slab, &map) != 0 || !(map.prot & PROT_READ)) return NULL;
+	if(slab->magic != SLAB_MAGIC) return NULL;
+	return slab;
+}
+
+/* move 'count' objects from a thread cache back to their class. */
+static void malloc_flush(CacheClass *cc, int idx, uint32_t count) {
+	MallocClass *cls = malloc_classes + idx;
+	FreeObj *head = cc->head;
+	FreeObj *tail = head;
+	uint32_t n;
+
+	if(count == 0) return;
+	for(n = 1; n < count; n++) {
+		tail = tail->next;
+	}
+	cc->head = tail->next;
+	cc->count -= count;
+	CLASS_LOCK(cls);
+	tail->next = cls->free;
+	cls->free = head;
+	CLASS_UNLOCK(cls);
+}
+
+/* fill a thread cache with a batch of objects, from the class's free list or a slab. */
+static int malloc_refill(CacheClass *cc, int idx) {
+	MallocClass *cls = malloc_classes + idx;
+	size_t size = malloc_class_size(idx);
+	uint32_t batch = malloc_batch(idx);
+	FreeObj *head = NULL;
+	FreeObj *obj;
+	uint8_t *slab;
+	uint32_t n = 0;
+
+	CLASS_LOCK(cls);
+	while(n < batch && cls->free != NULL) {
+		obj = cls->free;
+		cls->free = obj->next;
+		obj->next = head;
+		head = obj;
+		n++;
+	}
+	while(n < batch) {
+		if((size_t)(cls->bump_end - cls->bump) < size) {
+			if(n > 0) break;
+			slab = (uint8_t *)lowmem_map_aligned(SLAB_SIZE, SLAB_SIZE, PROT_READ|PROT_WRITE);
+			if(slab == NULL) break;
+			((Slab *)slab)->magic = SLAB_MAGIC;
+			((Slab *)slab)->cls = idx;
+			((Slab *)slab)->len = SLAB_SIZE;
+			cls->bump = slab + SLAB_HEADER;
+			cls->bump_end = slab + SLAB_SIZE;
+			__atomic_fetch_add(&malloc_stats.slabs, 1, __ATOMIC_RELAXED);
+		}
+		obj = (FreeObj *)cls->bump;
+		cls->bump += size;
+		obj->next = head;
+		head = obj;
+		n++;
+	}
+	CLASS_UNLOCK(cls);
+	cc->head = head;
+	cc->count = n;
+	return n;
+}
+
+#ifdef SUPPORT_THREADS
+static void malloc_cache_destroy(void *data) {
+	MallocCache *cache = (MallocCache *)data;
+	int i;
+
+	for(i = 0; i < MALLOC_CLASSES; i++) {
+		malloc_flush(cache->cls + i, i, cache->cls[i].count);
+	}
+	thread_mcache = NULL;
+	SYS_MUNMAP(cache, sizeof(MallocCache));
+}
+
+static void malloc_init() {
+	int i;
+
+	for(i = 0; i < MALLOC_CLASSES; i++) {
+		pthread_mutex_init(&(malloc_classes[i].lock), NULL);
+	}
+	pthread_key_create(&malloc_key, malloc_cache_destroy);
+}
+#endif
+
+static MallocCache *malloc_cache_new() {
+	MallocCache *cache;
+
+	/* might be called before any hook has looked up the system calls. */
+	wrap_mmap_init();
+	/* the hooked mmap must not be re-entered for our own bookkeeping. */
+	cache = (MallocCache *)SYS_MMAP(NULL, sizeof(MallocCache), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(cache == MAP_FAILED) return NULL;
+#ifdef SUPPORT_THREADS
+	pthread_once(&malloc_once, malloc_init);
+	pthread_setspecific(malloc_key, cache);
+#endif
+	thread_mcache = cache;
+	return cache;
+}
+
+static void *malloc_large(size_t size) {
+	size_t len = size + SLAB_HEADER;
+	Slab *slab;
+
+	if(len < size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	slab = (Slab *)lowmem_map_aligned(len, SLAB_SIZE, PROT_READ|PROT_WRITE);
+	if(slab == NULL) return NULL;
+	slab->magic = SLAB_MAGIC;
+	slab->cls = LARGE_CLASS;
+	slab->len = len;
+	__atomic_fetch_add(&malloc_stats.large, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&malloc_stats.large_bytes, len, __ATOMIC_RELAXED);
+	return (uint8_t *)slab + SLAB_HEADER;
+}
+
+void *lowmem_malloc(size_t size) {
+	MallocCache *cache;
+	CacheClass *cc;
+	FreeObj *obj;
+	int idx;
+
+	if(size > MALLOC_SMALL_MAX) return malloc_large(size);
+	cache = thread_mcache;
+	if(L_UNLIKELY(cache == NULL)) {
+		cache = malloc_cache_new();
+		if(cache == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	idx = malloc_class(size);
+	cc = cache->cls + idx;
+	if(L_UNLIKELY(cc->head == NULL) && malloc_refill(cc, idx) == 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	obj = cc->head;
+	cc->head = obj->next;
+	cc->count--;
+	return obj;
+}
+
+void lowmem_free(void *ptr) {
+	MallocCache *cache;
+	CacheClass *cc;
+	FreeObj *obj;
+	Slab *slab;
+	uint32_t batch;
+
+	if(ptr == NULL) return;
+	slab = malloc_owner(ptr);
+	if(L_UNLIKELY(slab == NULL)) return;  /* not ours. */
+	if(slab->cls == LARGE_CLASS) {
+		__atomic_fetch_sub(&malloc_stats.large, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&malloc_stats.large_bytes, slab->len, __ATOMIC_RELAXED);
+		lowmem_unmap(slab, slab->len);
+		return;
+	}
+	cache = thread_mcache;
+	if(L_UNLIKELY(cache == NULL)) {
+		cache = malloc_cache_new();
+		if(cache == NULL) {
+			/* no cache for this thread, hand the object straight back to its class. */
+			CacheClass one = { (FreeObj *)ptr, 1 };
+			((FreeObj *)ptr)->next = NULL;
+			malloc_flush(&one, slab->cls, 1);
+			return;
+		}
+	}
+	/* objects freed by another thread move to this thread's cache. */
+	cc = cache->cls + slab->cls;
+	obj = (FreeObj *)ptr;
+	obj->next = cc->head;
+	cc->head = obj;
+	cc->count++;
+	batch = malloc_batch(slab->cls);
+	if(L_UNLIKELY(cc->count >= 2 * batch)) {
+		malloc_flush(cc, slab->cls, batch);
+	}
+}
+
+size_t lowmem_malloc_usable_size(void *ptr) {
+	Slab *slab;
+
+	if(ptr == NULL) return 0;
+	slab = malloc_owner(ptr);
+	if(slab == NULL) return 0;
+	if(slab->cls == LARGE_CLASS) return slab->len - SLAB_HEADER;
+	return malloc_class_size(slab->cls);
+}
+
+void *lowmem_realloc(void *ptr, size_t size) {
+	size_t old_size;
+	Slab *slab;
+	void *mem;
+
+	if(ptr == NULL) return lowmem_malloc(size);
+	if(size == 0) {
+		lowmem_free(ptr);
+		return NULL;
+	}
+	old_size = lowmem_malloc_usable_size(ptr);
+	if(old_size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	slab = malloc_slab(ptr);
+	if(slab->cls == LARGE_CLASS) {
+		if(size > MALLOC_SMALL_MAX && (size + SLAB_HEADER) > size) {
+			/* resize in-place, moving would lose the slab alignment. */
+			if(lowmem_remap(slab, slab->len, size + SLAB_HEADER, 0) != NULL) {
+				__atomic_fetch_add(&malloc_stats.large_bytes, (size + SLAB_HEADER) - slab->len, __ATOMIC_RELAXED);
+				slab->len = size + SLAB_HEADER;
+				return ptr;
+			}
+		}
+	} else if(size <= old_size && malloc_class(size) == (int)slab->cls) {
+		return ptr;
+	}
+	mem = lowmem_malloc(size);
+	if(mem == NULL) return NULL;
+	memcpy(mem, ptr, (size < old_size) ? size : old_size);
+	lowmem_free(ptr);
+	return mem;
+}
+
+void lowmem_malloc_get_stats(LowmemMallocStats *stats) {
+	stats->slabs = __atomic_load_n(&malloc_stats.slabs, __ATOMIC_RELAXED);
+	stats->large = __atomic_load_n(&malloc_stats.large, __ATOMIC_RELAXED);
+	stats->large_bytes = __atomic_load_n(&malloc_stats.large_bytes, __ATOMIC_RELAXED);
+}
@@ -14,27 +14,34 @@
 #include <sys/mman.h>
 
 #include <stdarg.h>
-
-#ifdef SUPPORT_THREADS
-#include <pthread.h>
-
-static pthread_mutex_t page_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
-#define PAGE_LOCK() pthread_mutex_lock(&(page_alloc_lock))
-#define PAGE_UNLOCK() pthread_mutex_unlock(&(page_alloc_lock))
-#else
-#define PAGE_LOCK() do { } while(0)
-#define PAGE_UNLOCK() do { } while(0)
-#endif
+#include <signal.h>
+#include <string.h>
 
 #include "wrap_mmap.h"
 
 #include "page_alloc.h"
+#include "page_slab.h"
+#include "span_cache.h"
+#include "retain_cache.h"
+#include "reclaim.h"
+#include "prefault.h"
+#include "live_table.h"
+#include "stats.h"
+#include "stats_page.h"
+#include "trace.h"
+#include "probes.h"
+#include "arena.h"
+#include "proc_maps.h"
+#include "window.h"
+#include "lowmem.h"
 
 #define KBYTE (size_t)1024
 #define MBYTE (KBYTE * 1024)
 #define GBYTE (MBYTE * 1024)
 
-#define ENABLE_VERBOSE 1
+#ifndef ENABLE_VERBOSE
+#define ENABLE_VERBOSE 0
+#endif
 
 #if (ENABLE_VERBOSE != 1)
 #define printf(...)
@@ -45,6 +52,38 @@ static pthread_mutex_t page_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
 #define REGION_CHECK(addr) \
 	(((uint8_t *)(addr) >= region_start) && ((uint8_t *)(addr) < LOW_4G))
 
+/* range the high cursor moves through, see MMAP_LOWMEM_HIGH. */
+#define HIGH_START ((uintptr_t)LOW_4G)
+#define HIGH_END ((uintptr_t)1 << 46)
+
+/* transparent huge page size. */
+#define HUGE_PAGE_SIZE (2 * MBYTE)
+
+/* default size at which anonymous mappings are huge-page aligned, off unless asked for. */
+#define THP_THRESHOLD 0
+
+/* default per-thread span cache size. */
+#define SPAN_CACHE_BYTES (16 * MBYTE)
+
+/* default time unused spans are retained, in ms. */
+#define RETAIN_DECAY 1000
+
+/* default bytes queued before the reclaim thread is woken early. */
+#define RECLAIM_BATCH (4 * MBYTE)
+
+/* default bytes the prefault thread populates at a time. */
+#define PREFAULT_CHUNK HUGE_PAGE_SIZE
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* default milliseconds between shared memory stats updates. */
+#define STATS_INTERVAL 1000
+
+/* ranges the batch calls handle per allocator lock. */
+#define LOWMEM_BATCH 64
+
 static void *lowmem_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 static void *lowmem_mmap64(void *addr, size_t length, int prot, int flags, int fd, off64_t offset);
 static void *lowmem_mremap2(void *old_addr, size_t old_size, size_t new_size, int flags, void *new_addr);
@@ -57,32 +96,350 @@ static WrapMMAP lowmem_wrap_mmap = {
 	lowmem_munmap,
 };
 
-static long sys_pagesize = 4096;
-
 /* managed region. */
 static uint8_t *region_start = NULL;
 
-static PageAlloc *palloc = NULL;
+static ArenaSet *arenas = NULL;
+
+/* the whole region is reserved with PROT_NONE placeholder pages. */
+static int region_reserved = 0;
+
+/* anonymous mappings at least this large are huge-page aligned, zero disables. */
+static size_t thp_threshold = THP_THRESHOLD;
+
+/* try MAP_HUGETLB for huge-page aligned mappings. */
+static int thp_hugetlb = 0;
+
+/* huge-page aligned mappings, and how many bytes of them can be backed by huge pages. */
+static uint64_t thp_maps = 0;
+static uint64_t thp_bytes = 0;
+
+/* writable anonymous mappings at least this large are populated by mmap, zero disables. */
+static size_t populate_threshold = 0;
+
+/* populate with MADV_POPULATE_WRITE after the mmap, instead of MAP_POPULATE. */
+static int populate_madvise = 0;
+
+/* writable anonymous mappings at least this large are prefaulted in the background, zero disables. */
+static size_t prefault_threshold = 0;
+
+/* mappings populated by mmap, and their bytes. */
+static uint64_t populate_maps = 0;
+static uint64_t populate_bytes = 0;
+
+/* steer hint-less mappings without MAP_32BIT above the low region. */
+static int high_steer = 0;
+
+/* where the next steered mapping is tried. */
+static uintptr_t high_cursor = HIGH_START;
+
+/* MMAP_LOWMEM_WINDOWS set up at least one extra window. */
+static int windows_enabled = 0;
+
+/* set by the stats signal, the next hook call writes the stats. */
+static int stats_dump_pending = 0;
+
+/* set when the stats are published to shared memory. */
+static int stats_publish = 0;
+
+/* set when low region calls are recorded to a trace file. */
+static int trace_enabled = 0;
+
+#define STATS_POLL() do { \
+	if(L_UNLIKELY(__atomic_load_n(&stats_dump_pending, __ATOMIC_RELAXED))) stats_poll(); \
+	if(stats_publish) stats_page_tick(); \
+} while(0)
 
 #define M_FLAGS (MAP_PRIVATE|MAP_ANONYMOUS)
 
+int mmap_lowmem_get_stats(LowmemStats *stats) {
+	PageAllocStats free;
+
+	memset(stats, 0, sizeof(LowmemStats));
+	stats_get_ops(stats->op);
+	if(arenas == NULL) return -1;
+	arena_get_stats(arenas, &free);
+	stats->region_bytes = LOW_4G - region_start;
+	stats->mapped_bytes = live_table_bytes();
+	stats->reserved_bytes = stats->region_bytes - free.free_bytes;
+	stats->free_bytes = free.free_bytes;
+	stats->free_segs = free.free_segs;
+	stats->largest_free = free.largest_free;
+	return 0;
+}
+
+static void stats_write(int fd, const char *buf, int len) {
+	while(len > 0) {
+		ssize_t rc = write(fd, buf, len);
+		if(rc <= 0) {
+			if(rc < 0 && errno == EINTR) continue;
+			return;
+		}
+		buf += rc;
+		len -= rc;
+	}
+}
+
+void mmap_lowmem_dump_stats(int fd) {
+	LowmemMallocStats lmalloc;
+	RetainCacheStats retain;
+	LowmemStats stats;
+	char buf[1024];
+	int len;
+	int op;
+
+	mmap_lowmem_get_stats(&stats);
+	len = snprintf(buf, sizeof(buf),
+		"mmap_lowmem: region=%zu, mapped=%zu, reserved=%zu, free=%zu, free_segs=%zu, largest_free=%zu, frag=%.3f\n",
+		stats.region_bytes, stats.mapped_bytes, stats.reserved_bytes, stats.free_bytes,
+		stats.free_segs, stats.largest_free, page_alloc_fragmentation(stats.largest_free, stats.free_bytes));
+	stats_write(fd, buf, len);
+	for(op = 0; op < STATS_OPS; op++) {
+		len = stats_format_op(buf, sizeof(buf), stats_op_name(op), stats.op + op);
+		stats_write(fd, buf, len);
+	}
+#ifdef SUPPORT_THREADS
+	SpanCacheStats span;
+	ReclaimStats reclaim;
+	PrefaultStats prefault;
+	span_cache_get_stats(&span);
+	len = snprintf(buf, sizeof(buf),
+		"span_cache: ops=%llu, lock_acquires=%llu, hits=%llu, flushes=%llu\n",
+		(unsigned long long)span.ops, (unsigned long long)span.lock_acquires,
+		(unsigned long long)span.hits, (unsigned long long)span.flushes);
+	stats_write(fd, buf, len);
+	reclaim_get_stats(&reclaim);
+	len = snprintf(buf, sizeof(buf),
+		"reclaim: queued=%llu, batches=%llu, unmaps=%llu, bytes=%llu\n",
+		(unsigned long long)reclaim.queued, (unsigned long long)reclaim.batches,
+		(unsigned long long)reclaim.unmaps, (unsigned long long)reclaim.bytes);
+	stats_write(fd, buf, len);
+	prefault_get_stats(&prefault);
+	len = snprintf(buf, sizeof(buf),
+		"prefault: queued=%llu, cancelled=%llu, bytes=%llu\n",
+		(unsigned long long)prefault.queued, (unsigned long long)prefault.cancelled,
+		(unsigned long long)prefault.bytes);
+	stats_write(fd, buf, len);
+#endif
+	retain_cache_get_stats(&retain);
+	len = snprintf(buf, sizeof(buf),
+		"retain: retained=%llu, hits=%llu, evictions=%llu, bytes=%zu\n",
+		(unsigned long long)retain.retained, (unsigned long long)retain.hits,
+		(unsigned long long)retain.evictions, retain.bytes);
+	stats_write(fd, buf, len);
+	len = snprintf(buf, sizeof(buf), "thp: maps=%llu, bytes=%llu\n",
+		(unsigned long long)thp_maps, (unsigned long long)thp_bytes);
+	stats_write(fd, buf, len);
+	len = snprintf(buf, sizeof(buf), "populate: maps=%llu, bytes=%llu\n",
+		(unsigned long long)populate_maps, (unsigned long long)populate_bytes);
+	stats_write(fd, buf, len);
+	lowmem_malloc_get_stats(&lmalloc);
+	len = snprintf(buf, sizeof(buf), "lowmem_malloc: slabs=%llu, large=%llu, large_bytes=%llu\n",
+		(unsigned long long)lmalloc.slabs, (unsigned long long)lmalloc.large,
+		(unsigned long long)lmalloc.large_bytes);
+	stats_write(fd, buf, len);
+	for(op = 0; op < window_count(); op++) {
+		Window *w = window_get(op);
+		PageAllocStats pstats;
+		uint8_t *start;
+		uint8_t *end;
+		window_get_stats(w, &start, &end, &pstats);
+		len = snprintf(buf, sizeof(buf),
+			"window %s: start=%p, len=%zu, free=%zu, free_segs=%zu, largest_free=%zu, frag=%.3f\n",
+			window_name(w), start, (size_t)(end - start), pstats.free_bytes, pstats.free_segs,
+			pstats.largest_free, page_alloc_fragmentation(pstats.largest_free, pstats.free_bytes));
+		stats_write(fd, buf, len);
+	}
+}
+
+static void stats_poll() {
+	if(__atomic_exchange_n(&stats_dump_pending, 0, __ATOMIC_RELAXED)) {
+		mmap_lowmem_dump_stats(STDERR_FILENO);
+	}
+}
+
+static int stats_signal = 0;
+
+/* only flag the request, the stats are written outside of the signal handler. */
+static void stats_signal_handler(int sig) {
+	__atomic_store_n(&stats_dump_pending, 1, __ATOMIC_RELAXED);
+}
+
+static void dump_stats_at_exit() {
+	mmap_lowmem_dump_stats(STDERR_FILENO);
+}
+
+#if (STATS_PAGE_CELLS != ARENA_FREE_CELLS)
+#error "the stats page and the arenas must use the same free-space map."
+#endif
+
+/*
+ * runs from a hook call, so nothing here walks the free space: the arenas count
+ * the free bytes of each map cell as segments are taken and released.
+ */
+static void stats_page_fill(StatsPage *page) {
+	uint64_t cell_free[ARENA_FREE_CELLS];
+	PageAllocStats free;
+	size_t cell_bytes;
+	int i;
+
+	memset(&(page->stats), 0, sizeof(LowmemStats));
+	stats_get_ops(page->stats.op);
+	if(arenas == NULL) return;
+	arena_get_summary(arenas, &free);
+	page->stats.region_bytes = LOW_4G - region_start;
+	page->stats.mapped_bytes = live_table_bytes();
+	page->stats.reserved_bytes = page->stats.region_bytes - free.free_bytes;
+	page->stats.free_bytes = free.free_bytes;
+	page->stats.free_segs = free.free_segs;
+	page->stats.largest_free = free.largest_free;
+	cell_bytes = arena_free_map(arenas, cell_free);
+	page->region_start = (uintptr_t)region_start;
+	page->cell_bytes = cell_bytes;
+	for(i = 0; i < STATS_PAGE_CELLS; i++) {
+		page->free_map[i] = (cell_free[i] * 255) / cell_bytes;
+	}
+}
+
 #if ENABLE_VERBOSE
 static void dump_stats() {
-	if(palloc) {
-		page_alloc_dump_stats(palloc);
-		getc(stdin);
+	if(arenas) {
+		fflush(stdout);
+		mmap_lowmem_dump_stats(STDOUT_FILENO);
+		arena_dump_stats(arenas);
 	}
 }
 #endif
 
+/* parse a byte size with an optional K/M/G suffix from the environment. */
+static size_t env_size(const char *name, size_t def) {
+	const char *val = getenv(name);
+	char *end;
+	size_t size;
+
+	if(val == NULL || *val == '\0') return def;
+	size = strtoull(val, &end, 0);
+	switch(*end) {
+	case 'g': case 'G': size *= GBYTE; break;
+	case 'm': case 'M': size *= MBYTE; break;
+	case 'k': case 'K': size *= KBYTE; break;
+	}
+	return size;
+}
+
+/* map PROT_NONE placeholder pages over a low-region range. */
+static int lowmem_placeholder(uint8_t *addr, size_t len, int replace) {
+	int flags = M_FLAGS | MAP_NORESERVE | (replace ? MAP_FIXED : MAP_FIXED_NOREPLACE);
+	void *mem = SYS_MMAP(addr, len, PROT_NONE, flags, -1, 0);
+	if(mem == addr) return 0;
+	if(mem != MAP_FAILED) {
+		/* older kernels treat MAP_FIXED_NOREPLACE as a hint. */
+		SYS_MUNMAP(mem, len);
+	}
+	return -1;
+}
+
+/* drop the pages mapped in a low-region range. */
+static int lowmem_discard(uint8_t *addr, size_t len) {
+	if(region_reserved) {
+		/* replace the mapping with placeholder pages, the range never becomes a hole. */
+		return lowmem_placeholder(addr, len, 1);
+	}
+	return SYS_MUNMAP(addr, len);
+}
+
+/* put placeholder pages back over a low-region range the kernel has unmapped. */
+static int lowmem_refill(uint8_t *addr, size_t len) {
+	if(region_reserved) {
+		return lowmem_placeholder(addr, len, 0);
+	}
+	return 0;
+}
+
+/* keep a mapping we didn't make reserved. */
+static void seed_foreign(void *data, uint8_t *start, uint8_t *end) {
+	arena_reserve_segment(arenas, start, end - start);
+}
+
+/* 'next' is the end of the last mapping seen. */
+static void refresh_foreign(void *data, uint8_t *start, uint8_t *end) {
+	uint8_t **next = (uint8_t **)data;
+	if(start > *next) {
+		/* nothing is mapped in the gap before this mapping. */
+		arena_release_segment(arenas, *next, start - *next);
+	}
+	*next = end;
+}
+
+/* something we didn't map is inside the reserved range 'seg', keep only that part reserved. */
+static void lowmem_refresh(uint8_t *seg, size_t len) {
+	uint8_t *next = seg;
+
+	if(proc_maps_walk(seg, seg + len, refresh_foreign, &next) != 0) {
+		/* can't tell what is mapped, keep the whole range. */
+		return;
+	}
+	if(next < (seg + len)) {
+		arena_release_segment(arenas, next, (seg + len) - next);
+	}
+}
+
+typedef struct ReserveHoles {
+	int  placed;
+	int  failed;
+} ReserveHoles;
+
+static void reserve_hole(void *data, uint8_t *addr, size_t len) {
+	ReserveHoles *r = (ReserveHoles *)data;
+	if(r->failed) return;
+	if(lowmem_placeholder(addr, len, 0) != 0) {
+		r->failed = 1;
+		return;
+	}
+	r->placed++;
+}
+
+static void unreserve_hole(void *data, uint8_t *addr, size_t len) {
+	ReserveHoles *r = (ReserveHoles *)data;
+	if(r->placed <= 0) return;
+	SYS_MUNMAP(addr, len);
+	r->placed--;
+}
+
+/* map placeholder pages over every free hole, all or nothing. */
+static int lowmem_reserve_holes() {
+	ReserveHoles r = { 0, 0 };
+
+	arena_walk_free(arenas, reserve_hole, &r);
+	if(!r.failed) return 0;
+	/* the holes are walked in the same order. */
+	arena_walk_free(arenas, unreserve_hole, &r);
+	return -1;
+}
+
+/* release a batch of spans from a thread's span cache. */
+static void flush_spans(Span *spans, int count) {
+	arena_release_spans(arenas, spans, count);
+}
+
+/* unmap a range held by the retain cache or reclaim queue, and release it. */
+static void discard_release(uint8_t *addr, size_t len) {
+	if(lowmem_discard(addr, len) == 0) {
+		arena_release_segment(arenas, addr, len);
+	}
+}
+
 WrapMMAP *init_lowmem_mmap() {
+	PageAllocEngine engine;
+	size_t split;
+	const char *shm_name;
+	const char *trace_path;
 	uint8_t *start;
+	int count = 1;
 
 #if ENABLE_VERBOSE
 	atexit(dump_stats);
 #endif
-	sys_pagesize = sysconf(_SC_PAGE_SIZE);
-
 	/* find the end of the bss/brk segment (and make sure it is page-aligned). */
 	region_start = ((uint8_t *)(((ptrdiff_t)sbrk(0)) & ~(sys_pagesize - 1)) + sys_pagesize);
 	/* check if brk is inside the low 4Gbytes. */
@@ -109,94 +466,887 @@ WrapMMAP *init_lowmem_mmap() {
 	/* keep one guard page between region_start and end of bss/brk. */
 	start += sys_pagesize;
 	region_start = start;
-	palloc = page_alloc_new(region_start, LOW_4G - region_start);
+	/* select page allocator engine. */
+	engine = page_alloc_engine_by_name(getenv("MMAP_LOWMEM_ENGINE"), PAGE_ALLOC_DEFAULT_ENGINE);
+#ifdef SUPPORT_THREADS
+	/* one arena per cpu by default. */
+	count = env_size("MMAP_LOWMEM_ARENAS", sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+	/* allocator metadata must not come from the hooked mmap. */
+	page_slab_set_system(system_mmap.mmap, system_mmap.munmap);
+	arenas = arena_set_new(engine, region_start, LOW_4G - region_start, sys_pagesize, count);
+	if(arenas == NULL) {
+		region_start = NULL;
+		return NULL;
+	}
+	/* only the holes between existing mappings (libraries, vdso, earlier mmaps) are free. */
+	proc_maps_walk(region_start, LOW_4G, seed_foreign, NULL);
+	if(env_size("MMAP_LOWMEM_RESERVE", 0)) {
+		/* reserve the rest of the region, so nothing else can be mapped inside it. */
+		if(lowmem_reserve_holes() == 0) {
+			region_reserved = 1;
+		}
+#if ENABLE_VERBOSE
+		else {
+			printf("--- failed to reserve low-mem, falling back to address hints.\n");
+		}
+#endif
+	}
+	high_steer = env_size("MMAP_LOWMEM_HIGH", 0);
+	windows_enabled = (window_init(getenv("MMAP_LOWMEM_WINDOWS"), engine, region_start, LOW_4G) > 0);
+	split = env_size("MMAP_LOWMEM_SPLIT", 0);
+	if(split > 0) {
+		arena_set_split(arenas, split);
+		window_set_split(split);
+	}
+	thp_threshold = env_size("MMAP_LOWMEM_THP_THRESHOLD", THP_THRESHOLD);
+	thp_hugetlb = env_size("MMAP_LOWMEM_HUGETLB", 0);
+	populate_threshold = env_size("MMAP_LOWMEM_POPULATE", 0);
+	populate_madvise = env_size("MMAP_LOWMEM_POPULATE_MADVISE", 0);
+	prefault_threshold = env_size("MMAP_LOWMEM_PREFAULT", 0);
+	if(prefault_threshold > 0) {
+		prefault_init(PAGE_ALIGN(env_size("MMAP_LOWMEM_PREFAULT_CHUNK", PREFAULT_CHUNK)));
+	}
+	live_table_init(sys_pagesize);
+	span_cache_init(flush_spans, sys_pagesize, env_size("MMAP_LOWMEM_SPAN_CACHE", SPAN_CACHE_BYTES));
+	retain_cache_init(discard_release, sys_pagesize, env_size("MMAP_LOWMEM_RETAIN", 0),
+		env_size("MMAP_LOWMEM_RETAIN_DECAY", RETAIN_DECAY), env_size("MMAP_LOWMEM_RETAIN_LAZY", 0));
+	/* MMAP_LOWMEM_RECLAIM is the delay in ms before queued ranges are unmapped, zero disables. */
+	reclaim_init(discard_release, env_size("MMAP_LOWMEM_RECLAIM", 0),
+		env_size("MMAP_LOWMEM_RECLAIM_BATCH", RECLAIM_BATCH));
 #if ENABLE_VERBOSE
 	printf("--- got low-mem: len=0x%zx, start=%p, end=%p\n",
 		(LOW_4G - region_start), region_start, LOW_4G);
-	getc(stdin);
 #endif
+	if(env_size("MMAP_LOWMEM_STATS", 0)) {
+		atexit(dump_stats_at_exit);
+	}
+	stats_signal = env_size("MMAP_LOWMEM_STATS_SIGNAL", 0);
+	if(stats_signal > 0) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = stats_signal_handler;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(stats_signal, &sa, NULL);
+	}
+	/* MMAP_LOWMEM_STATS_SHM is the shared memory name, e.g. "/lowmem.<pid>". */
+	shm_name = getenv("MMAP_LOWMEM_STATS_SHM");
+	if(shm_name != NULL && *shm_name != '\0' &&
+			stats_page_init(shm_name, env_size("MMAP_LOWMEM_STATS_INTERVAL", STATS_INTERVAL),
+				stats_page_fill) == 0) {
+		stats_publish = 1;
+		atexit(stats_page_close);
+	}
+	/* MMAP_LOWMEM_TRACE is the file low region calls are recorded to. */
+	trace_path = getenv("MMAP_LOWMEM_TRACE");
+	if(trace_path != NULL && *trace_path != '\0' &&
+			trace_init(trace_path, sys_pagesize, region_start, LOW_4G - region_start) == 0) {
+		trace_enabled = 1;
+		atexit(trace_flush);
+	}
 	return &(lowmem_wrap_mmap);
 }
 
+/* reserve space in the low region. */
+static uint8_t *lowmem_get_segment(uint8_t *addr, size_t len) {
+	uint8_t *mem = NULL;
+	if(addr == NULL) {
+		/* try this thread's cache of freed spans first. */
+		mem = span_cache_get(len);
+		if(mem != NULL) return mem;
+	}
+	mem = arena_get_segment(arenas, addr, len);
+	if(mem == NULL && (span_cache_flush() + retain_cache_flush() + reclaim_flush()) > 0) {
+		/* low region is full, retry after returning cached spans. */
+		mem = arena_get_segment(arenas, addr, len);
+	}
+	if(mem == NULL) errno = ENOMEM;
+	return mem;
+}
+
+/* reserve huge-page aligned space in the low region. */
+static uint8_t *lowmem_get_aligned(size_t len) {
+	uint8_t *mem;
+	/* cached spans this large were most likely allocated aligned. */
+	mem = span_cache_get(len);
+	if(mem != NULL) return mem;
+	mem = arena_get_aligned_segment(arenas, len, HUGE_PAGE_SIZE);
+	if(mem != NULL) return mem;
+	/* fall back to unaligned space. */
+	return lowmem_get_segment(NULL, len);
+}
+
+static uint8_t *place_segment(void *data, uint8_t *addr, size_t len) {
+	return lowmem_get_segment(addr, len);
+}
+
+static uint8_t *place_aligned(void *data, uint8_t *addr, size_t len) {
+	return lowmem_get_aligned(len);
+}
+
+static void place_refresh(void *data, uint8_t *seg, size_t len) {
+	lowmem_refresh(seg, len);
+}
+
+static MapPlacer lowmem_placer = { place_segment, place_refresh, NULL };
+static MapPlacer lowmem_huge_placer = { place_aligned, place_refresh, NULL };
+
+/* ask for huge pages and count how much of the mapping can use them. */
+static void lowmem_advise_huge(uint8_t *mem, size_t len) {
+	uintptr_t start = ((uintptr_t)mem + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	uintptr_t end = ((uintptr_t)mem + len) & ~(HUGE_PAGE_SIZE - 1);
+
+	if(end <= start) return;
+	if(madvise(mem, len, MADV_HUGEPAGE) != 0) return;
+	__atomic_fetch_add(&thp_maps, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&thp_bytes, end - start, __ATOMIC_RELAXED);
+}
+
+/* mmap populates writable anonymous mappings this large. */
+static inline int lowmem_want_populate(size_t len, int prot, int flags) {
+	return (populate_threshold > 0 && len >= populate_threshold &&
+		(flags & MAP_ANONYMOUS) && (prot & PROT_WRITE));
+}
+
+/* populate a new mapping now, or queue it for the prefault thread.  'flags' has
+ * MAP_POPULATE if the mmap already populated it. */
+static void lowmem_populate(uint8_t *mem, size_t len, int prot, int flags) {
+	if(!(flags & MAP_ANONYMOUS) || !(prot & PROT_WRITE)) return;
+	if(lowmem_want_populate(len, prot, flags)) {
+		if(!(flags & MAP_POPULATE) && madvise(mem, len, MADV_POPULATE_WRITE) != 0) return;
+		__atomic_fetch_add(&populate_maps, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&populate_bytes, len, __ATOMIC_RELAXED);
+	} else if(prefault_threshold > 0 && len >= prefault_threshold && !(flags & MAP_POPULATE)) {
+		prefault_queue(mem, len);
+	}
+}
+
+/* reserve an exact range in the low region. */
+static int lowmem_reserve(uint8_t *addr, size_t len) {
+	if(arena_reserve_segment(arenas, addr, len) == 0) return 0;
+	/* part of the range might be held by this thread's span cache, the retain cache or the reclaim queue. */
+	if((span_cache_flush() + retain_cache_flush() + reclaim_flush()) > 0) {
+		return arena_reserve_segment(arenas, addr, len);
+	}
+	return -1;
+}
+
+/* a gap between the caller's mappings that isn't free. */
+static void unowned_used(void *data, uint8_t *addr, size_t len) {
+	if(!arena_is_free(arenas, addr, len)) *(int *)data = 1;
+}
+
+/*
+ * take the free pages of a MAP_FIXED target that also covers mappings the
+ * caller owns.  The target's pages outside those mappings might still be in
+ * another thread's span cache, those caches are flushed first so their pages
+ * are taken too instead of being handed out again later.
+ */
+static int lowmem_claim(uint8_t *addr, size_t len, PageAllocClaim *claim) {
+	int unowned = 0;
+
+	live_table_gaps(addr, len, unowned_used, &unowned);
+	if(unowned) span_cache_flush_all();
+	return arena_claim_segment(arenas, addr, len, claim);
+}
+
+/* give back the pages taken by lowmem_claim(), 'discard' drops whatever a failed mmap left there. */
+static void lowmem_unclaim(PageAllocClaim *claim, int discard) {
+	size_t i;
+
+	for(i = 0; i < claim->count; i++) {
+		if(discard) lowmem_discard(claim->range[i].addr, claim->range[i].len);
+		arena_release_segment(arenas, claim->range[i].addr, claim->range[i].len);
+	}
+	page_alloc_claim_free(claim);
+}
+
+/* return unmapped space to the low region. */
+static int lowmem_release(uint8_t *addr, size_t len) {
+	if(span_cache_put(addr, len) == 0) {
+		/* keep span in this thread's cache. */
+		return 0;
+	}
+	return arena_release_segment(arenas, addr, len);
+}
+
+/* return a range the kernel has unmapped to the low region. */
+static void lowmem_return(uint8_t *addr, size_t len) {
+	if(lowmem_refill(addr, len) != 0) {
+		/* something else got mapped there, keep the range reserved. */
+		return;
+	}
+	lowmem_release(addr, len);
+}
+
+/* release part of a mapping that the kernel has already unmapped. */
+static void release_range(uint8_t *addr, size_t len) {
+	lowmem_release(addr, len);
+}
+
+/* unmap part of a mapping, or queue it for the reclaim thread. */
+static void unmap_range(uint8_t *addr, size_t len) {
+	if(reclaim_queue(addr, len) == 0) {
+		/* the range stays reserved until the reclaim thread has unmapped it. */
+		return;
+	}
+	/* unmap before releasing, so no other thread can be handed the range while it is still mapped. */
+	if(lowmem_discard(addr, len) != 0) {
+		perror("munmap(): system munmap failed");
+		return;
+	}
+	lowmem_release(addr, len);
+}
+
 static void *mmap_lowmem(void *addr, size_t length, int prot, int flags, int fd, off64_t offset) {
+	size_t len = PAGE_ALIGN(length);
+	int map_flags = (flags & ~(MAP_32BIT|MAP_FIXED));
+	/* only plain private anonymous mappings can be retained. */
+	int anon = (map_flags == M_FLAGS);
+	int reserved = 1;
+	int claimed = 0;
+	int huge = 0;
+	PageAllocClaim claim;
+	uint8_t *seg;
 	void *mem;
-	PAGE_LOCK();
-	mem = page_alloc_get_segment(palloc, addr, length);
-	PAGE_UNLOCK();
-	if(mem == NULL) return MAP_FAILED;
+	int err;
+	span_cache_count_op();
+	if(flags & MAP_FIXED) {
+		seg = (uint8_t *)addr;
+		prefault_cancel(seg, len);
+		if(lowmem_reserve(seg, len) != 0) {
+			/* caller is replacing mappings it already owns, take the free pages around them. */
+			page_alloc_claim_init(&claim);
+			if(lowmem_claim(seg, len, &claim) != 0) {
+				lowmem_unclaim(&claim, 0);
+				errno = ENOMEM;
+				return MAP_FAILED;
+			}
+			reserved = 0;
+			claimed = 1;
+			live_table_remove(seg, len, NULL);
+		}
+	} else if(anon && addr == NULL && (seg = retain_cache_get(len, prot)) != NULL) {
+		/* still mapped, with the pages dropped. */
+		live_table_insert(seg, len, prot, map_flags);
+		lowmem_populate(seg, len, prot, map_flags);
+		return seg;
+	} else if(addr == NULL && thp_threshold > 0 && len >= thp_threshold && (flags & MAP_ANONYMOUS)) {
+		seg = lowmem_get_aligned(len);
+		if(seg == NULL) return MAP_FAILED;
+		huge = 1;
+	} else {
+		seg = lowmem_get_segment(addr, len);
+		if(seg == NULL) return MAP_FAILED;
+	}
 	flags = (flags & ~(MAP_32BIT));
-	mem = SYS_MMAP64(mem, length, prot, flags, fd, offset);
+	if(region_reserved) {
+		/* map over the placeholder pages. */
+		flags |= MAP_FIXED;
+	} else if(!(flags & MAP_FIXED)) {
+		/* fail instead of mapping somewhere else when the range isn't really free. */
+		flags |= MAP_FIXED_NOREPLACE;
+	}
+	if(!huge && !populate_madvise && lowmem_want_populate(len, prot, flags)) {
+		/* huge-page aligned mappings are populated after MADV_HUGEPAGE. */
+		flags |= MAP_POPULATE;
+	}
+	if(huge && thp_hugetlb && ((uintptr_t)seg & (HUGE_PAGE_SIZE - 1)) == 0 && (len & (HUGE_PAGE_SIZE - 1)) == 0) {
+		/* fall back to normal pages if no hugetlb pages are available. */
+		mem = SYS_MMAP64(seg, length, prot, flags | MAP_HUGETLB, fd, offset);
+		if(mem != MAP_FAILED) {
+			if(mem == seg) {
+				__atomic_fetch_add(&thp_maps, 1, __ATOMIC_RELAXED);
+				__atomic_fetch_add(&thp_bytes, len, __ATOMIC_RELAXED);
+				live_table_insert(mem, len, prot, map_flags | MAP_HUGETLB);
+				return mem;
+			}
+			/* the kernel didn't honour the hint. */
+			SYS_MUNMAP(mem, len);
+		}
+	}
+	mem = sys_mmap_place(huge ? &lowmem_huge_placer : &lowmem_placer, &seg, addr, len,
+		length, prot, flags, fd, offset);
+	if(seg == NULL) return MAP_FAILED;
 	if(mem == MAP_FAILED) {
-		perror("mmap_lowmem(): mprotect failed");
+		err = errno;
+		perror("mmap_lowmem(): mmap failed");
+		if(reserved) {
+			if(flags & MAP_FIXED) {
+				/* a failed MAP_FIXED mmap might have unmapped the old pages. */
+				lowmem_discard(seg, len);
+			}
+			lowmem_release(seg, len);
+		} else if(claimed) {
+			/* only the pages that were free before, the caller's old mappings stay allocated. */
+			lowmem_unclaim(&claim, 1);
+		}
+		errno = err;
 		return MAP_FAILED;
 	}
+	if(claimed) {
+		page_alloc_claim_free(&claim);
+	}
+	if(huge) {
+		lowmem_advise_huge(mem, len);
+	}
+	lowmem_populate(mem, len, prot, flags);
+	live_table_insert(mem, len, prot, map_flags);
 	return mem;
 }
 
+/* time a low region mmap. */
+static void *mmap_lowmem_timed(void *addr, size_t length, int prot, int flags, int fd, off64_t offset) {
+	uint64_t start;
+	uint64_t ns;
+	void *mem;
+
+	LOWMEM_PROBE4(mmap_entry, addr, length, prot, flags);
+	start = stats_now();
+	mem = mmap_lowmem(addr, length, prot, flags, fd, offset);
+	ns = stats_record(STATS_MMAP, start, mem == MAP_FAILED);
+	LOWMEM_PROBE3(mmap_return, mem, length, ns);
+	if(trace_enabled) {
+		/* time the mapping was handed out, see trace.h */
+		trace_record(TRACE_MMAP, stats_now(), mem == MAP_FAILED, mem, length, addr, 0, prot, flags);
+	}
+	return mem;
+}
+
+/* 'last' is the end of the highest mapping seen. */
+static void high_skip(void *data, uint8_t *start, uint8_t *end) {
+	uint8_t **last = (uint8_t **)data;
+	if(end > *last) *last = end;
+}
+
+/*
+ * place a mapping above the low region.  The cursor only moves up (next-fit)
+ * and wraps around at HIGH_END, so ranges freed behind it get reused.  The
+ * range is claimed from the cursor before the mmap, so threads never try the
+ * same range, anything already mapped there is skipped.
+ */
+static void *mmap_high(size_t length, int prot, int flags, int fd, off64_t offset) {
+	size_t len = PAGE_ALIGN(length);
+	uintptr_t addr;
+	uintptr_t next;
+	uintptr_t cur;
+	uint8_t *last;
+	void *mem;
+	int tries;
+
+	if(len == 0 || len > (HIGH_END - HIGH_START)) goto fallback;
+	for(tries = 0; tries < COLLIDE_RETRIES; tries++) {
+		cur = __atomic_load_n(&high_cursor, __ATOMIC_RELAXED);
+		do {
+			addr = ((cur + len) > HIGH_END) ? HIGH_START : cur;
+			next = addr + len;
+		} while(!__atomic_compare_exchange_n(&high_cursor, &cur, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		mem = SYS_MMAP64((void *)addr, length, prot, flags | MAP_FIXED_NOREPLACE, fd, offset);
+		if(mem == (void *)addr) return mem;
+		if(mem != MAP_FAILED) {
+			/* older kernels treat MAP_FIXED_NOREPLACE as a hint. */
+			if((uint8_t *)mem >= LOW_4G) return mem;
+			SYS_MUNMAP(mem, len);
+		} else if(errno != EEXIST) {
+			break;
+		}
+		/* move the cursor past what is mapped there, unless another thread already moved it. */
+		last = (uint8_t *)next;
+		if(proc_maps_walk((uint8_t *)addr, (uint8_t *)next, high_skip, &last) != 0) break;
+		__atomic_compare_exchange_n(&high_cursor, &next, (uintptr_t)last, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+fallback:
+	return SYS_MMAP64(NULL, length, prot, flags, fd, offset);
+}
+
+/* extra window that serves an mmap outside of the low region, NULL if none. */
+static Window *mmap_window(void *addr, int flags) {
+	if(!windows_enabled || addr == NULL) return NULL;
+	return (flags & MAP_FIXED) ? window_at(addr) : window_route(addr);
+}
+
 static void *lowmem_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+	Window *w;
+
+	STATS_POLL();
 	/* check if 'addr' hint is in low 4Gb range. */
 	if(((flags & MAP_32BIT) && !(flags & MAP_FIXED)) || REGION_CHECK(addr)) {
-		return mmap_lowmem(addr, length, prot, flags, fd, offset);
+		return mmap_lowmem_timed(addr, length, prot, flags, fd, offset);
+	}
+	w = mmap_window(addr, flags);
+	if(w != NULL) {
+		return window_mmap(w, addr, length, prot, flags, fd, offset);
 	}
 	/* fallback to system mmap. */
+	stats_fallback(STATS_MMAP);
+	LOWMEM_PROBE3(mmap_fallback, addr, length, flags);
+	if(high_steer && addr == NULL && !(flags & MAP_FIXED)) {
+		return mmap_high(length, prot, flags, fd, offset);
+	}
 	return SYS_MMAP(addr, length, prot, flags, fd, offset);
 }
 
 static void *lowmem_mmap64(void *addr, size_t length, int prot, int flags, int fd, off64_t offset) {
+	Window *w;
+
+	STATS_POLL();
 	/* check if 'addr' hint is in low 4Gb range. */
 	if(((flags & MAP_32BIT) && !(flags & MAP_FIXED)) || REGION_CHECK(addr)) {
-		return mmap_lowmem(addr, length, prot, flags, fd, offset);
+		return mmap_lowmem_timed(addr, length, prot, flags, fd, offset);
+	}
+	w = mmap_window(addr, flags);
+	if(w != NULL) {
+		return window_mmap(w, addr, length, prot, flags, fd, offset);
 	}
 	/* fallback to system mmap. */
+	stats_fallback(STATS_MMAP);
+	LOWMEM_PROBE3(mmap_fallback, addr, length, flags);
+	if(high_steer && addr == NULL && !(flags & MAP_FIXED)) {
+		return mmap_high(length, prot, flags, fd, offset);
+	}
 	return SYS_MMAP64(addr, length, prot, flags, fd, offset);
 }
 
-static void *lowmem_mremap2(void *old_addr, size_t old_size, size_t new_size, int flags, void *new_addr) {
+/* get a segment for mremap to move pages to.  MREMAP_FIXED replaces whatever is
+ * mapped there, so claim it with placeholder pages first. */
+static uint8_t *lowmem_get_move_target(size_t len) {
+	uint8_t *seg = NULL;
+
+	if(region_reserved) return lowmem_get_segment(NULL, len);
+	if(sys_mmap_place(&lowmem_placer, &seg, NULL, len, len, PROT_NONE,
+			M_FLAGS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0) != MAP_FAILED) {
+		return seg;
+	}
+	if(seg != NULL) {
+		lowmem_release(seg, len);
+	}
+	return NULL;
+}
+
+static void *mremap_lowmem(void *old_addr, size_t old_size, size_t new_size, int flags, void *new_addr) {
+	size_t old_len = PAGE_ALIGN(old_size);
+	size_t new_len = PAGE_ALIGN(new_size);
+	LiveMap map = { NULL, 0, 0, 0 };
+	LiveMap next;
+	uint8_t *mem;
+	Window *w;
+
+	if(REGION_CHECK(old_addr)) {
+		prefault_cancel(old_addr, old_len);
+		live_table_find(old_addr, &map);
+	}
 	if(flags & MREMAP_FIXED) {
 		if(REGION_CHECK(new_addr)) {
-printf("------ FAIL mremap(%p, %zd, %zd, 0x%x, %p)\n", old_addr, old_size, new_size, flags, new_addr);
-			/* TODO: handle */
-			return MAP_FAILED;
+			span_cache_count_op();
+			/* claim the target range, then let the kernel move the pages there. */
+			if(lowmem_reserve(new_addr, new_len) != 0) {
+				errno = ENOMEM;
+				return MAP_FAILED;
+			}
+			mem = SYS_MREMAP2(old_addr, old_size, new_size, flags, new_addr);
+			if(mem == MAP_FAILED) {
+				lowmem_discard(new_addr, new_len);
+				lowmem_release(new_addr, new_len);
+				return MAP_FAILED;
+			}
+			live_table_insert(mem, new_len, map.prot, map.flags);
+		} else if(windows_enabled) {
+			mem = window_mremap(old_addr, old_size, new_size, flags, new_addr);
+			if(mem == MAP_FAILED) return MAP_FAILED;
+		} else {
+			mem = SYS_MREMAP2(old_addr, old_size, new_size, flags, new_addr);
+			if(mem == MAP_FAILED) return MAP_FAILED;
 		}
-		return SYS_MREMAP2(old_addr, old_size, new_size, flags, new_addr);
+		if(REGION_CHECK(old_addr)) {
+			/* the kernel has unmapped the old range. */
+			live_table_remove(old_addr, old_len, lowmem_return);
+		} else if(windows_enabled && (w = window_at(old_addr)) != NULL) {
+			window_release(w, old_addr, old_len);
+		}
+		return mem;
 	}
 	if(REGION_CHECK(old_addr)) {
-		uint8_t *mem;
 		//printf("32BIT_mremap(%p, %zd, %zd, 0x%x)\n", old_addr, old_size, new_size, flags);
-		PAGE_LOCK();
-		mem = page_alloc_resize_segment(palloc, old_addr, old_size, new_size);
-		PAGE_UNLOCK();
-		if(mem != old_addr) {
-			if(flags & MREMAP_MAYMOVE) {
-printf("------ FAIL mremap(%p, %zd, %zd, 0x%x)\n", old_addr, old_size, new_size, flags);
-				/* TODO: try to support MREMAP_MAYMOVE. */
+		span_cache_count_op();
+		if(new_len < old_len) {
+			/* shrink in-place. */
+			if(region_reserved) {
+				if(lowmem_discard(old_addr + new_len, old_len - new_len) != 0) return MAP_FAILED;
+				mem = old_addr;
+			} else {
+				mem = SYS_MREMAP2(old_addr, old_size, new_size, flags & ~MREMAP_MAYMOVE, NULL);
+				if(mem == MAP_FAILED) return MAP_FAILED;
+			}
+			live_table_remove(old_addr + new_len, old_len - new_len, release_range);
+			return mem;
+		}
+		/* a live mapping right after the old range means it can't grow in-place. */
+		if(new_len == old_len || (live_table_lookup(old_addr + old_len, &next) != 0 &&
+				arena_reserve_segment(arenas, old_addr + old_len, new_len - old_len) == 0)) {
+			/* we can resize the memory region in-place. */
+			if(region_reserved && new_len > old_len) {
+				/* make room for the kernel to grow the mapping. */
+				SYS_MUNMAP(old_addr + old_len, new_len - old_len);
+			}
+			mem = SYS_MREMAP2(old_addr, old_size, new_size, flags & ~MREMAP_MAYMOVE, NULL);
+			if(new_len == old_len) return mem;
+			if(mem != MAP_FAILED) {
+				live_table_remove(old_addr, old_len, NULL);
+				live_table_insert(old_addr, new_len, map.prot, map.flags);
+				return mem;
+			}
+			/* something outside of our control is mapped after the old range. */
+			if(region_reserved) {
+				lowmem_return(old_addr + old_len, new_len - old_len);
+			} else {
+				lowmem_refresh(old_addr + old_len, new_len - old_len);
 			}
+		}
+		if(!(flags & MREMAP_MAYMOVE)) {
+			errno = ENOMEM;
+			return MAP_FAILED;
+		}
+		/* move the pages to a new low-region segment, without copying them. */
+		mem = lowmem_get_move_target(new_len);
+		if(mem == NULL) {
+			errno = ENOMEM;
+			return MAP_FAILED;
+		}
+		new_addr = SYS_MREMAP2(old_addr, old_size, new_size, MREMAP_MAYMOVE|MREMAP_FIXED, mem);
+		if(new_addr == MAP_FAILED) {
+			lowmem_discard(mem, new_len);
+			lowmem_release(mem, new_len);
 			return MAP_FAILED;
 		}
-		/* we can resize the memory region in-place. */
-		return SYS_MREMAP2(old_addr, old_size, new_size, flags, NULL);
+		live_table_insert(new_addr, new_len, map.prot, map.flags);
+		live_table_remove(old_addr, old_len, lowmem_return);
+		return new_addr;
 	}
 	return SYS_MREMAP2(old_addr, old_size, new_size, flags, NULL);
 }
 
+/* unmap the parts of a gap that the low region doesn't hold free, they are mappings we don't track. */
+static void unmap_untracked(void *data, uint8_t *addr, size_t len) {
+	uint8_t *end = addr + len;
+	size_t n;
+
+	while(addr < end) {
+		n = arena_free_at(arenas, addr);
+		if(n == 0) {
+			n = arena_used_at(arenas, addr);
+			if(n == 0) break;
+			if(n > (size_t)(end - addr)) n = end - addr;
+			if(SYS_MUNMAP(addr, n) != 0) *(int *)data = -1;
+		}
+		addr += n;
+	}
+}
+
+static int munmap_lowmem(void *addr, size_t length) {
+	size_t len = PAGE_ALIGN(length);
+	LiveMap map;
+	int unowned = 0;
+	int rc = 0;
+	//printf("32BIT_munmap(%p, %zd)\n", addr, length);
+	if(len == 0 || ((uintptr_t)addr & (sys_pagesize - 1))) {
+		errno = EINVAL;
+		return -1;
+	}
+	span_cache_count_op();
+	prefault_cancel(addr, len);
+	if(live_table_lookup(addr, &map) == 0 && map.len == len) {
+		/* common case, a whole mapping. */
+		live_table_remove(addr, len, NULL);
+		if(map.flags == M_FLAGS && retain_cache_put(addr, len, map.prot) == 0) {
+			/* the span stays mapped in the retain cache. */
+			return 0;
+		}
+		unmap_range(addr, len);
+		return 0;
+	}
+	if(len > (size_t)(LOW_4G - (uint8_t *)addr)) {
+		/* the part above the low region isn't ours. */
+		if(SYS_MUNMAP(LOW_4G, len - (LOW_4G - (uint8_t *)addr)) != 0) rc = -1;
+		len = LOW_4G - (uint8_t *)addr;
+	}
+	/* gaps between our mappings are either free, which the kernel treats as already unmapped, or not ours. */
+	live_table_gaps(addr, len, unowned_used, &unowned);
+	if(unowned) {
+		/* pages held by the caches aren't free yet, give them back so only untracked mappings are left. */
+		span_cache_flush_all();
+		retain_cache_flush();
+		reclaim_flush();
+		live_table_gaps(addr, len, unmap_untracked, &rc);
+	}
+	/* part of a mapping, or a range that covers several mappings. */
+	live_table_remove(addr, len, unmap_range);
+	return rc;
+}
+
+/* time a low region mremap. */
+static void *mremap_lowmem_timed(void *old_addr, size_t old_size, size_t new_size, int flags, void *new_addr) {
+	uint64_t start;
+	uint64_t ns;
+	void *mem;
+
+	LOWMEM_PROBE4(mremap_entry, old_addr, old_size, new_size, flags);
+	start = stats_now();
+	mem = mremap_lowmem(old_addr, old_size, new_size, flags, new_addr);
+	ns = stats_record(STATS_MREMAP, start, mem == MAP_FAILED);
+	LOWMEM_PROBE3(mremap_return, mem, new_size, ns);
+	if(trace_enabled) {
+		trace_record(TRACE_MREMAP, start, mem == MAP_FAILED, old_addr, old_size,
+			(flags & MREMAP_FIXED) ? new_addr : mem, new_size, 0, flags);
+	}
+	return mem;
+}
+
+static void *lowmem_mremap2(void *old_addr, size_t old_size, size_t new_size, int flags, void *new_addr) {
+	STATS_POLL();
+	if(!REGION_CHECK(old_addr) && !((flags & MREMAP_FIXED) && REGION_CHECK(new_addr))) {
+		if(windows_enabled && (window_at(old_addr) != NULL ||
+				((flags & MREMAP_FIXED) && window_at(new_addr) != NULL))) {
+			return window_mremap(old_addr, old_size, new_size, flags, new_addr);
+		}
+		stats_fallback(STATS_MREMAP);
+		LOWMEM_PROBE3(mremap_fallback, old_addr, old_size, new_size);
+		return SYS_MREMAP2(old_addr, old_size, new_size, flags, new_addr);
+	}
+	return mremap_lowmem_timed(old_addr, old_size, new_size, flags, new_addr);
+}
+
+/* time a low region munmap. */
+static int munmap_lowmem_timed(void *addr, size_t length) {
+	uint64_t start;
+	uint64_t ns;
+	int rc;
+
+	LOWMEM_PROBE2(munmap_entry, addr, length);
+	start = stats_now();
+	rc = munmap_lowmem(addr, length);
+	ns = stats_record(STATS_MUNMAP, start, rc != 0);
+	LOWMEM_PROBE3(munmap_return, rc, length, ns);
+	if(trace_enabled) {
+		trace_record(TRACE_MUNMAP, start, rc != 0, addr, length, NULL, 0, 0, 0);
+	}
+	return rc;
+}
+
 static int lowmem_munmap(void *addr, size_t length) {
+	Window *w;
+
+	STATS_POLL();
 	/* check if 'addr' is in low 4Gb range. */
 	if(REGION_CHECK(addr)) {
-		//printf("32BIT_munmap(%p, %zd)\n", addr, length);
-		PAGE_LOCK();
-		int rc = page_alloc_release_segment(palloc, addr, length);
-		PAGE_UNLOCK();
-		if(rc != 0) {
-			errno = EINVAL;
-			return -1;
-		}
-		if(SYS_MUNMAP(addr, length) != 0) {
-			perror("munmap(): system munmap failed");
-			return -1;
-		}
-		return 0;
+		return munmap_lowmem_timed(addr, length);
+	}
+	if(windows_enabled && (w = window_at(addr)) != NULL) {
+		return window_munmap(w, addr, length);
 	}
 	//printf("munmap(%p, %zd)\n", addr, length);
+	stats_fallback(STATS_MUNMAP);
+	LOWMEM_PROBE2(munmap_fallback, addr, length);
 	return SYS_MUNMAP(addr, length);
 }
 
+/* make sure the low region is set up, for calls that don't come through the hooks. */
+static int lowmem_ready() {
+	if(L_UNLIKELY(region_start == NULL)) {
+		wrap_mmap_init();
+		if(region_start == NULL) {
+			errno = ENOMEM;
+			return 0;
+		}
+	}
+	STATS_POLL();
+	return 1;
+}
+
+void *lowmem_map(size_t len, int prot) {
+	void *mem;
+
+	if(!lowmem_ready()) return NULL;
+	mem = mmap_lowmem_timed(NULL, len, prot, M_FLAGS | MAP_32BIT, -1, 0);
+	return (mem == MAP_FAILED) ? NULL : mem;
+}
+
+void *lowmem_remap(void *addr, size_t len, size_t new_len, int flags) {
+	void *mem;
+
+	if(!lowmem_ready()) return NULL;
+	if(!REGION_CHECK(addr) || (flags & ~MREMAP_MAYMOVE)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	mem = mremap_lowmem_timed(addr, len, new_len, flags, NULL);
+	return (mem == MAP_FAILED) ? NULL : mem;
+}
+
+int lowmem_unmap(void *addr, size_t len) {
+	if(!lowmem_ready()) return -1;
+	if(!REGION_CHECK(addr)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return munmap_lowmem_timed(addr, len);
+}
+
+/* map a private anonymous mapping over a segment from the allocator, NULL if
+ * something we didn't map is there (the segment is released either way). */
+static uint8_t *lowmem_map_segment(uint8_t *seg, size_t len, int prot) {
+	int flags = M_FLAGS | (region_reserved ? MAP_FIXED : MAP_FIXED_NOREPLACE);
+	int huge = (thp_threshold > 0 && len >= thp_threshold);
+	uint64_t start;
+	void *mem;
+
+	if(!huge && !populate_madvise && lowmem_want_populate(len, prot, flags)) {
+		flags |= MAP_POPULATE;
+	}
+	start = stats_now();
+	mem = SYS_MMAP64(seg, len, prot, flags, -1, 0);
+	if(L_UNLIKELY(sys_mmap_collided(seg, len, mem, flags))) {
+		lowmem_refresh(seg, len);
+		errno = EEXIST;
+		return NULL;
+	}
+	stats_record(STATS_MMAP, start, mem == MAP_FAILED);
+	if(mem == MAP_FAILED) {
+		lowmem_release(seg, len);
+		return NULL;
+	}
+	if(huge) {
+		lowmem_advise_huge(mem, len);
+	}
+	lowmem_populate(mem, len, prot, flags);
+	live_table_insert(mem, len, prot, M_FLAGS);
+	if(trace_enabled) {
+		trace_record(TRACE_MMAP, stats_now(), 0, mem, len, NULL, 0, prot, M_FLAGS | MAP_32BIT);
+	}
+	return mem;
+}
+
+void *lowmem_map_aligned(size_t len, size_t align, int prot) {
+	uint8_t *seg;
+	uint8_t *mem;
+	int collided;
+
+	if(!lowmem_ready()) return NULL;
+	len = PAGE_ALIGN(len);
+	if(len == 0 || align < (size_t)sys_pagesize || (align & (align - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	for(collided = 0; collided < COLLIDE_RETRIES; collided++) {
+		seg = arena_get_aligned_segment(arenas, len, align);
+		if(seg == NULL && (span_cache_flush() + retain_cache_flush() + reclaim_flush()) > 0) {
+			/* low region is full, retry after returning cached spans. */
+			seg = arena_get_aligned_segment(arenas, len, align);
+		}
+		if(seg == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		mem = lowmem_map_segment(seg, len, prot);
+		if(mem != NULL || errno != EEXIST) return mem;
+	}
+	errno = ENOMEM;
+	return NULL;
+}
+
+int lowmem_map_batch(LowmemRange *ranges, int count, int prot) {
+	Span spans[LOWMEM_BATCH];
+	int done = 0;
+	int n;
+	int i;
+
+	if(!lowmem_ready()) return -1;
+	while(done < count) {
+		n = (count - done) < LOWMEM_BATCH ? (count - done) : LOWMEM_BATCH;
+		for(i = 0; i < n; i++) {
+			spans[i].len = PAGE_ALIGN(ranges[done + i].len);
+			if(spans[i].len == 0) {
+				errno = EINVAL;
+				goto failed;
+			}
+		}
+		if(arena_get_segments(arenas, spans, n) != 0) {
+			/* low region is full, retry after returning cached spans. */
+			if((span_cache_flush() + retain_cache_flush() + reclaim_flush()) == 0 ||
+					arena_get_segments(arenas, spans, n) != 0) {
+				errno = ENOMEM;
+				goto failed;
+			}
+		}
+		for(i = 0; i < n; i++) {
+			LowmemRange *range = ranges + done;
+			range->addr = lowmem_map_segment(spans[i].addr, spans[i].len, prot);
+			if(range->addr == NULL) {
+				/* collided with a mapping we didn't make, take the slow path. */
+				range->addr = lowmem_map(range->len, prot);
+			}
+			if(range->addr == NULL) {
+				/* give back the segments that weren't mapped yet. */
+				if(i + 1 < n) arena_release_spans(arenas, spans + i + 1, n - i - 1);
+				goto failed;
+			}
+			done++;
+		}
+	}
+	return 0;
+failed:
+	lowmem_unmap_batch(ranges, done);
+	return -1;
+}
+
+int lowmem_unmap_batch(LowmemRange *ranges, int count) {
+	Span spans[LOWMEM_BATCH];
+	LiveMap map;
+	uint8_t *addr;
+	size_t len;
+	uint64_t start;
+	int rc = 0;
+	int n = 0;
+	int i;
+
+	if(!lowmem_ready()) return -1;
+	for(i = 0; i < count; i++) {
+		addr = (uint8_t *)ranges[i].addr;
+		len = PAGE_ALIGN(ranges[i].len);
+		if(!REGION_CHECK(addr)) {
+			rc = -1;
+			continue;
+		}
+		if(live_table_lookup(addr, &map) != 0 || map.len != len) {
+			/* not a whole mapping, take the slow path. */
+			if(munmap_lowmem_timed(addr, ranges[i].len) != 0) rc = -1;
+			continue;
+		}
+		start = stats_now();
+		prefault_cancel(addr, len);
+		live_table_remove(addr, len, NULL);
+		if((map.flags == M_FLAGS && retain_cache_put(addr, len, map.prot) == 0) ||
+				reclaim_queue(addr, len) == 0) {
+			/* the range stays reserved in the retain cache or the reclaim queue. */
+		} else if(lowmem_discard(addr, len) != 0) {
+			perror("lowmem_unmap_batch(): system munmap failed");
+			rc = -1;
+		} else {
+			/* released with one lock acquisition per arena. */
+			spans[n].addr = addr;
+			spans[n].len = len;
+			if(++n == LOWMEM_BATCH) {
+				arena_release_spans(arenas, spans, n);
+				n = 0;
+			}
+		}
+		stats_record(STATS_MUNMAP, start, 0);
+		if(trace_enabled) {
+			trace_record(TRACE_MUNMAP, start, 0, addr, len, NULL, 0, 0, 0);
+		}
+	}
+	if(n > 0) {
+		arena_release_spans(arenas, spans, n);
+	}
+	return rc;
+}
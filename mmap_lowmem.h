@@ -8,7 +8,14 @@
 
 #include "lcommon.h"
 #include "wrap_mmap.h"
+#include "stats.h"
 
 L_LIB_API WrapMMAP *init_lowmem_mmap();
 
+/* returns -1 if the low region isn't in use. */
+L_LIB_API int mmap_lowmem_get_stats(LowmemStats *stats);
+
+/* write all counters to 'fd', only blocks on the write itself. */
+L_LIB_API void mmap_lowmem_dump_stats(int fd);
+
 #endif /* __MMAP_LOWMEM_H__ */
@@ -0,0 +1,373 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Replay a trace recorded with MMAP_LOWMEM_TRACE against a page allocator.
+ *
+ *   mmap_lowmem_replay [-e tree|bitmap] [-T thp_threshold] [-S split_threshold] <trace file>
+ *
+ * Nothing is mapped, the allocator just hands out addresses, so the same trace
+ * always gives the same result.  Replayed addresses differ from the recorded
+ * ones, a table maps each recorded mapping to where the replay put it.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "page_alloc.h"
+#include "trace.h"
+#include "bench.h"
+
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+/* how often the free space is sampled, in records. */
+#define SAMPLE_EVERY 1024
+
+/* a recorded mapping and where the replay put it. */
+typedef struct Mapping {
+	uint64_t  rec;
+	size_t    len;
+	uint8_t   *rep;
+} Mapping;
+
+typedef struct Replay {
+	PageAlloc     *palloc;
+	size_t        page_size;
+	size_t        thp_threshold;
+	size_t        split;
+	Mapping       *map;
+	size_t        count;
+	size_t        size;
+	uint64_t      ns;        /* time spent in the allocator for the current record. */
+	BenchSamples  op[3];
+	size_t        failed;    /* calls that worked when recorded but not in the replay. */
+	size_t        skipped;   /* calls that failed when recorded. */
+	size_t        overlaps;  /* mappings recorded over a range that was still live. */
+	size_t        reserved;
+	size_t        peak_reserved;
+	size_t        max_free_segs;
+	size_t        min_largest_free;
+} Replay;
+
+typedef struct Entry {
+	TraceRecord rec;
+	size_t      pos;
+} Entry;
+
+static const char *op_names[3] = { "mmap", "munmap", "mremap" };
+
+/* allocator calls, timed. */
+static uint8_t *rp_get(Replay *r, uint8_t *hint, size_t len) {
+	uint64_t start = bench_now();
+	uint8_t *addr;
+
+	if(r->thp_threshold > 0 && len >= r->thp_threshold) {
+		addr = page_alloc_get_aligned_segment(r->palloc, len, HUGE_PAGE_SIZE);
+	} else {
+		addr = page_alloc_get_segment(r->palloc, hint, len);
+	}
+	r->ns += bench_now() - start;
+	if(addr != NULL) r->reserved += len;
+	return addr;
+}
+
+static int rp_reserve(Replay *r, uint8_t *addr, size_t len) {
+	uint64_t start = bench_now();
+	int rc = page_alloc_reserve_segment(r->palloc, addr, len);
+	r->ns += bench_now() - start;
+	if(rc == 0) r->reserved += len;
+	return rc;
+}
+
+static void rp_release(Replay *r, uint8_t *addr, size_t len) {
+	uint64_t start = bench_now();
+	page_alloc_release_segment(r->palloc, addr, len);
+	r->ns += bench_now() - start;
+	r->reserved -= len;
+}
+
+static uint8_t *rp_resize(Replay *r, uint8_t *addr, size_t len, size_t new_len) {
+	uint64_t start = bench_now();
+	uint8_t *mem = page_alloc_resize_segment(r->palloc, addr, len, new_len);
+	r->ns += bench_now() - start;
+	if(mem != NULL) r->reserved += new_len - len;
+	return mem;
+}
+
+/* index of the first mapping that ends after 'addr'. */
+static size_t map_search(Replay *r, uint64_t addr) {
+	size_t lo = 0;
+	size_t hi = r->count;
+
+	while(lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if(r->map[mid].rec + r->map[mid].len <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static void map_insert(Replay *r, uint64_t rec, size_t len, uint8_t *rep) {
+	size_t i = map_search(r, rec);
+
+	if(r->count == r->size) {
+		r->size = r->size ? r->size * 2 : 1024;
+		r->map = (Mapping *)realloc(r->map, r->size * sizeof(Mapping));
+	}
+	memmove(r->map + i + 1, r->map + i, (r->count - i) * sizeof(Mapping));
+	r->map[i].rec = rec;
+	r->map[i].len = len;
+	r->map[i].rep = rep;
+	r->count++;
+}
+
+/* release the replayed parts of [rec, rec + len), splitting mappings that only partly overlap. */
+static size_t map_remove(Replay *r, uint64_t rec, size_t len) {
+	uint64_t end = rec + len;
+	size_t removed = 0;
+	size_t i = map_search(r, rec);
+
+	while(i < r->count && r->map[i].rec < end) {
+		Mapping m = r->map[i];
+		uint64_t m_end = m.rec + m.len;
+		uint64_t cut = (m.rec > rec) ? m.rec : rec;
+		uint64_t cut_end = (m_end < end) ? m_end : end;
+
+		rp_release(r, m.rep + (cut - m.rec), cut_end - cut);
+		removed += cut_end - cut;
+		memmove(r->map + i, r->map + i + 1, (r->count - i - 1) * sizeof(Mapping));
+		r->count--;
+		if(cut_end < m_end) {
+			/* keep the tail. */
+			map_insert(r, cut_end, m_end - cut_end, m.rep + (cut_end - m.rec));
+		}
+		if(m.rec < cut) {
+			/* keep the head. */
+			map_insert(r, m.rec, cut - m.rec, m.rep);
+			i++;
+		}
+		if(cut_end < m_end) i++;
+	}
+	return removed;
+}
+
+/* add a mapping, a live mapping in the way means records from two threads were out of order. */
+static void map_add(Replay *r, uint64_t rec, size_t len, uint8_t *rep) {
+	if(map_remove(r, rec, len) != 0) r->overlaps++;
+	map_insert(r, rec, len, rep);
+}
+
+static void replay_mmap(Replay *r, const TraceRecord *rec) {
+	size_t len = (size_t)rec->pages * r->page_size;
+	uint8_t *mem;
+
+	if(rec->flags & MAP_FIXED) {
+		/* the caller picked the address, replay it as-is. */
+		map_remove(r, rec->addr, len);
+		if(rp_reserve(r, (uint8_t *)(uintptr_t)rec->addr, len) != 0) {
+			r->failed++;
+			return;
+		}
+		map_insert(r, rec->addr, len, (uint8_t *)(uintptr_t)rec->addr);
+		return;
+	}
+	mem = rp_get(r, (uint8_t *)(uintptr_t)rec->new_addr, len);
+	if(mem == NULL) {
+		r->failed++;
+		return;
+	}
+	map_add(r, rec->addr, len, mem);
+}
+
+static void replay_mremap(Replay *r, const TraceRecord *rec) {
+	size_t len = (size_t)rec->pages * r->page_size;
+	size_t new_len = (size_t)rec->new_pages * r->page_size;
+	size_t i = map_search(r, rec->addr);
+	uint8_t *mem;
+	Mapping m;
+
+	if((rec->flags & MREMAP_FIXED) || i >= r->count ||
+			r->map[i].rec != rec->addr || r->map[i].len != len) {
+		/* not a whole mapping, replay it as unmap + map. */
+		map_remove(r, rec->addr, len);
+		if(rec->flags & MREMAP_FIXED) {
+			map_remove(r, rec->new_addr, new_len);
+			mem = (rp_reserve(r, (uint8_t *)(uintptr_t)rec->new_addr, new_len) == 0) ?
+				(uint8_t *)(uintptr_t)rec->new_addr : NULL;
+		} else {
+			mem = rp_get(r, NULL, new_len);
+		}
+		if(mem == NULL) {
+			r->failed++;
+			return;
+		}
+		map_add(r, rec->new_addr, new_len, mem);
+		return;
+	}
+	m = r->map[i];
+	mem = rp_resize(r, m.rep, len, new_len);
+	if(mem == NULL) {
+		/* move it. */
+		mem = rp_get(r, NULL, new_len);
+		if(mem == NULL) {
+			r->failed++;
+			return;
+		}
+		rp_release(r, m.rep, len);
+	}
+	memmove(r->map + i, r->map + i + 1, (r->count - i - 1) * sizeof(Mapping));
+	r->count--;
+	map_add(r, rec->new_addr, new_len, mem);
+}
+
+static void replay_sample(Replay *r) {
+	PageAllocStats stats;
+
+	page_alloc_get_stats(r->palloc, &stats);
+	if(stats.free_segs > r->max_free_segs) r->max_free_segs = stats.free_segs;
+	if(stats.largest_free < r->min_largest_free) r->min_largest_free = stats.largest_free;
+}
+
+static int cmp_entry(const void *a, const void *b) {
+	const Entry *x = (const Entry *)a;
+	const Entry *y = (const Entry *)b;
+
+	if(x->rec.time != y->rec.time) return (x->rec.time > y->rec.time) ? 1 : -1;
+	return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+static Entry *load_trace(const char *path, TraceHeader *hdr, size_t *count) {
+	TraceRecord rec;
+	Entry *entries = NULL;
+	size_t size = 0;
+	size_t n = 0;
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if(fp == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if(fread(hdr, sizeof(TraceHeader), 1, fp) != 1 || hdr->magic != TRACE_MAGIC ||
+			hdr->version != TRACE_VERSION) {
+		fprintf(stderr, "%s: not a mmap_lowmem trace\n", path);
+		fclose(fp);
+		return NULL;
+	}
+	while(fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if(n == size) {
+			size = size ? size * 2 : 4096;
+			entries = (Entry *)realloc(entries, size * sizeof(Entry));
+		}
+		entries[n].rec = rec;
+		entries[n].pos = n;
+		n++;
+	}
+	fclose(fp);
+	/* buffers from different threads are only ordered within themselves. */
+	qsort(entries, n, sizeof(Entry), cmp_entry);
+	*count = n;
+	return entries;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-e tree|bitmap] [-T thp_threshold] [-S split_threshold] <trace file>\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	PageAllocEngine engine = PAGE_ALLOC_DEFAULT_ENGINE;
+	PageAllocStats stats;
+	TraceHeader hdr;
+	Entry *entries;
+	Replay r;
+	size_t count;
+	size_t i;
+	char prefix[256];
+	int opt;
+	int op;
+
+	memset(&r, 0, sizeof(r));
+	while((opt = getopt(argc, argv, "e:T:S:h")) != -1) {
+		switch(opt) {
+		case 'e':
+			engine = page_alloc_engine_by_name(optarg, engine);
+			break;
+		case 'T':
+			r.thp_threshold = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			r.split = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1) usage(argv[0]);
+
+	entries = load_trace(argv[optind], &hdr, &count);
+	if(entries == NULL) return 1;
+	r.palloc = page_alloc_new_engine(engine, (uint8_t *)(uintptr_t)hdr.region_start, hdr.region_len);
+	page_alloc_set_split(r.palloc, r.split);
+	r.page_size = hdr.page_size;
+	r.min_largest_free = hdr.region_len;
+	for(op = 0; op < 3; op++) {
+		bench_samples_init(r.op + op, count);
+	}
+
+	for(i = 0; i < count; i++) {
+		const TraceRecord *rec = &(entries[i].rec);
+		op = rec->op & ~TRACE_FAILED;
+		if((rec->op & TRACE_FAILED) || op > TRACE_MREMAP) {
+			r.skipped++;
+			continue;
+		}
+		r.ns = 0;
+		switch(op) {
+		case TRACE_MMAP:
+			replay_mmap(&r, rec);
+			break;
+		case TRACE_MUNMAP:
+			map_remove(&r, rec->addr, (size_t)rec->pages * r.page_size);
+			break;
+		case TRACE_MREMAP:
+			replay_mremap(&r, rec);
+			break;
+		}
+		bench_sample_ns(r.op + op, r.ns);
+		if(r.reserved > r.peak_reserved) r.peak_reserved = r.reserved;
+		if((i % SAMPLE_EVERY) == 0) replay_sample(&r);
+	}
+	replay_sample(&r);
+
+	page_alloc_get_stats(r.palloc, &stats);
+	snprintf(prefix, sizeof(prefix), "replay=%s engine=%s thp_threshold=%zu split=%zu", argv[optind],
+		(engine == PAGE_ALLOC_BITMAP) ? "bitmap" : "tree", r.thp_threshold, r.split);
+	for(op = 0; op < 3; op++) {
+		bench_report(prefix, op_names[op], r.op + op, 0);
+		printf("\n");
+	}
+	printf("%s records=%zu failed=%zu skipped=%zu overlaps=%zu live=%zu peak_reserved=%zu max_free_segs=%zu"
+		" min_largest_free=%zu free_segs=%zu largest_free=%zu frag=%.3f\n", prefix, count, r.failed,
+		r.skipped, r.overlaps, r.count, r.peak_reserved, r.max_free_segs, r.min_largest_free,
+		stats.free_segs, stats.largest_free, page_alloc_fragmentation(stats.largest_free, stats.free_bytes));
+
+	for(op = 0; op < 3; op++) {
+		bench_samples_free(r.op + op);
+	}
+	free(r.map);
+	free(entries);
+	page_alloc_free(r.palloc);
+	return 0;
+}
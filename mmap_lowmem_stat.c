@@ -0,0 +1,165 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Display the statistics a process publishes with MMAP_LOWMEM_STATS_SHM.
+ *
+ *   mmap_lowmem_stat [-d seconds] [-n count] <shm name>
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "stats_page.h"
+
+#define MBYTE (1024.0 * 1024.0)
+
+/* map cell density, from fully used to fully free. */
+static const char free_chars[] = "#%*+=-:. ";
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-d seconds] [-n count] <shm name>\n", prog);
+	exit(1);
+}
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/* upper bound of the histogram bucket that holds the 'pct' percentile. */
+static uint64_t latency_pct(const StatsOpCounters *op, int pct) {
+	uint64_t total = 0;
+	uint64_t want;
+	uint64_t seen = 0;
+	int i;
+
+	for(i = 0; i < STATS_BUCKETS; i++) total += op->latency[i];
+	if(total == 0) return 0;
+	want = (total * pct + 99) / 100;
+	for(i = 0; i < STATS_BUCKETS; i++) {
+		seen += op->latency[i];
+		if(seen >= want) break;
+	}
+	return 2ULL << i;
+}
+
+static void show(const StatsPage *page, const StatsPage *prev) {
+	static const char *names[STATS_OPS] = { "mmap", "munmap", "mremap" };
+	const LowmemStats *st = &(page->stats);
+	double frag = 0.0;
+	int op;
+	int i;
+
+	if(st->free_bytes > 0 && st->largest_free > 0) {
+		frag = 1.0 - ((double)st->largest_free / (double)st->free_bytes);
+	}
+	printf("pid %u%s, updated %.1fs ago\n\n", page->pid,
+		(kill(page->pid, 0) != 0 && errno == ESRCH) ? " (exited)" : "",
+		(double)(now_ns() - page->updated_ns) / 1e9);
+	printf("region %10.1fM  mapped %10.1fM  reserved %10.1fM\n",
+		st->region_bytes / MBYTE, st->mapped_bytes / MBYTE, st->reserved_bytes / MBYTE);
+	if(st->free_bytes > 0 && st->largest_free == 0) {
+		/* the bitmap engine can't tell without walking the free space. */
+		printf("free   %10.1fM  largest %10s  fragments %9zu  fragmentation %6s\n\n",
+			st->free_bytes / MBYTE, "-", st->free_segs, "-");
+	} else {
+		printf("free   %10.1fM  largest %9.1fM  fragments %9zu  fragmentation %5.1f%%\n\n",
+			st->free_bytes / MBYTE, st->largest_free / MBYTE, st->free_segs, frag * 100.0);
+	}
+	printf("%-8s %12s %10s %12s %10s %10s %10s\n",
+		"op", "calls", "calls/s", "fallbacks", "failures", "p50 ns", "p99 ns");
+	for(op = 0; op < STATS_OPS; op++) {
+		const StatsOpCounters *cur = st->op + op;
+		double rate = 0.0;
+		if(prev != NULL) {
+			rate = (double)(cur->calls - prev->stats.op[op].calls) * 1e9 /
+				(double)(page->updated_ns - prev->updated_ns);
+		}
+		printf("%-8s %12llu %10.0f %12llu %10llu %10llu %10llu\n", names[op],
+			(unsigned long long)cur->calls, rate, (unsigned long long)cur->fallbacks,
+			(unsigned long long)cur->failures,
+			(unsigned long long)latency_pct(cur, 50), (unsigned long long)latency_pct(cur, 99));
+	}
+	printf("\nfree-space map, %.1fM per cell ('#' used, ' ' free), from 0x%llx:\n",
+		page->cell_bytes / MBYTE, (unsigned long long)page->region_start);
+	for(i = 0; i < STATS_PAGE_CELLS; i++) {
+		if((i % 64) == 0) printf("  |");
+		putchar(free_chars[(page->free_map[i] * (sizeof(free_chars) - 2)) / 255]);
+		if((i % 64) == 63) printf("|\n");
+	}
+}
+
+int main(int argc, char *argv[]) {
+	const StatsPage *page;
+	StatsPage snap;
+	StatsPage last;
+	StatsPage older;
+	double delay = 1.0;
+	long count = -1;
+	int have_last = 0;
+	int have_older = 0;
+	int opt;
+	int fd;
+
+	while((opt = getopt(argc, argv, "d:n:h")) != -1) {
+		switch(opt) {
+		case 'd':
+			delay = atof(optarg);
+			break;
+		case 'n':
+			count = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1) usage(argv[0]);
+
+	fd = shm_open(argv[optind], O_RDONLY, 0);
+	if(fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], strerror(errno));
+		return 1;
+	}
+	page = (const StatsPage *)mmap(NULL, sizeof(StatsPage), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(page == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %s\n", argv[0], strerror(errno));
+		return 1;
+	}
+	if(__atomic_load_n(&(page->magic), __ATOMIC_ACQUIRE) != STATS_PAGE_MAGIC ||
+			page->version != STATS_PAGE_VERSION) {
+		fprintf(stderr, "%s: %s: not a mmap_lowmem stats page\n", argv[0], argv[optind]);
+		return 1;
+	}
+
+	while(count != 0) {
+		/* rates are taken between the last two distinct updates. */
+		if(stats_page_read(page, &snap) == 0) {
+			if(!have_last || snap.updated_ns != last.updated_ns) {
+				older = last;
+				have_older = have_last;
+				last = snap;
+				have_last = 1;
+			}
+			/* clear the screen when running top-style. */
+			if(count != 1) printf("\033[H\033[2J");
+			show(&last, have_older ? &older : NULL);
+			fflush(stdout);
+		}
+		if(count > 0) count--;
+		if(count != 0) usleep((useconds_t)(delay * 1e6));
+	}
+	return 0;
+}
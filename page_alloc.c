@@ -4,6 +4,9 @@
  ***************************************************************************/
 
 #include "page_alloc.h"
+#include "page_bitmap.h"
+#include "page_slab.h"
+#include "probes.h"
 
 #define ENABLE_STATS 1
 
@@ -11,6 +14,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
+#include <unistd.h>
 
 #if ENABLE_STATS
 #include <stdio.h>
@@ -18,19 +23,46 @@
 
 typedef struct Segment Segment;
 
-#if 0
-typedef uint32_t seg_t;
-#define INVALID_SEG 0xFFFFFFFF
-#else
-typedef uint64_t seg_t;
-#define INVALID_SEG 0xFFFFFFFFFF
-#endif
-
+/*
+ * Inside the allocator addresses are page numbers relative to 'base' and
+ * lengths are page counts, they are only converted at the public API.
+ *
+ * A node has five fields, so they are packed into bit-fields to keep it at
+ * 16 bytes (four nodes per cache line).  SEG_PAGE_BITS covers windows of up
+ * to 8Gbytes with 4K pages (the low window is at most 4Gbytes), larger
+ * windows use the bitmap engine.  SEG_ID_BITS is one bit wider, so there are
+ * always more node ids than free segments.
+ */
+#define SEG_PAGE_BITS 21
+#define SEG_ID_BITS 22
+
+typedef uint32_t seg_t;   /* node id. */
+typedef uint32_t page_t;  /* page number or page count. */
+
+#define INVALID_SEG (((seg_t)1 << SEG_ID_BITS) - 1)
+#define MAX_PAGES ((size_t)1 << SEG_PAGE_BITS)
+
+/*
+ * Free space is kept in an address-ordered treap.  Each node also tracks the
+ * largest free segment in its sub-tree, so address lookup, first-fit search
+ * and coalescing-insert are all O(log n).
+ *
+ * The bitmap engine's struct also starts with an 'engine' field, public
+ * functions check it and forward bitmap allocators to page_bitmap.c.
+ */
 struct PageAlloc {
+	PageAllocEngine engine;
+	PageSlab  slab;        /* holds this struct and the Segment array. */
+	uint8_t   *base;       /* address of page 0. */
+	size_t    page_shift;
+	page_t    pages;       /* size of the window. */
 	Segment   *seg;
 	seg_t     seg_len;
-	seg_t     free_list;   /* free memory list. */
+	seg_t     max_segs;    /* Segments that fit in the slab. */
+	seg_t     free_tree;   /* root of free memory tree. */
 	seg_t     unused_list; /* list of unused Segment structure. */
+	size_t    free_segs;   /* number of segments in the free tree. */
+	page_t    split;       /* requests this large are placed from the top, 0 disables. */
 #if ENABLE_STATS
 	seg_t     used_segs;
 	seg_t     peak_used_segs;
@@ -38,74 +70,215 @@ struct PageAlloc {
 };
 
 struct Segment {
-	seg_t   start;
-	seg_t   len;
-	seg_t   prev;
-	seg_t   next;
+	uint64_t  start:SEG_PAGE_BITS;
+	uint64_t  left:SEG_ID_BITS;
+	uint64_t  len:SEG_PAGE_BITS;
+	uint64_t  max_len:SEG_PAGE_BITS;  /* largest free segment in this sub-tree. */
+	uint64_t  right:SEG_ID_BITS;      /* also used to link unused segments. */
 };
 
-#define INIT_SEGS 4
+/* the Segment array starts on its own cache line after the struct. */
+#define SEG_OFFSET ((sizeof(PageAlloc) + 63) & ~(size_t)63)
 
-#define ADDR_TO_SEG(addr) (seg_t)((ptrdiff_t)(addr))
-#define SEG_TO_ADDR(seg) (uint8_t *)((ptrdiff_t)(seg))
+#define IS_BITMAP(palloc) ((palloc)->engine == PAGE_ALLOC_BITMAP)
+#define TO_BITMAP(palloc) ((PageBitmap *)(palloc))
 
-static void page_alloc_remove_seg(PageAlloc *palloc, seg_t id) {
-	Segment *cur;
-	Segment *prev;
-	Segment *next;
+/* rounds up to whole pages. */
+static inline page_t page_alloc_pages(PageAlloc *palloc, size_t len) {
+	return (len + ((size_t)1 << palloc->page_shift) - 1) >> palloc->page_shift;
+}
 
-	/* remove segment from free space list. */
-	cur = palloc->seg + id;
-	if(cur->prev != INVALID_SEG) {
-		prev = palloc->seg + cur->prev;
-		prev->next = cur->next;
+static inline page_t page_alloc_page(PageAlloc *palloc, uint8_t *addr) {
+	return (size_t)(addr - palloc->base) >> palloc->page_shift;
+}
+
+static inline uint8_t *page_alloc_addr(PageAlloc *palloc, page_t page) {
+	return palloc->base + ((size_t)page << palloc->page_shift);
+}
+
+static inline size_t page_alloc_bytes(PageAlloc *palloc, page_t pages) {
+	return (size_t)pages << palloc->page_shift;
+}
+
+/* [addr, addr + len) is inside the window, checked before a length is narrowed to a page_t. */
+static inline int page_alloc_in_window(PageAlloc *palloc, uint8_t *addr, size_t len) {
+	size_t size = page_alloc_bytes(palloc, palloc->pages);
+
+	if(addr < palloc->base || len > size) return 0;
+	return (size_t)(addr - palloc->base) <= (size - len);
+}
+
+/* treap priority, derived from the segment id so it doesn't need to be stored. */
+static uint32_t page_alloc_seg_priority(seg_t id) {
+	uint64_t h = (uint64_t)id;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (uint32_t)h;
+}
+
+static inline page_t page_alloc_max_len(PageAlloc *palloc, seg_t id) {
+	return (id == INVALID_SEG) ? 0 : palloc->seg[id].max_len;
+}
+
+static void page_alloc_update_seg(PageAlloc *palloc, seg_t id) {
+	Segment *seg = palloc->seg + id;
+	page_t max = seg->len;
+	page_t sub;
+
+	sub = page_alloc_max_len(palloc, seg->left);
+	if(sub > max) max = sub;
+	sub = page_alloc_max_len(palloc, seg->right);
+	if(sub > max) max = sub;
+	seg->max_len = max;
+}
+
+static seg_t page_alloc_rotate_right(PageAlloc *palloc, seg_t id) {
+	Segment *seg = palloc->seg + id;
+	seg_t left = seg->left;
+
+	seg->left = palloc->seg[left].right;
+	palloc->seg[left].right = id;
+	page_alloc_update_seg(palloc, id);
+	page_alloc_update_seg(palloc, left);
+	return left;
+}
+
+static seg_t page_alloc_rotate_left(PageAlloc *palloc, seg_t id) {
+	Segment *seg = palloc->seg + id;
+	seg_t right = seg->right;
+
+	seg->right = palloc->seg[right].left;
+	palloc->seg[right].left = id;
+	page_alloc_update_seg(palloc, id);
+	page_alloc_update_seg(palloc, right);
+	return right;
+}
+
+static seg_t page_alloc_tree_insert(PageAlloc *palloc, seg_t root, seg_t id) {
+	Segment *seg;
+
+	if(root == INVALID_SEG) {
+		page_alloc_update_seg(palloc, id);
+		return id;
+	}
+	seg = palloc->seg + root;
+	if(palloc->seg[id].start < seg->start) {
+		seg->left = page_alloc_tree_insert(palloc, seg->left, id);
+		if(page_alloc_seg_priority(seg->left) > page_alloc_seg_priority(root)) {
+			return page_alloc_rotate_right(palloc, root);
+		}
+	} else {
+		seg->right = page_alloc_tree_insert(palloc, seg->right, id);
+		if(page_alloc_seg_priority(seg->right) > page_alloc_seg_priority(root)) {
+			return page_alloc_rotate_left(palloc, root);
+		}
+	}
+	page_alloc_update_seg(palloc, root);
+	return root;
+}
+
+/* join two sub-trees, every segment in 'left' is below every segment in 'right'. */
+static seg_t page_alloc_tree_join(PageAlloc *palloc, seg_t left, seg_t right) {
+	if(left == INVALID_SEG) return right;
+	if(right == INVALID_SEG) return left;
+	if(page_alloc_seg_priority(left) > page_alloc_seg_priority(right)) {
+		palloc->seg[left].right = page_alloc_tree_join(palloc, palloc->seg[left].right, right);
+		page_alloc_update_seg(palloc, left);
+		return left;
+	}
+	palloc->seg[right].left = page_alloc_tree_join(palloc, left, palloc->seg[right].left);
+	page_alloc_update_seg(palloc, right);
+	return right;
+}
+
+static seg_t page_alloc_tree_unlink(PageAlloc *palloc, seg_t root, page_t start) {
+	Segment *seg;
+
+	if(root == INVALID_SEG) return INVALID_SEG;
+	seg = palloc->seg + root;
+	if(start < seg->start) {
+		seg->left = page_alloc_tree_unlink(palloc, seg->left, start);
+	} else if(start > seg->start) {
+		seg->right = page_alloc_tree_unlink(palloc, seg->right, start);
 	} else {
-		/* removing the first segment in the free space list. */
-		palloc->free_list = cur->next;
+		return page_alloc_tree_join(palloc, seg->left, seg->right);
 	}
-	if(cur->next != INVALID_SEG) {
-		next = palloc->seg + cur->next;
-		next->prev = cur->prev;
+	page_alloc_update_seg(palloc, root);
+	return root;
+}
+
+/* refresh 'max_len' on the path to a segment after its start/len changed. */
+static void page_alloc_tree_fixup(PageAlloc *palloc, seg_t root, page_t start) {
+	Segment *seg;
+
+	if(root == INVALID_SEG) return;
+	seg = palloc->seg + root;
+	if(start < seg->start) {
+		page_alloc_tree_fixup(palloc, seg->left, start);
+	} else if(start > seg->start) {
+		page_alloc_tree_fixup(palloc, seg->right, start);
 	}
+	page_alloc_update_seg(palloc, root);
+}
+
+static void page_alloc_remove_seg(PageAlloc *palloc, seg_t id) {
+	Segment *cur;
+
+	/* remove segment from free space tree. */
+	cur = palloc->seg + id;
+	palloc->free_tree = page_alloc_tree_unlink(palloc, palloc->free_tree, cur->start);
+	palloc->free_segs--;
 
 	/* add to head of unused segment list. */
-	cur->start = INVALID_SEG;
+	cur->start = 0;
 	cur->len = 0;
-	cur->prev = INVALID_SEG;
-	cur->next = palloc->unused_list;
+	cur->max_len = 0;
+	cur->left = INVALID_SEG;
+	cur->right = palloc->unused_list;
 #if ENABLE_STATS
 	palloc->used_segs--;
 #endif
 	palloc->unused_list = id;
 }
 
-static void page_alloc_grow_list(PageAlloc *palloc, seg_t new_len) {
-	Segment *seg;
+/* make more Segments usable, the slab at least doubles so they never move. */
+static int page_alloc_grow_list(PageAlloc *palloc) {
+	Segment *seg = palloc->seg;
 	seg_t old_len = palloc->seg_len;
+	seg_t new_len;
+	seg_t i;
+	seg_t next;
 
-	seg = (Segment *)realloc(palloc->seg, new_len * sizeof(Segment));
-	palloc->seg = seg;
-	palloc->seg_len = new_len;
-	if(old_len < new_len) {
-		seg_t i = new_len;
-		seg_t next = palloc->unused_list;
-		/* add new segments to list of unused segments. */
-		do {
-			i--;
-			seg[i].start = INVALID_SEG;
-			seg[i].len = 0;
-			seg[i].prev = INVALID_SEG;
-			seg[i].next = next;
-			next = i;
-		} while(i > old_len);
-		palloc->unused_list = old_len;
+	if(old_len >= palloc->max_segs) return -1;
+	if(page_slab_grow(&(palloc->slab), SEG_OFFSET + ((size_t)old_len + 1) * sizeof(Segment)) != 0) {
+		return -1;
 	}
+	new_len = (palloc->slab.committed - SEG_OFFSET) / sizeof(Segment);
+	if(new_len > palloc->max_segs) new_len = palloc->max_segs;
+	palloc->seg_len = new_len;
+	/* add new segments to list of unused segments. */
+	i = new_len;
+	next = palloc->unused_list;
+	do {
+		i--;
+		seg[i].start = 0;
+		seg[i].len = 0;
+		seg[i].max_len = 0;
+		seg[i].left = INVALID_SEG;
+		seg[i].right = next;
+		next = i;
+	} while(i > old_len);
+	palloc->unused_list = old_len;
+	return 0;
 }
 
 static seg_t page_alloc_get_unused_seg(PageAlloc *palloc) {
 	seg_t id = palloc->unused_list;
 	if(id == INVALID_SEG) {
-		page_alloc_grow_list(palloc, palloc->seg_len + 100);
+		if(page_alloc_grow_list(palloc) != 0) return INVALID_SEG;
 		id = palloc->unused_list;
 	}
 #if ENABLE_STATS
@@ -114,181 +287,327 @@ static seg_t page_alloc_get_unused_seg(PageAlloc *palloc) {
 		palloc->peak_used_segs = palloc->used_segs;
 	}
 #endif
-	palloc->unused_list = palloc->seg[id].next;
+	palloc->unused_list = palloc->seg[id].right;
 	return id;
 }
 
-static seg_t page_alloc_find_addr(PageAlloc *palloc, seg_t addr) {
+/* make sure page_alloc_new_seg() can't fail. */
+static inline int page_alloc_have_unused_seg(PageAlloc *palloc) {
+	if(palloc->unused_list != INVALID_SEG) return 0;
+	return page_alloc_grow_list(palloc);
+}
+
+/* returns -1 if the system is out of memory for another Segment, nothing is changed then. */
+static int page_alloc_new_seg(PageAlloc *palloc, page_t start, page_t len) {
+	Segment *seg;
+	seg_t id;
+
+	id = page_alloc_get_unused_seg(palloc);
+	if(id == INVALID_SEG) return -1;
+	seg = palloc->seg + id;
+	seg->start = start;
+	seg->len = len;
+	seg->left = INVALID_SEG;
+	seg->right = INVALID_SEG;
+	palloc->free_tree = page_alloc_tree_insert(palloc, palloc->free_tree, id);
+	palloc->free_segs++;
+	return 0;
+}
+
+/* find the free segment with the highest start page <= 'page'. */
+static seg_t page_alloc_find_page(PageAlloc *palloc, page_t page) {
 	Segment *seg;
 	seg_t prev;
 	seg_t cur;
 
 	prev = INVALID_SEG;
-	cur = palloc->free_list;
+	cur = palloc->free_tree;
 	while(cur != INVALID_SEG) {
 		seg = palloc->seg + cur;
-		if(addr <= seg->start) {
-			if(addr == seg->start) {
-				/* found perfect match. */
-				return cur;
-			}
-			/* address might be in range of previous segment. */
-			return prev;
+		if(page < seg->start) {
+			cur = seg->left;
+		} else if(page > seg->start) {
+			/* page might be in range of this segment. */
+			prev = cur;
+			cur = seg->right;
+		} else {
+			/* found perfect match. */
+			return cur;
 		}
-		prev = cur;
-		cur = seg->next;
 	}
 	return prev;
 }
 
-static seg_t page_alloc_free_space(PageAlloc *palloc, seg_t len) {
+static seg_t page_alloc_free_space(PageAlloc *palloc, page_t len) {
 	Segment *seg;
 	seg_t cur;
 
-	/* first-fit search. */
-	cur = palloc->free_list;
+	/* first-fit search, guided by the largest free segment of each sub-tree. */
+	cur = palloc->free_tree;
 	while(cur != INVALID_SEG) {
 		seg = palloc->seg + cur;
-		if(len <= seg->len) break;
-		cur = seg->next;
+		if(len <= page_alloc_max_len(palloc, seg->left)) {
+			cur = seg->left;
+		} else if(len <= seg->len) {
+			break;
+		} else if(len <= page_alloc_max_len(palloc, seg->right)) {
+			cur = seg->right;
+		} else {
+			return INVALID_SEG;
+		}
 	}
 	return cur;
 }
 
-static void page_alloc_add_free_seg(PageAlloc *palloc, seg_t addr, seg_t len) {
+/* first page of 'seg' on a multiple of 'align' pages, alignment is relative to address zero. */
+static inline size_t page_alloc_align_start(PageAlloc *palloc, Segment *seg, size_t align) {
+	size_t base = (size_t)palloc->base >> palloc->page_shift;
+	return ((base + seg->start + align - 1) & ~(align - 1)) - base;
+}
+
+/* first-fit search for a segment that can hold 'len' pages starting at a multiple of 'align'. */
+static seg_t page_alloc_free_aligned(PageAlloc *palloc, seg_t root, page_t len, size_t align) {
+	Segment *seg;
+	seg_t id;
+
+	/* skip sub-trees without any segment that is large enough. */
+	if(page_alloc_max_len(palloc, root) < len) return INVALID_SEG;
+	seg = palloc->seg + root;
+	id = page_alloc_free_aligned(palloc, seg->left, len, align);
+	if(id != INVALID_SEG) return id;
+	if((page_alloc_align_start(palloc, seg, align) + len) <= ((size_t)seg->start + seg->len)) return root;
+	return page_alloc_free_aligned(palloc, seg->right, len, align);
+}
+
+#define NO_FIT ((size_t)-1)
+
+/* highest page of 'seg' on a multiple of 'align' pages with room for 'len' pages after it, NO_FIT if none. */
+static inline size_t page_alloc_align_end(PageAlloc *palloc, Segment *seg, page_t len, size_t align) {
+	size_t base = (size_t)palloc->base >> palloc->page_shift;
+	size_t start;
+
+	if(seg->len < len) return NO_FIT;
+	start = ((base + seg->start + seg->len - len) & ~(align - 1));
+	return (start >= (base + seg->start)) ? (start - base) : NO_FIT;
+}
+
+/* last-fit search, the mirror of page_alloc_free_aligned(). */
+static seg_t page_alloc_free_last(PageAlloc *palloc, seg_t root, page_t len, size_t align) {
+	Segment *seg;
 	seg_t id;
+
+	if(page_alloc_max_len(palloc, root) < len) return INVALID_SEG;
+	seg = palloc->seg + root;
+	id = page_alloc_free_last(palloc, seg->right, len, align);
+	if(id != INVALID_SEG) return id;
+	if(page_alloc_align_end(palloc, seg, len, align) != NO_FIT) return root;
+	return page_alloc_free_last(palloc, seg->left, len, align);
+}
+
+static int page_alloc_add_free_seg(PageAlloc *palloc, page_t start, page_t len) {
 	Segment *seg;
-	seg_t *prev_p;
 	seg_t prev;
+	seg_t next;
 	seg_t cur;
 
-	/* find first segment with higher start address. */
+	/* find the segments just before and after the free space. */
 	prev = INVALID_SEG;
-	prev_p = &(palloc->free_list);
-	cur = palloc->free_list;
+	next = INVALID_SEG;
+	cur = palloc->free_tree;
 	while(cur != INVALID_SEG) {
 		seg = palloc->seg + cur;
-		if(addr < seg->start) break;
-		prev = cur;
-		prev_p = &(seg->next);
-		cur = seg->next;
+		if(start < seg->start) {
+			next = cur;
+			cur = seg->left;
+		} else {
+			prev = cur;
+			cur = seg->right;
+		}
 	}
 
-	/* try to merge free space in to found segment. */
-	if(cur != INVALID_SEG) {
-		/* current segment is after free space. */
-		if((addr + len) == seg->start) {
-			/* pre-append free space on the start of segment. */
-			seg->start = addr;
-			seg->len += len;
+	/* try to merge free space in to next segment. */
+	if(next != INVALID_SEG) {
+		seg = palloc->seg + next;
+		if((start + len) == seg->start) {
 			/* try merging with previous segment. */
 			if(prev != INVALID_SEG) {
 				Segment *prev_s = palloc->seg + prev;
-				if(addr == (prev_s->start + prev_s->len)) {
-					/* merge space into previous segment. */
-					prev_s->len += seg->len;
-					page_alloc_remove_seg(palloc, cur);
+				if(start == (prev_s->start + prev_s->len)) {
+					/* merge free space and next segment into previous segment. */
+					prev_s->len += len + seg->len;
+					page_alloc_remove_seg(palloc, next);
+					page_alloc_tree_fixup(palloc, palloc->free_tree, prev_s->start);
+					LOWMEM_PROBE4(palloc_coalesce, page_alloc_addr(palloc, start),
+						page_alloc_bytes(palloc, len), 3, palloc->free_segs);
+					return 0;
 				}
 			}
-			return;
+			/* pre-append free space on the start of segment. */
+			seg->start = start;
+			seg->len += len;
+			page_alloc_tree_fixup(palloc, palloc->free_tree, start);
+			LOWMEM_PROBE4(palloc_coalesce, page_alloc_addr(palloc, start),
+				page_alloc_bytes(palloc, len), 2, palloc->free_segs);
+			return 0;
 		}
-		if(prev != INVALID_SEG) {
-			/* try to merge free space into previous segment. */
-			seg = palloc->seg + prev;
-			if(addr == (seg->start + seg->len)) {
-				/* append free space to end of the segment. */
-				seg->len += len;
-				/* we already know that the free space can't be merged with the next segment. */
-				return;
-			}
+	}
+	if(prev != INVALID_SEG) {
+		/* try to merge free space into previous segment. */
+		seg = palloc->seg + prev;
+		if(start == (seg->start + seg->len)) {
+			/* append free space to end of the segment. */
+			seg->len += len;
+			/* we already know that the free space can't be merged with the next segment. */
+			page_alloc_tree_fixup(palloc, palloc->free_tree, seg->start);
+			LOWMEM_PROBE4(palloc_coalesce, page_alloc_addr(palloc, start),
+				page_alloc_bytes(palloc, len), 1, palloc->free_segs);
+			return 0;
 		}
-		/* free space can't be merged with current/previous segments. */
 	}
 
-	/* setup a new segment */
-	id = page_alloc_get_unused_seg(palloc);
-	seg = palloc->seg + id;
-	seg->start = addr;
-	seg->len = len;
-	/* insert segment into free space list. */
-	*prev_p = id;
-	seg->prev = prev;
-	seg->next = cur;
-	if(cur != INVALID_SEG) {
-		palloc->seg[cur].prev = id;
-	}
+	/* free space can't be merged with next/previous segments. */
+	if(page_alloc_new_seg(palloc, start, len) != 0) return -1;
+	LOWMEM_PROBE4(palloc_coalesce, page_alloc_addr(palloc, start),
+		page_alloc_bytes(palloc, len), 0, palloc->free_segs);
+	return 0;
+}
 
+PageAllocEngine page_alloc_engine_by_name(const char *name, PageAllocEngine def) {
+	if(name == NULL) return def;
+	if(strcmp(name, "tree") == 0) return PAGE_ALLOC_TREE;
+	if(strcmp(name, "bitmap") == 0) return PAGE_ALLOC_BITMAP;
+	return def;
 }
 
 PageAlloc *page_alloc_new(uint8_t *addr, size_t len) {
-	PageAlloc *palloc;
+	return page_alloc_new_engine(PAGE_ALLOC_DEFAULT_ENGINE, addr, len);
+}
 
-	palloc = (PageAlloc *)calloc(1, sizeof(PageAlloc));
+PageAlloc *page_alloc_new_engine(PageAllocEngine engine, uint8_t *addr, size_t len) {
+	PageAlloc *palloc;
+	PageSlab slab;
+	long page_size = sysconf(_SC_PAGE_SIZE);
+	size_t page_shift = __builtin_ctzll((uint64_t)page_size);
+	size_t pages = len >> page_shift;
+	size_t max_segs;
+
+	/* the tree's page numbers can't index windows that large. */
+	if(engine == PAGE_ALLOC_BITMAP || pages >= MAX_PAGES) {
+		return page_bitmap_new(addr, len);
+	}
 
-	palloc->free_list = INVALID_SEG;
+	/* free segments are separated by used pages, a cut can need one more. */
+	max_segs = (pages / 2) + 2;
+	if(page_slab_init(&slab, SEG_OFFSET + (max_segs * sizeof(Segment)), page_size) != 0) {
+		return NULL;
+	}
+	palloc = (PageAlloc *)slab.base;
+
+	palloc->engine = PAGE_ALLOC_TREE;
+	palloc->slab = slab;
+	palloc->base = addr;
+	palloc->page_shift = page_shift;
+	palloc->pages = pages;
+	palloc->free_tree = INVALID_SEG;
+	palloc->split = 0;
 	palloc->unused_list = INVALID_SEG;
+	palloc->seg = (Segment *)(slab.base + SEG_OFFSET);
 	palloc->seg_len = 0;
-	palloc->seg = NULL;
-	page_alloc_grow_list(palloc, INIT_SEGS);
+	palloc->max_segs = max_segs;
+	if(page_alloc_grow_list(palloc) != 0) {
+		page_slab_free(&slab);
+		return NULL;
+	}
 
 	/* add free space. */
-	page_alloc_add_free_seg(palloc, ADDR_TO_SEG(addr), len);
+	if(palloc->pages > 0) {
+		page_alloc_add_free_seg(palloc, 0, palloc->pages);
+	}
 
 	return palloc;
 }
 
-static uint8_t *page_alloc_cut_segment(PageAlloc *palloc, seg_t id, uint8_t *addr, size_t len) {
-	Segment *seg;
-	seg_t start;
+void page_alloc_free(PageAlloc *palloc) {
+	PageSlab slab;
 
-	seg = palloc->seg + id;
-	start = ADDR_TO_SEG(addr);
-	if(start != seg->start) {
-		Segment *extra;
-		seg_t extra_id;
-		seg_t extra_len;
-		seg_t prev;
-
-		/* trim extra free space from start of segment. */
-		extra_id = page_alloc_get_unused_seg(palloc);
-		extra = palloc->seg + extra_id;
-		extra_len = (start - seg->start);
-		extra->start = seg->start;
-		extra->len = extra_len;
-		seg->start = start;
-		seg->len -= extra_len;
-
-		/* insert new segment. */
-		prev = seg->prev;
-		extra->prev = prev;
-		extra->next = id;
-		if(prev == INVALID_SEG) {
-			palloc->free_list = extra_id;
-		} else {
-			palloc->seg[prev].next = extra_id;
-		}
-		seg->prev = extra_id;
+	if(IS_BITMAP(palloc)) {
+		page_bitmap_free(TO_BITMAP(palloc));
+		return;
 	}
+	slab = palloc->slab;
+	page_slab_free(&slab);
+}
+
+/* take 'len' pages from the front of a free segment. */
+static void page_alloc_trim_start(PageAlloc *palloc, seg_t id, page_t len) {
+	Segment *seg = palloc->seg + id;
 
-	/* trim requested space from start of segment. */
+	LOWMEM_PROBE3(palloc_cut, page_alloc_addr(palloc, seg->start), page_alloc_bytes(palloc, len),
+		palloc->free_segs);
+	if(seg->len == len) {
+		page_alloc_remove_seg(palloc, id);
+		return;
+	}
+	seg->start += len;
 	seg->len -= len;
-	if(seg->len == 0) {
+	page_alloc_tree_fixup(palloc, palloc->free_tree, seg->start);
+}
+
+/* take 'len' pages from the end of a free segment. */
+static void page_alloc_trim_end(PageAlloc *palloc, seg_t id, page_t len) {
+	Segment *seg = palloc->seg + id;
+
+	LOWMEM_PROBE3(palloc_cut, page_alloc_addr(palloc, seg->start + seg->len - len),
+		page_alloc_bytes(palloc, len), palloc->free_segs);
+	if(seg->len == len) {
 		page_alloc_remove_seg(palloc, id);
-	} else {
-		seg->start += len;
+		return;
 	}
-	return addr;
+	seg->len -= len;
+	page_alloc_tree_fixup(palloc, palloc->free_tree, seg->start);
+}
+
+/* allocate pages [start, start + len) from free segment 'id', returns NULL if the system is
+ * out of memory for the Segment of the free space after the range. */
+static uint8_t *page_alloc_cut_segment(PageAlloc *palloc, seg_t id, page_t start, page_t len) {
+	Segment *seg;
+	page_t end;
+	page_t tail_len;
+
+	seg = palloc->seg + id;
+	if(start == seg->start) {
+		/* trim requested space from start of segment. */
+		page_alloc_trim_start(palloc, id, len);
+		return page_alloc_addr(palloc, start);
+	}
+
+	/* keep the extra free space at the start of the segment. */
+	end = seg->start + seg->len;
+	tail_len = end - (start + len);
+	if(tail_len > 0 && page_alloc_have_unused_seg(palloc) != 0) return NULL;
+	page_alloc_trim_end(palloc, id, end - start);
+	if(tail_len > 0) {
+		/* split off the free space after the requested range. */
+		page_alloc_new_seg(palloc, start + len, tail_len);
+	}
+	return page_alloc_addr(palloc, start);
 }
 
 uint8_t *page_alloc_get_segment(PageAlloc *palloc, uint8_t *addr, size_t len) {
 	Segment *seg;
-	seg_t seg_end;
-	seg_t start;
+	page_t seg_end;
+	page_t start;
+	page_t count;
 	seg_t id;
 
-	if(addr != NULL) {
-		start = ADDR_TO_SEG(addr);
-		id = page_alloc_find_addr(palloc, start);
+	if(IS_BITMAP(palloc)) {
+		return page_bitmap_get_segment(TO_BITMAP(palloc), addr, len);
+	}
+	if(len == 0 || len > page_alloc_bytes(palloc, palloc->pages)) return NULL;
+	count = page_alloc_pages(palloc, len);
+	if(addr != NULL && addr >= palloc->base && page_alloc_page(palloc, addr) < palloc->pages) {
+		start = page_alloc_page(palloc, addr);
+		id = page_alloc_find_page(palloc, start);
 		if(id == INVALID_SEG) {
 			/* failed to find a segment close to the address. */
 			goto find_free_space;
@@ -296,64 +615,114 @@ uint8_t *page_alloc_get_segment(PageAlloc *palloc, uint8_t *addr, size_t len) {
 		seg = palloc->seg + id;
 		/* make sure the requested range doesn't overlap a segment boundry. */
 		seg_end = seg->start + seg->len;
-		if((start + len) <= seg_end) {
+		if(((size_t)start + count) <= seg_end) {
 			/* the requested address range is available. */
-			return page_alloc_cut_segment(palloc, id, addr, len);
+			return page_alloc_cut_segment(palloc, id, start, count);
 		}
 		/* check if current segment is large enough for requested length. */
-		if(len <= seg->len) {
+		if(count <= seg->len) {
 			/* trim space from end of segment. */
-			seg->len -= len;
-			if(seg->len == 0) {
-				addr = SEG_TO_ADDR(seg->start);
-				page_alloc_remove_seg(palloc, id);
-			} else {
-				addr = SEG_TO_ADDR(seg->start + seg->len);
-			}
+			addr = page_alloc_addr(palloc, seg_end - count);
+			page_alloc_trim_end(palloc, id, count);
 			return addr;
 		}
 		/* can't allocate requested range. */
 		/* ignore address hint and look for free space. */
 	}
 find_free_space:
+	if(palloc->split > 0 && count >= palloc->split) {
+		/* large request, cut it from the end of the last segment that is large enough. */
+		id = page_alloc_free_last(palloc, palloc->free_tree, count, 1);
+		LOWMEM_PROBE3(palloc_search, len,
+			(id == INVALID_SEG) ? NULL : page_alloc_addr(palloc, palloc->seg[id].start), palloc->free_segs);
+		if(id == INVALID_SEG) return NULL;
+		seg = palloc->seg + id;
+		addr = page_alloc_addr(palloc, seg->start + seg->len - count);
+		page_alloc_trim_end(palloc, id, count);
+		return addr;
+	}
 	/* find the first segment that is large enough. */
-	id = page_alloc_free_space(palloc, len);
+	id = page_alloc_free_space(palloc, count);
+	LOWMEM_PROBE3(palloc_search, len,
+		(id == INVALID_SEG) ? NULL : page_alloc_addr(palloc, palloc->seg[id].start), palloc->free_segs);
 	if(id == INVALID_SEG) return NULL;
 	/* cut space from start of free space. */
-	seg = palloc->seg + id;
-	addr = SEG_TO_ADDR(seg->start);
-	seg->start += len;
-	seg->len -= len;
-	if(seg->len == 0) {
-		page_alloc_remove_seg(palloc, id);
-	}
+	addr = page_alloc_addr(palloc, palloc->seg[id].start);
+	page_alloc_trim_start(palloc, id, count);
 	return addr;
 }
 
+uint8_t *page_alloc_get_aligned_segment(PageAlloc *palloc, size_t len, size_t align) {
+	page_t count;
+	seg_t id;
+
+	if(IS_BITMAP(palloc)) {
+		return page_bitmap_get_aligned_segment(TO_BITMAP(palloc), len, align);
+	}
+	if(len == 0 || len > page_alloc_bytes(palloc, palloc->pages)) return NULL;
+	count = page_alloc_pages(palloc, len);
+	align >>= palloc->page_shift;
+	if(align < 1) align = 1;
+	if(palloc->split > 0 && count >= palloc->split) {
+		id = page_alloc_free_last(palloc, palloc->free_tree, count, align);
+		LOWMEM_PROBE3(palloc_search, len,
+			(id == INVALID_SEG) ? NULL : page_alloc_addr(palloc, palloc->seg[id].start), palloc->free_segs);
+		if(id == INVALID_SEG) return NULL;
+		return page_alloc_cut_segment(palloc, id,
+			page_alloc_align_end(palloc, palloc->seg + id, count, align), count);
+	}
+	id = page_alloc_free_aligned(palloc, palloc->free_tree, count, align);
+	LOWMEM_PROBE3(palloc_search, len,
+		(id == INVALID_SEG) ? NULL : page_alloc_addr(palloc, palloc->seg[id].start), palloc->free_segs);
+	if(id == INVALID_SEG) return NULL;
+	return page_alloc_cut_segment(palloc, id,
+		page_alloc_align_start(palloc, palloc->seg + id, align), count);
+}
+
+void page_alloc_set_split(PageAlloc *palloc, size_t threshold) {
+	if(IS_BITMAP(palloc)) {
+		page_bitmap_set_split(TO_BITMAP(palloc), threshold);
+		return;
+	}
+	/* nothing is large in a window smaller than the threshold. */
+	if(threshold > page_alloc_bytes(palloc, palloc->pages)) threshold = 0;
+	palloc->split = page_alloc_pages(palloc, threshold);
+}
+
 uint8_t *page_alloc_resize_segment(PageAlloc *palloc, uint8_t *addr, size_t len, size_t new_len) {
-	seg_t end_addr = ADDR_TO_SEG(addr + len);
+	page_t start;
+	page_t count;
+	page_t new_count;
+	page_t end;
 	Segment *seg;
 	seg_t cur;
-	if(new_len < len) {
+
+	if(IS_BITMAP(palloc)) {
+		return page_bitmap_resize_segment(TO_BITMAP(palloc), addr, len, new_len);
+	}
+	if(!page_alloc_in_window(palloc, addr, (new_len > len) ? new_len : len)) return NULL;
+	start = page_alloc_page(palloc, addr);
+	count = page_alloc_pages(palloc, len);
+	new_count = page_alloc_pages(palloc, new_len);
+	if(new_count <= count) {
 		/* shrink allocated segment */
-		page_alloc_add_free_seg(palloc, ADDR_TO_SEG(addr + new_len), len - new_len);
+		if(new_count < count &&
+				page_alloc_add_free_seg(palloc, start + new_count, count - new_count) != 0) {
+			return NULL;
+		}
 		return addr;
 	}
 
 	/* find next free segment. */
-	cur = page_alloc_find_addr(palloc, end_addr);
+	end = start + count;
+	cur = page_alloc_find_page(palloc, end);
 	if(cur == INVALID_SEG) return NULL;
 	seg = palloc->seg + cur;
-	if(end_addr == seg->start) {
-		seg_t need = new_len - len;
+	if(end == seg->start) {
+		page_t need = new_count - count;
 		if(need <= seg->len) {
 			/* we can grow the allocated segment */
-			seg->len -= need;
-			if(seg->len == 0) {
-				page_alloc_remove_seg(palloc, cur);
-			} else {
-				seg->start += need;
-			}
+			page_alloc_trim_start(palloc, cur, need);
 			return addr;
 		}
 	}
@@ -363,15 +732,223 @@ uint8_t *page_alloc_resize_segment(PageAlloc *palloc, uint8_t *addr, size_t len,
 }
 
 int page_alloc_release_segment(PageAlloc *palloc, uint8_t *addr, size_t len) {
+	page_t count;
+
+	if(IS_BITMAP(palloc)) {
+		return page_bitmap_release_segment(TO_BITMAP(palloc), addr, len);
+	}
+	if(!page_alloc_in_window(palloc, addr, len)) return -1;
+	count = page_alloc_pages(palloc, len);
+	if(count == 0) return 0;
 	/* add free space. */
-	page_alloc_add_free_seg(palloc, ADDR_TO_SEG(addr), len);
+	return page_alloc_add_free_seg(palloc, page_alloc_page(palloc, addr), count);
+}
+
+int page_alloc_reserve_segment(PageAlloc *palloc, uint8_t *addr, size_t len) {
+	Segment *seg;
+	page_t start;
+	page_t count;
+	seg_t id;
+
+	if(IS_BITMAP(palloc)) {
+		return page_bitmap_reserve_segment(TO_BITMAP(palloc), addr, len);
+	}
+	if(!page_alloc_in_window(palloc, addr, len)) return -1;
+	start = page_alloc_page(palloc, addr);
+	count = page_alloc_pages(palloc, len);
+	id = page_alloc_find_page(palloc, start);
+	if(id == INVALID_SEG) return -1;
+	seg = palloc->seg + id;
+	if(((size_t)start + count) > ((size_t)seg->start + seg->len)) return -1;
+	if(page_alloc_cut_segment(palloc, id, start, count) == NULL) return -1;
 	return 0;
 }
 
+/* enough for every free range of a 4Gbyte window of 4K pages. */
+#define CLAIM_MAX (((size_t)1 << 19) + 1)
+
+void page_alloc_claim_init(PageAllocClaim *claim) {
+	claim->count = 0;
+	claim->max = PAGE_ALLOC_CLAIM_INLINE;
+	claim->range = claim->inline_range;
+	claim->slab.base = NULL;
+}
+
+void page_alloc_claim_free(PageAllocClaim *claim) {
+	if(claim->slab.base != NULL) {
+		page_slab_free(&(claim->slab));
+	}
+	page_alloc_claim_init(claim);
+}
+
+static int page_alloc_claim_add(PageAllocClaim *claim, uint8_t *addr, size_t len) {
+	if(claim->count == claim->max) {
+		if(claim->slab.base == NULL) {
+			/* move the ranges to a slab that can hold them all. */
+			if(page_slab_init(&(claim->slab), CLAIM_MAX * sizeof(PageAllocRange),
+					2 * PAGE_ALLOC_CLAIM_INLINE * sizeof(PageAllocRange)) != 0) {
+				claim->slab.base = NULL;
+				return -1;
+			}
+			memcpy(claim->slab.base, claim->inline_range, claim->count * sizeof(PageAllocRange));
+			claim->range = (PageAllocRange *)claim->slab.base;
+		}
+		if(page_slab_grow(&(claim->slab), (claim->count + 1) * sizeof(PageAllocRange)) != 0) return -1;
+		claim->max = claim->slab.committed / sizeof(PageAllocRange);
+	}
+	claim->range[claim->count].addr = addr;
+	claim->range[claim->count].len = len;
+	claim->count++;
+	return 0;
+}
+
+int page_alloc_claim(PageAlloc *palloc, uint8_t *addr, size_t len, PageAllocClaim *claim) {
+	uint8_t *end = addr + len;
+	size_t n;
+
+	while(addr < end) {
+		n = page_alloc_free_at(palloc, addr);
+		if(n > 0) {
+			if(n > (size_t)(end - addr)) n = end - addr;
+			if(claim != NULL && page_alloc_claim_add(claim, addr, n) != 0) return -1;
+			if(page_alloc_reserve_segment(palloc, addr, n) != 0) {
+				/* the range is still free, don't give it back with the claim. */
+				if(claim != NULL) claim->count--;
+				return -1;
+			}
+		} else {
+			n = page_alloc_used_at(palloc, addr);
+			if(n == 0) break;
+		}
+		addr += n;
+	}
+	return 0;
+}
+
+size_t page_alloc_free_at(PageAlloc *palloc, uint8_t *addr) {
+	page_t start;
+	page_t seg_end;
+	seg_t id;
+
+	if(IS_BITMAP(palloc)) {
+		return page_bitmap_free_at(TO_BITMAP(palloc), addr);
+	}
+	if(addr < palloc->base) return 0;
+	start = page_alloc_page(palloc, addr);
+	id = page_alloc_find_page(palloc, start);
+	if(id == INVALID_SEG) return 0;
+	seg_end = palloc->seg[id].start + palloc->seg[id].len;
+	return (start < seg_end) ? page_alloc_bytes(palloc, seg_end - start) : 0;
+}
+
+size_t page_alloc_free_before(PageAlloc *palloc, uint8_t *addr) {
+	Segment *seg;
+	page_t end;
+	seg_t id;
+
+	if(IS_BITMAP(palloc)) {
+		return page_bitmap_free_before(TO_BITMAP(palloc), addr);
+	}
+	if(addr <= palloc->base) return 0;
+	end = page_alloc_page(palloc, addr);
+	id = page_alloc_find_page(palloc, end - 1);
+	if(id == INVALID_SEG) return 0;
+	seg = palloc->seg + id;
+	return (end <= (seg->start + seg->len)) ? page_alloc_bytes(palloc, end - seg->start) : 0;
+}
+
+size_t page_alloc_used_at(PageAlloc *palloc, uint8_t *addr) {
+	Segment *seg;
+	page_t page;
+	page_t next;
+	seg_t cur;
+
+	if(IS_BITMAP(palloc)) {
+		return page_bitmap_used_at(TO_BITMAP(palloc), addr);
+	}
+	if(addr < palloc->base) return 0;
+	page = page_alloc_page(palloc, addr);
+	if(page >= palloc->pages) return 0;
+	/* find the first free segment after 'page', and make sure 'page' isn't inside the one before. */
+	next = palloc->pages;
+	cur = palloc->free_tree;
+	while(cur != INVALID_SEG) {
+		seg = palloc->seg + cur;
+		if(page < seg->start) {
+			next = seg->start;
+			cur = seg->left;
+		} else if(page < (seg->start + seg->len)) {
+			return 0;
+		} else {
+			cur = seg->right;
+		}
+	}
+	return page_alloc_bytes(palloc, next - page);
+}
+
+static void page_alloc_tree_stats(PageAlloc *palloc, seg_t id, PageAllocStats *stats) {
+	while(id != INVALID_SEG) {
+		Segment *seg = palloc->seg + id;
+		stats->free_bytes += page_alloc_bytes(palloc, seg->len);
+		stats->free_segs++;
+		page_alloc_tree_stats(palloc, seg->left, stats);
+		id = seg->right;
+	}
+}
+
+void page_alloc_get_stats(PageAlloc *palloc, PageAllocStats *stats) {
+	if(IS_BITMAP(palloc)) {
+		page_bitmap_get_stats(TO_BITMAP(palloc), stats);
+		return;
+	}
+	stats->free_bytes = 0;
+	stats->free_segs = 0;
+	page_alloc_tree_stats(palloc, palloc->free_tree, stats);
+	/* the root knows the largest free segment. */
+	stats->largest_free = page_alloc_bytes(palloc, page_alloc_max_len(palloc, palloc->free_tree));
+}
+
+double page_alloc_fragmentation(size_t largest_free, size_t free_bytes) {
+	if(free_bytes == 0) return 0.0;
+	return 1.0 - ((double)largest_free / (double)free_bytes);
+}
+
+static void page_alloc_tree_walk(PageAlloc *palloc, seg_t id, PageAllocWalkFn fn, void *data) {
+	while(id != INVALID_SEG) {
+		Segment *seg = palloc->seg + id;
+		page_alloc_tree_walk(palloc, seg->left, fn, data);
+		fn(data, page_alloc_addr(palloc, seg->start), page_alloc_bytes(palloc, seg->len));
+		id = seg->right;
+	}
+}
+
+size_t page_alloc_free_segs(PageAlloc *palloc) {
+	if(IS_BITMAP(palloc)) {
+		return page_bitmap_free_segs(TO_BITMAP(palloc));
+	}
+	return palloc->free_segs;
+}
+
+size_t page_alloc_largest_free(PageAlloc *palloc) {
+	if(IS_BITMAP(palloc)) return 0;
+	return page_alloc_bytes(palloc, page_alloc_max_len(palloc, palloc->free_tree));
+}
+
+void page_alloc_walk_free(PageAlloc *palloc, PageAllocWalkFn fn, void *data) {
+	if(IS_BITMAP(palloc)) {
+		page_bitmap_walk_free(TO_BITMAP(palloc), fn, data);
+		return;
+	}
+	page_alloc_tree_walk(palloc, palloc->free_tree, fn, data);
+}
+
 void page_alloc_dump_stats(PageAlloc *palloc) {
+	if(IS_BITMAP(palloc)) {
+		page_bitmap_dump_stats(TO_BITMAP(palloc));
+		return;
+	}
 #if ENABLE_STATS
-	printf("seg_len=%zd, used_segs=%zd, peak_used_segs=%zd\n",
-		palloc->seg_len, palloc->used_segs, palloc->peak_used_segs);
+	printf("seg_len=%u, used_segs=%u, peak_used_segs=%u, node_bytes=%zu\n",
+		palloc->seg_len, palloc->used_segs, palloc->peak_used_segs, sizeof(Segment));
 #endif
 }
-
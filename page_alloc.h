@@ -6,17 +6,109 @@
 #define __PAGE_ALLOC_H__
 
 #include "lcommon.h"
+#include "page_slab.h"
 
 typedef struct PageAlloc PageAlloc;
 
+/* page allocator engines. */
+typedef enum PageAllocEngine {
+	PAGE_ALLOC_TREE = 0,   /* tree of free segments. */
+	PAGE_ALLOC_BITMAP = 1, /* hierarchical page occupancy bitmap. */
+} PageAllocEngine;
+
+/* engine used by page_alloc_new() */
+#ifndef PAGE_ALLOC_DEFAULT_ENGINE
+#define PAGE_ALLOC_DEFAULT_ENGINE PAGE_ALLOC_TREE
+#endif
+
 L_LIB_API PageAlloc *page_alloc_new(uint8_t *addr, size_t len);
 
+L_LIB_API PageAlloc *page_alloc_new_engine(PageAllocEngine engine, uint8_t *addr, size_t len);
+
+L_LIB_API void page_alloc_free(PageAlloc *palloc);
+
+/* parse an engine name ("tree" or "bitmap"), returns 'def' for NULL/unknown names. */
+L_LIB_API PageAllocEngine page_alloc_engine_by_name(const char *name, PageAllocEngine def);
+
 L_LIB_API uint8_t *page_alloc_get_segment(PageAlloc *palloc, uint8_t *addr, size_t len);
 
+/* first-fit allocation that starts on a multiple of 'align' (a power of two). */
+L_LIB_API uint8_t *page_alloc_get_aligned_segment(PageAlloc *palloc, size_t len, size_t align);
+
+/*
+ * Two-ended placement: requests without a usable address hint of at least
+ * 'threshold' bytes are placed last-fit from the top of the window, smaller
+ * ones first-fit from the bottom, so short-lived small mappings don't break
+ * up the holes large ones need.  0 (the default) places everything first-fit.
+ */
+L_LIB_API void page_alloc_set_split(PageAlloc *palloc, size_t threshold);
+
 L_LIB_API uint8_t *page_alloc_resize_segment(PageAlloc *palloc, uint8_t *addr, size_t len, size_t new_len);
 
 L_LIB_API int page_alloc_release_segment(PageAlloc *palloc, uint8_t *addr, size_t len);
 
+/* allocate exactly [addr, addr + len), returns -1 if any part of it isn't free. */
+L_LIB_API int page_alloc_reserve_segment(PageAlloc *palloc, uint8_t *addr, size_t len);
+
+/* a range taken by page_alloc_claim(). */
+typedef struct PageAllocRange {
+	uint8_t   *addr;
+	size_t    len;
+} PageAllocRange;
+
+/* ranges kept inside PageAllocClaim, more spill into a slab. */
+#define PAGE_ALLOC_CLAIM_INLINE 8
+
+/* the free ranges a claim took, so a caller whose mapping failed can give back exactly those. */
+typedef struct PageAllocClaim {
+	size_t         count;
+	size_t         max;
+	PageAllocRange *range;  /* 'inline_range' or the slab. */
+	PageSlab       slab;
+	PageAllocRange inline_range[PAGE_ALLOC_CLAIM_INLINE];
+} PageAllocClaim;
+
+L_LIB_API void page_alloc_claim_init(PageAllocClaim *claim);
+
+L_LIB_API void page_alloc_claim_free(PageAllocClaim *claim);
+
+/* allocate every free page in [addr, addr + len), the rest is already allocated.  Each range
+ * taken is added to 'claim' (can be NULL).  returns -1 if 'claim' can't hold another range,
+ * the ranges taken so far stay allocated. */
+L_LIB_API int page_alloc_claim(PageAlloc *palloc, uint8_t *addr, size_t len, PageAllocClaim *claim);
+
+/* number of free bytes starting at 'addr'. */
+L_LIB_API size_t page_alloc_free_at(PageAlloc *palloc, uint8_t *addr);
+
+/* number of free bytes just before 'addr'. */
+L_LIB_API size_t page_alloc_free_before(PageAlloc *palloc, uint8_t *addr);
+
+/* number of allocated bytes starting at 'addr', up to the next free page or the end of the window. */
+L_LIB_API size_t page_alloc_used_at(PageAlloc *palloc, uint8_t *addr);
+
+/* free space summary, used to measure fragmentation. */
+typedef struct PageAllocStats {
+	size_t    free_bytes;
+	size_t    free_segs;     /* number of free fragments. */
+	size_t    largest_free;  /* largest free fragment. */
+} PageAllocStats;
+
+L_LIB_API void page_alloc_get_stats(PageAlloc *palloc, PageAllocStats *stats);
+
+/* 1 - largest_free / free_bytes: 0 when the free space is one block, near 1 when it is scattered. */
+L_LIB_API double page_alloc_fragmentation(size_t largest_free, size_t free_bytes);
+
+/* number of free segments, O(1). */
+L_LIB_API size_t page_alloc_free_segs(PageAlloc *palloc);
+
+/* largest free segment if it is known without a walk (tree engine), 0 otherwise. */
+L_LIB_API size_t page_alloc_largest_free(PageAlloc *palloc);
+
+typedef void (*PageAllocWalkFn)(void *data, uint8_t *addr, size_t len);
+
+/* call 'fn' for each free segment. */
+L_LIB_API void page_alloc_walk_free(PageAlloc *palloc, PageAllocWalkFn fn, void *data);
+
 L_LIB_API void page_alloc_dump_stats(PageAlloc *palloc);
 
 #endif /* __PAGE_ALLOC_H__ */
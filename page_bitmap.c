@@ -0,0 +1,542 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "page_bitmap.h"
+#include "page_slab.h"
+#include "probes.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/*
+ * Hierarchical page occupancy bitmap.
+ *
+ * Level 0 has one bit per page (set when the page is free).  Level 1 has two
+ * summary bitmaps with one bit per level 0 word: 'any' is set when the word
+ * has at least one free page, 'full' is set when every page in the word is
+ * free.  A 4 Gbyte window of 4 Kbyte pages needs 128 Kbytes for level 0 and
+ * 2 Kbytes for each summary, so searches stay cache-resident no matter how
+ * fragmented the window gets.
+ */
+struct PageBitmap {
+	PageAllocEngine engine; /* must be first, see page_alloc.c */
+	PageSlab  slab;        /* holds this struct and the bitmaps. */
+	uint8_t   *base;
+	size_t    page_shift;
+	size_t    pages;       /* number of pages in window. */
+	size_t    words;       /* number of words in 'free' bitmap. */
+	size_t    sum_words;   /* number of words in each summary bitmap. */
+	uint64_t  *free;
+	uint64_t  *any;
+	uint64_t  *full;
+	size_t    free_pages;
+	size_t    free_runs;   /* number of runs of free pages. */
+	size_t    split;       /* requests this large are placed from the top, 0 disables. */
+};
+
+#define WORD_BITS 64
+#define WORD_SHIFT 6
+#define WORD_MASK (WORD_BITS - 1)
+#define ALL_FREE (~(uint64_t)0)
+
+#define NO_PAGE ((size_t)-1)
+
+#define ctz64(x) __builtin_ctzll(x)
+#define clz64(x) __builtin_clzll(x)
+
+static inline size_t page_bitmap_pages(PageBitmap *bm, size_t len) {
+	return (len + ((size_t)1 << bm->page_shift) - 1) >> bm->page_shift;
+}
+
+static inline size_t page_bitmap_page(PageBitmap *bm, uint8_t *addr) {
+	return (size_t)(addr - bm->base) >> bm->page_shift;
+}
+
+static inline uint8_t *page_bitmap_addr(PageBitmap *bm, size_t page) {
+	return bm->base + (page << bm->page_shift);
+}
+
+/* [addr, addr + len) is inside the window, checked before a length is rounded up to pages. */
+static inline int page_bitmap_in_window(PageBitmap *bm, uint8_t *addr, size_t len) {
+	size_t size = bm->pages << bm->page_shift;
+
+	if(addr < bm->base || len > size) return 0;
+	return (size_t)(addr - bm->base) <= (size - len);
+}
+
+static inline void page_bitmap_update_summary(PageBitmap *bm, size_t w) {
+	uint64_t x = bm->free[w];
+	uint64_t bit = (uint64_t)1 << (w & WORD_MASK);
+	size_t s = w >> WORD_SHIFT;
+
+	if(x != 0) {
+		bm->any[s] |= bit;
+	} else {
+		bm->any[s] &= ~bit;
+	}
+	if(x == ALL_FREE) {
+		bm->full[s] |= bit;
+	} else {
+		bm->full[s] &= ~bit;
+	}
+}
+
+static inline int page_bitmap_page_free(PageBitmap *bm, size_t page) {
+	return (bm->free[page >> WORD_SHIFT] >> (page & WORD_MASK)) & 1;
+}
+
+/* the whole range must be in the other state. */
+static void page_bitmap_mark(PageBitmap *bm, size_t page, size_t count, int is_free) {
+	size_t w = page >> WORD_SHIFT;
+	size_t off = page & WORD_MASK;
+	int prev;
+	int next;
+
+	/* an empty range doesn't join or split any runs. */
+	if(count == 0) return;
+	prev = (page > 0) && page_bitmap_page_free(bm, page - 1);
+	next = ((page + count) < bm->pages) && page_bitmap_page_free(bm, page + count);
+	if(is_free) {
+		bm->free_pages += count;
+		/* joins the free runs on either side. */
+		bm->free_runs = bm->free_runs + 1 - prev - next;
+		LOWMEM_PROBE4(palloc_coalesce, page_bitmap_addr(bm, page), count << bm->page_shift,
+			prev | (next << 1), bm->free_runs);
+	} else {
+		bm->free_pages -= count;
+		/* splits a free run, or trims it. */
+		bm->free_runs = bm->free_runs - 1 + prev + next;
+		LOWMEM_PROBE3(palloc_cut, page_bitmap_addr(bm, page), count << bm->page_shift, bm->free_runs);
+	}
+	while(count > 0) {
+		size_t n = WORD_BITS - off;
+		uint64_t mask;
+		if(n > count) n = count;
+		mask = (n == WORD_BITS) ? ALL_FREE : ((((uint64_t)1 << n) - 1) << off);
+		if(is_free) {
+			bm->free[w] |= mask;
+		} else {
+			bm->free[w] &= ~mask;
+		}
+		page_bitmap_update_summary(bm, w);
+		count -= n;
+		off = 0;
+		w++;
+	}
+}
+
+/* find the first set bit at or after 'i' in a summary bitmap, returns 'words' if none. */
+static size_t page_bitmap_next_set(PageBitmap *bm, uint64_t *sum, size_t i, int invert) {
+	size_t s = i >> WORD_SHIFT;
+	uint64_t bits;
+
+	if(i >= bm->words) return bm->words;
+	bits = (invert ? ~sum[s] : sum[s]) & (ALL_FREE << (i & WORD_MASK));
+	while(bits == 0) {
+		if(++s >= bm->sum_words) return bm->words;
+		bits = invert ? ~sum[s] : sum[s];
+	}
+	i = (s << WORD_SHIFT) + ctz64(bits);
+	return (i < bm->words) ? i : bm->words;
+}
+
+/* find the first used page at or after 'page'. */
+static size_t page_bitmap_next_used(PageBitmap *bm, size_t page) {
+	size_t w = page >> WORD_SHIFT;
+	uint64_t bits;
+
+	if(page >= bm->pages) return bm->pages;
+	bits = ~bm->free[w] & (ALL_FREE << (page & WORD_MASK));
+	if(bits == 0) {
+		/* skip words where every page is free. */
+		w = page_bitmap_next_set(bm, bm->full, w + 1, 1);
+		if(w >= bm->words) return bm->pages;
+		bits = ~bm->free[w];
+	}
+	page = (w << WORD_SHIFT) + ctz64(bits);
+	return (page < bm->pages) ? page : bm->pages;
+}
+
+/* find the first free page at or after 'page'. */
+static size_t page_bitmap_next_free(PageBitmap *bm, size_t page) {
+	size_t w = page >> WORD_SHIFT;
+	uint64_t bits;
+
+	if(page >= bm->pages) return NO_PAGE;
+	bits = bm->free[w] & (ALL_FREE << (page & WORD_MASK));
+	if(bits == 0) {
+		/* skip words without any free pages. */
+		w = page_bitmap_next_set(bm, bm->any, w + 1, 0);
+		if(w >= bm->words) return NO_PAGE;
+		bits = bm->free[w];
+	}
+	return (w << WORD_SHIFT) + ctz64(bits);
+}
+
+/* find the last set bit before 'i' in a summary bitmap. */
+static size_t page_bitmap_prev_set(PageBitmap *bm, uint64_t *sum, size_t i, int invert) {
+	size_t s;
+	uint64_t bits;
+
+	if(i == 0) return NO_PAGE;
+	i--;
+	s = i >> WORD_SHIFT;
+	bits = (invert ? ~sum[s] : sum[s]) & (ALL_FREE >> (WORD_MASK - (i & WORD_MASK)));
+	while(bits == 0) {
+		if(s == 0) return NO_PAGE;
+		s--;
+		bits = invert ? ~sum[s] : sum[s];
+	}
+	return (s << WORD_SHIFT) + WORD_MASK - clz64(bits);
+}
+
+/* find the last used page before 'page'. */
+static size_t page_bitmap_prev_used(PageBitmap *bm, size_t page) {
+	size_t w;
+	uint64_t bits;
+
+	if(page == 0) return NO_PAGE;
+	page--;
+	w = page >> WORD_SHIFT;
+	bits = ~bm->free[w] & (ALL_FREE >> (WORD_MASK - (page & WORD_MASK)));
+	if(bits == 0) {
+		/* skip words where every page is free. */
+		w = page_bitmap_prev_set(bm, bm->full, w, 1);
+		if(w == NO_PAGE) return NO_PAGE;
+		bits = ~bm->free[w];
+	}
+	return (w << WORD_SHIFT) + WORD_MASK - clz64(bits);
+}
+
+/* find the last free page before 'page'. */
+static size_t page_bitmap_prev_free(PageBitmap *bm, size_t page) {
+	size_t w;
+	uint64_t bits;
+
+	if(page == 0) return NO_PAGE;
+	page--;
+	w = page >> WORD_SHIFT;
+	bits = bm->free[w] & (ALL_FREE >> (WORD_MASK - (page & WORD_MASK)));
+	if(bits == 0) {
+		/* skip words without any free pages. */
+		w = page_bitmap_prev_set(bm, bm->any, w, 0);
+		if(w == NO_PAGE) return NO_PAGE;
+		bits = bm->free[w];
+	}
+	return (w << WORD_SHIFT) + WORD_MASK - clz64(bits);
+}
+
+static inline int page_bitmap_is_free(PageBitmap *bm, size_t page, size_t count) {
+	return page_bitmap_next_used(bm, page) >= (page + count);
+}
+
+static inline int page_bitmap_is_used(PageBitmap *bm, size_t page, size_t count) {
+	size_t next = page_bitmap_next_free(bm, page);
+	return (next == NO_PAGE) || (next >= (page + count));
+}
+
+/* mask of bit positions that start a run of 'n' free pages inside the word (n < 64). */
+static inline uint64_t page_bitmap_word_runs(uint64_t x, size_t n) {
+	size_t have = 1;
+
+	while(have < n && x != 0) {
+		size_t s = (have < (n - have)) ? have : (n - have);
+		x &= x >> s;
+		have += s;
+	}
+	return x;
+}
+
+/* first-fit search for 'n' free pages. */
+static size_t page_bitmap_first_fit(PageBitmap *bm, size_t n) {
+	size_t run = 0;
+	size_t run_start = 0;
+	size_t w;
+
+	w = page_bitmap_next_set(bm, bm->any, 0, 0);
+	while(w < bm->words) {
+		uint64_t x = bm->free[w];
+		uint64_t runs;
+		size_t head;
+		size_t tail;
+
+		if(x == ALL_FREE) {
+			/* skip over whole free words. */
+			size_t end = page_bitmap_next_set(bm, bm->full, w, 1);
+			if(run == 0) run_start = w << WORD_SHIFT;
+			run += (end - w) << WORD_SHIFT;
+			if(run >= n) return run_start;
+			w = end;
+			if(w >= bm->words) break;
+			x = bm->free[w];
+		}
+		/* free pages at the start of the word continue the current run. */
+		head = ctz64(~x);
+		if(run == 0) run_start = w << WORD_SHIFT;
+		if((run + head) >= n) return run_start;
+		/* runs inside the word. */
+		if(n < WORD_BITS) {
+			runs = page_bitmap_word_runs(x, n);
+			if(runs != 0) return (w << WORD_SHIFT) + ctz64(runs);
+		}
+		/* free pages at the end of the word start a new run. */
+		tail = clz64(~x);
+		run = tail;
+		run_start = ((w + 1) << WORD_SHIFT) - tail;
+		if(run == 0) {
+			w = page_bitmap_next_set(bm, bm->any, w + 1, 0);
+		} else {
+			w++;
+		}
+	}
+	return NO_PAGE;
+}
+
+/* first-fit search for 'n' free pages starting on a multiple of 'align' pages. */
+static size_t page_bitmap_aligned_fit(PageBitmap *bm, size_t n, size_t align) {
+	/* alignment is relative to address zero, not the start of the window. */
+	size_t base = (size_t)bm->base >> bm->page_shift;
+	size_t page = page_bitmap_next_free(bm, 0);
+
+	while(page != NO_PAGE) {
+		size_t used;
+		/* every step moves at least 'align' pages forward. */
+		page = ((base + page + align - 1) & ~(align - 1)) - base;
+		if(page >= bm->pages) break;
+		used = page_bitmap_next_used(bm, page);
+		if(used >= (page + n)) return (page + n <= bm->pages) ? page : NO_PAGE;
+		page = page_bitmap_next_free(bm, used);
+	}
+	return NO_PAGE;
+}
+
+/* last-fit search for 'n' free pages starting on a multiple of 'align' pages, walks the runs down from the top. */
+static size_t page_bitmap_last_fit(PageBitmap *bm, size_t n, size_t align) {
+	size_t base = (size_t)bm->base >> bm->page_shift;
+	size_t end = page_bitmap_prev_free(bm, bm->pages);
+
+	while(end != NO_PAGE) {
+		size_t used = page_bitmap_prev_used(bm, end);
+		size_t start = (used == NO_PAGE) ? 0 : (used + 1);
+		/* the run is [start, end]. */
+		if((end + 1 - start) >= n) {
+			size_t page = (base + end + 1 - n) & ~(align - 1);
+			if(page >= (base + start)) return page - base;
+		}
+		if(used == NO_PAGE) break;
+		end = page_bitmap_prev_free(bm, used);
+	}
+	return NO_PAGE;
+}
+
+PageAlloc *page_bitmap_new(uint8_t *addr, size_t len) {
+	PageBitmap *bm;
+	PageSlab slab;
+	long page_size = sysconf(_SC_PAGE_SIZE);
+	size_t page_shift = ctz64((uint64_t)page_size);
+	size_t pages = len >> page_shift;
+	size_t words = (pages + WORD_MASK) >> WORD_SHIFT;
+	size_t sum_words = (words + WORD_MASK) >> WORD_SHIFT;
+	size_t size;
+
+	/* the struct and all three bitmaps share one slab, it starts out zeroed. */
+	size = sizeof(PageBitmap) + ((words + (2 * sum_words)) * sizeof(uint64_t));
+	if(page_slab_init(&slab, size, size) != 0) return NULL;
+	bm = (PageBitmap *)slab.base;
+	bm->engine = PAGE_ALLOC_BITMAP;
+	bm->slab = slab;
+	bm->base = addr;
+	bm->page_shift = page_shift;
+	bm->pages = pages;
+	bm->words = words;
+	bm->sum_words = sum_words;
+	bm->free = (uint64_t *)(bm + 1);
+	bm->any = bm->free + words;
+	bm->full = bm->any + sum_words;
+
+	/* add free space. */
+	page_bitmap_mark(bm, 0, bm->pages, 1);
+
+	return (PageAlloc *)bm;
+}
+
+void page_bitmap_free(PageBitmap *bm) {
+	PageSlab slab = bm->slab;
+
+	page_slab_free(&slab);
+}
+
+uint8_t *page_bitmap_get_segment(PageBitmap *bm, uint8_t *addr, size_t len) {
+	size_t count = page_bitmap_pages(bm, len);
+	size_t page;
+
+	if(count == 0 || len > (bm->pages << bm->page_shift)) return NULL;
+	if(addr != NULL && addr >= bm->base) {
+		page = page_bitmap_page(bm, addr);
+		if(page < bm->pages && page_bitmap_is_free(bm, page, count)) {
+			/* the requested address range is available. */
+			page_bitmap_mark(bm, page, count, 0);
+			return page_bitmap_addr(bm, page);
+		}
+		/* ignore address hint and look for free space. */
+	}
+	if(bm->split > 0 && count >= bm->split) {
+		page = page_bitmap_last_fit(bm, count, 1);
+	} else {
+		page = page_bitmap_first_fit(bm, count);
+	}
+	LOWMEM_PROBE3(palloc_search, len, (page == NO_PAGE) ? NULL : page_bitmap_addr(bm, page),
+		bm->free_runs);
+	if(page == NO_PAGE) return NULL;
+	page_bitmap_mark(bm, page, count, 0);
+	return page_bitmap_addr(bm, page);
+}
+
+uint8_t *page_bitmap_get_aligned_segment(PageBitmap *bm, size_t len, size_t align) {
+	size_t count = page_bitmap_pages(bm, len);
+	size_t page;
+
+	if(count == 0 || len > (bm->pages << bm->page_shift)) return NULL;
+	align >>= bm->page_shift;
+	if(align < 1) align = 1;
+	if(bm->split > 0 && count >= bm->split) {
+		page = page_bitmap_last_fit(bm, count, align);
+	} else {
+		page = page_bitmap_aligned_fit(bm, count, align);
+	}
+	LOWMEM_PROBE3(palloc_search, len, (page == NO_PAGE) ? NULL : page_bitmap_addr(bm, page),
+		bm->free_runs);
+	if(page == NO_PAGE) return NULL;
+	page_bitmap_mark(bm, page, count, 0);
+	return page_bitmap_addr(bm, page);
+}
+
+void page_bitmap_set_split(PageBitmap *bm, size_t threshold) {
+	bm->split = page_bitmap_pages(bm, threshold);
+}
+
+uint8_t *page_bitmap_resize_segment(PageBitmap *bm, uint8_t *addr, size_t len, size_t new_len) {
+	size_t page = page_bitmap_page(bm, addr);
+	size_t count = page_bitmap_pages(bm, len);
+	size_t new_count = page_bitmap_pages(bm, new_len);
+
+	if(!page_bitmap_in_window(bm, addr, (new_len > len) ? new_len : len)) return NULL;
+	if(new_count == count) return addr;
+	if(new_count < count) {
+		/* shrink allocated segment */
+		page_bitmap_mark(bm, page + new_count, count - new_count, 1);
+		return addr;
+	}
+	if(!page_bitmap_is_free(bm, page + count, new_count - count)) {
+		/* can't expand segment. */
+		return NULL;
+	}
+	page_bitmap_mark(bm, page + count, new_count - count, 0);
+	return addr;
+}
+
+int page_bitmap_release_segment(PageBitmap *bm, uint8_t *addr, size_t len) {
+	size_t page;
+	size_t count = page_bitmap_pages(bm, len);
+
+	if(!page_bitmap_in_window(bm, addr, len)) return -1;
+	page = page_bitmap_page(bm, addr);
+	/* refuse to release pages that are already free. */
+	if(!page_bitmap_is_used(bm, page, count)) return -1;
+	page_bitmap_mark(bm, page, count, 1);
+	return 0;
+}
+
+int page_bitmap_reserve_segment(PageBitmap *bm, uint8_t *addr, size_t len) {
+	size_t page;
+	size_t count = page_bitmap_pages(bm, len);
+
+	if(!page_bitmap_in_window(bm, addr, len)) return -1;
+	page = page_bitmap_page(bm, addr);
+	if(!page_bitmap_is_free(bm, page, count)) return -1;
+	page_bitmap_mark(bm, page, count, 0);
+	return 0;
+}
+
+size_t page_bitmap_free_at(PageBitmap *bm, uint8_t *addr) {
+	size_t page;
+
+	if(addr < bm->base) return 0;
+	page = page_bitmap_page(bm, addr);
+	if(page >= bm->pages) return 0;
+	return (page_bitmap_next_used(bm, page) - page) << bm->page_shift;
+}
+
+size_t page_bitmap_free_before(PageBitmap *bm, uint8_t *addr) {
+	size_t page;
+	size_t prev;
+
+	if(addr <= bm->base) return 0;
+	page = page_bitmap_page(bm, addr);
+	if(page > bm->pages) return 0;
+	prev = page_bitmap_prev_used(bm, page);
+	if(prev == NO_PAGE) return page << bm->page_shift;
+	return (page - prev - 1) << bm->page_shift;
+}
+
+size_t page_bitmap_used_at(PageBitmap *bm, uint8_t *addr) {
+	size_t page;
+	size_t next;
+
+	if(addr < bm->base) return 0;
+	page = page_bitmap_page(bm, addr);
+	if(page >= bm->pages || page_bitmap_page_free(bm, page)) return 0;
+	next = page_bitmap_next_free(bm, page);
+	if(next == NO_PAGE) next = bm->pages;
+	return (next - page) << bm->page_shift;
+}
+
+void page_bitmap_get_stats(PageBitmap *bm, PageAllocStats *stats) {
+	size_t page = page_bitmap_next_free(bm, 0);
+
+	stats->free_bytes = bm->free_pages << bm->page_shift;
+	stats->free_segs = 0;
+	stats->largest_free = 0;
+	while(page != NO_PAGE) {
+		size_t used = page_bitmap_next_used(bm, page);
+		size_t len = (used - page) << bm->page_shift;
+		if(len > stats->largest_free) stats->largest_free = len;
+		stats->free_segs++;
+		page = page_bitmap_next_free(bm, used);
+	}
+}
+
+size_t page_bitmap_free_segs(PageBitmap *bm) {
+	return bm->free_runs;
+}
+
+void page_bitmap_walk_free(PageBitmap *bm, PageAllocWalkFn fn, void *data) {
+	size_t page = page_bitmap_next_free(bm, 0);
+
+	while(page != NO_PAGE) {
+		size_t used = page_bitmap_next_used(bm, page);
+		fn(data, page_bitmap_addr(bm, page), (used - page) << bm->page_shift);
+		page = page_bitmap_next_free(bm, used);
+	}
+}
+
+void page_bitmap_dump_stats(PageBitmap *bm) {
+	size_t runs = 0;
+	uint64_t carry = 0;
+	size_t w;
+
+	/* count free runs, a run starts at every free page without a free page before it. */
+	for(w = 0; w < bm->words; w++) {
+		uint64_t x = bm->free[w];
+		runs += __builtin_popcountll(x & ~((x << 1) | carry));
+		carry = x >> WORD_MASK;
+	}
+	printf("pages=%zd, free_pages=%zd, free_runs=%zd\n",
+		bm->pages, bm->free_pages, runs);
+}
+
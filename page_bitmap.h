@@ -0,0 +1,46 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__PAGE_BITMAP_H__)
+#define __PAGE_BITMAP_H__
+
+#include "page_alloc.h"
+
+/*
+ * Bitmap page allocator engine.  Only used internally by page_alloc.c, the
+ * returned allocator is handled through the normal page_alloc_* interface.
+ */
+typedef struct PageBitmap PageBitmap;
+
+PageAlloc *page_bitmap_new(uint8_t *addr, size_t len);
+
+void page_bitmap_free(PageBitmap *bm);
+
+uint8_t *page_bitmap_get_segment(PageBitmap *bm, uint8_t *addr, size_t len);
+
+uint8_t *page_bitmap_get_aligned_segment(PageBitmap *bm, size_t len, size_t align);
+
+void page_bitmap_set_split(PageBitmap *bm, size_t threshold);
+
+uint8_t *page_bitmap_resize_segment(PageBitmap *bm, uint8_t *addr, size_t len, size_t new_len);
+
+int page_bitmap_release_segment(PageBitmap *bm, uint8_t *addr, size_t len);
+
+int page_bitmap_reserve_segment(PageBitmap *bm, uint8_t *addr, size_t len);
+
+size_t page_bitmap_free_at(PageBitmap *bm, uint8_t *addr);
+
+size_t page_bitmap_free_before(PageBitmap *bm, uint8_t *addr);
+
+size_t page_bitmap_used_at(PageBitmap *bm, uint8_t *addr);
+
+void page_bitmap_get_stats(PageBitmap *bm, PageAllocStats *stats);
+
+size_t page_bitmap_free_segs(PageBitmap *bm);
+
+void page_bitmap_walk_free(PageBitmap *bm, PageAllocWalkFn fn, void *data);
+
+void page_bitmap_dump_stats(PageBitmap *bm);
+
+#endif /* __PAGE_BITMAP_H__ */
@@ -0,0 +1,66 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "page_slab.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static PageSlabMmapFn slab_mmap = mmap;
+static PageSlabMunmapFn slab_munmap = munmap;
+
+void page_slab_set_system(PageSlabMmapFn mmap, PageSlabMunmapFn munmap) {
+	slab_mmap = mmap;
+	slab_munmap = munmap;
+}
+
+static size_t page_slab_round(size_t len) {
+	size_t page_size = sysconf(_SC_PAGE_SIZE);
+	return (len + page_size - 1) & ~(page_size - 1);
+}
+
+int page_slab_init(PageSlab *slab, size_t reserve, size_t commit) {
+	uint8_t *base;
+
+	reserve = page_slab_round(reserve);
+	commit = page_slab_round(commit);
+	if(commit > reserve) commit = reserve;
+	base = (uint8_t *)slab_mmap(NULL, reserve, PROT_NONE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if(base == MAP_FAILED) return -1;
+	if(commit > 0 && mprotect(base, commit, PROT_READ|PROT_WRITE) != 0) {
+		slab_munmap(base, reserve);
+		return -1;
+	}
+	slab->base = base;
+	slab->reserved = reserve;
+	slab->committed = commit;
+	return 0;
+}
+
+int page_slab_grow(PageSlab *slab, size_t len) {
+	size_t commit = slab->committed;
+
+	if(len <= commit) return 0;
+	if(len > slab->reserved) return -1;
+	/* grow geometrically. */
+	if(commit == 0) commit = page_slab_round(1);
+	while(commit < len) commit *= 2;
+	if(commit > slab->reserved) commit = slab->reserved;
+	if(mprotect(slab->base + slab->committed, commit - slab->committed, PROT_READ|PROT_WRITE) != 0) {
+		return -1;
+	}
+	slab->committed = commit;
+	return 0;
+}
+
+void page_slab_free(PageSlab *slab) {
+	uint8_t *base = slab->base;
+	size_t reserved = slab->reserved;
+
+	slab_munmap(base, reserved);
+}
@@ -0,0 +1,43 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__PAGE_SLAB_H__)
+#define __PAGE_SLAB_H__
+
+#include "lcommon.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Metadata memory for the page allocators.
+ *
+ * A slab reserves address space for its largest possible size up front
+ * (PROT_NONE) and makes it usable from the start, doubling each time it
+ * grows, so its contents never move and node ids can stay plain array
+ * indices.  The memory comes straight from the system mmap, never from
+ * malloc or the hooked mmap.
+ */
+typedef struct PageSlab {
+	uint8_t   *base;
+	size_t    reserved;   /* bytes of address space. */
+	size_t    committed;  /* usable bytes at the start of the slab. */
+} PageSlab;
+
+typedef void *(*PageSlabMmapFn)(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+typedef int (*PageSlabMunmapFn)(void *addr, size_t len);
+
+/* mmap/munmap to use, the default is the libc functions.  The library sets its system_mmap. */
+L_LIB_API void page_slab_set_system(PageSlabMmapFn mmap, PageSlabMunmapFn munmap);
+
+/* reserve 'reserve' bytes, with the first 'commit' bytes usable.  returns -1 on error. */
+L_LIB_API int page_slab_init(PageSlab *slab, size_t reserve, size_t commit);
+
+/* make at least 'len' bytes usable, returns -1 if that is more than was reserved. */
+L_LIB_API int page_slab_grow(PageSlab *slab, size_t len);
+
+/* 'slab' can live inside its own memory. */
+L_LIB_API void page_slab_free(PageSlab *slab);
+
+#endif /* __PAGE_SLAB_H__ */
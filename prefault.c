@@ -0,0 +1,174 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "prefault.h"
+
+#ifdef SUPPORT_THREADS
+
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "wrap_mmap.h"
+#include "span_cache.h"
+#include "bg_thread.h"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* upper limit for the number of queued ranges. */
+#define PREFAULT_MAX_RANGES 256
+
+static size_t prefault_chunk = 0;
+
+static pthread_mutex_t prefault_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefault_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t prefault_done = PTHREAD_COND_INITIALIZER;
+
+/* queued ranges, oldest first. */
+static Span *prefault_spans = NULL;
+static int prefault_count = 0;
+/* chunk the prefault thread is populating. */
+static uint8_t *prefault_busy_addr = NULL;
+static size_t prefault_busy_len = 0;
+/* queued and busy bytes, read without the lock so cancel is cheap when idle. */
+static size_t prefault_pending = 0;
+
+static BgThread prefault_worker;
+
+static PrefaultStats prefault_stats;
+
+static inline int prefault_overlaps(uint8_t *addr, size_t len, uint8_t *addr2, size_t len2) {
+	return (addr < (addr2 + len2)) && (addr2 < (addr + len));
+}
+
+/* remove queued range 'idx', the lock must be held. */
+static void prefault_remove(int idx) {
+	prefault_count--;
+	memmove(prefault_spans + idx, prefault_spans + idx + 1, (prefault_count - idx) * sizeof(Span));
+}
+
+static void *prefault_thread(void *data) {
+	Span *span;
+	uint8_t *addr;
+	size_t len;
+	int rc;
+
+	pthread_mutex_lock(&prefault_lock);
+	for(;;) {
+		while(prefault_count == 0) {
+			pthread_cond_wait(&prefault_wake, &prefault_lock);
+		}
+		/* take one chunk from the oldest range. */
+		span = prefault_spans;
+		addr = span->addr;
+		len = (span->len < prefault_chunk) ? span->len : prefault_chunk;
+		span->addr += len;
+		span->len -= len;
+		if(span->len == 0) {
+			prefault_remove(0);
+		}
+		prefault_busy_addr = addr;
+		prefault_busy_len = len;
+		pthread_mutex_unlock(&prefault_lock);
+
+		rc = madvise(addr, len, MADV_POPULATE_WRITE);
+
+		pthread_mutex_lock(&prefault_lock);
+		if(rc == 0) {
+			prefault_stats.bytes += len;
+		} else if(errno == EINVAL) {
+			/* kernel is too old (before 5.14), stop queueing ranges. */
+			prefault_chunk = 0;
+			prefault_count = 0;
+			__atomic_store_n(&prefault_pending, 0, __ATOMIC_RELAXED);
+		}
+		if(prefault_chunk > 0) {
+			__atomic_store_n(&prefault_pending, prefault_pending - len, __ATOMIC_RELAXED);
+		}
+		prefault_busy_len = 0;
+		pthread_cond_broadcast(&prefault_done);
+	}
+	return NULL;
+}
+
+static void prefault_atfork_child() {
+	/* the prefault thread doesn't exist in the child. */
+	pthread_mutex_init(&prefault_lock, NULL);
+	pthread_cond_init(&prefault_wake, NULL);
+	pthread_cond_init(&prefault_done, NULL);
+	if(prefault_busy_len > 0) {
+		prefault_pending -= prefault_busy_len;
+		prefault_busy_len = 0;
+	}
+	bg_thread_forked(&prefault_worker);
+}
+
+void prefault_init(size_t chunk) {
+	if(chunk == 0) return;
+	/* allocate the queue directly from the system, we can't call malloc from inside mmap. */
+	prefault_spans = (Span *)SYS_MMAP(NULL, PREFAULT_MAX_RANGES * sizeof(Span),
+		PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(prefault_spans == MAP_FAILED) {
+		prefault_spans = NULL;
+		return;
+	}
+	bg_thread_init(&prefault_worker, prefault_thread, NULL, NULL, prefault_atfork_child);
+	prefault_chunk = chunk;
+}
+
+int prefault_queue(uint8_t *addr, size_t len) {
+	int rc = -1;
+
+	if(prefault_chunk == 0) return -1;
+	if(bg_thread_ensure(&prefault_worker, &prefault_lock) != 0) return -1;
+	pthread_mutex_lock(&prefault_lock);
+	if(prefault_chunk > 0 && prefault_count < PREFAULT_MAX_RANGES) {
+		prefault_spans[prefault_count].addr = addr;
+		prefault_spans[prefault_count].len = len;
+		prefault_count++;
+		__atomic_store_n(&prefault_pending, prefault_pending + len, __ATOMIC_RELAXED);
+		prefault_stats.queued++;
+		if(prefault_count == 1) {
+			pthread_cond_signal(&prefault_wake);
+		}
+		rc = 0;
+	}
+	pthread_mutex_unlock(&prefault_lock);
+	return rc;
+}
+
+void prefault_cancel(uint8_t *addr, size_t len) {
+	int i;
+
+	if(__atomic_load_n(&prefault_pending, __ATOMIC_RELAXED) == 0) return;
+	pthread_mutex_lock(&prefault_lock);
+	/* the range must not be unmapped while it is being populated. */
+	while(prefault_busy_len > 0 && prefault_overlaps(addr, len, prefault_busy_addr, prefault_busy_len)) {
+		pthread_cond_wait(&prefault_done, &prefault_lock);
+	}
+	/* the rest of a partly unmapped range isn't populated either. */
+	for(i = 0; i < prefault_count; i++) {
+		Span *span = prefault_spans + i;
+		if(!prefault_overlaps(addr, len, span->addr, span->len)) continue;
+		__atomic_store_n(&prefault_pending, prefault_pending - span->len, __ATOMIC_RELAXED);
+		prefault_stats.cancelled++;
+		prefault_remove(i);
+		i--;
+	}
+	pthread_mutex_unlock(&prefault_lock);
+}
+
+void prefault_get_stats(PrefaultStats *stats) {
+	pthread_mutex_lock(&prefault_lock);
+	*stats = prefault_stats;
+	pthread_mutex_unlock(&prefault_lock);
+}
+
+#endif
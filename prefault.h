@@ -0,0 +1,51 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__PREFAULT_H__)
+#define __PREFAULT_H__
+
+#include "lcommon.h"
+
+#include <stddef.h>
+
+/*
+ * Background prefaulting of new low-memory mappings.
+ *
+ * Queued ranges are populated by a background thread with
+ * MADV_POPULATE_WRITE, one chunk at a time, so the mutator finds the pages
+ * already there instead of taking a fault per page.  A range that is
+ * unmapped or remapped must be cancelled first, cancelling waits for a chunk
+ * the thread is populating.  Only used by the thread-safe build, the
+ * single-threaded build gets no-op stubs.
+ */
+
+typedef struct PrefaultStats {
+	uint64_t  queued;     /* ranges queued. */
+	uint64_t  cancelled;  /* ranges unmapped before they were fully populated. */
+	uint64_t  bytes;      /* bytes populated. */
+} PrefaultStats;
+
+#ifdef SUPPORT_THREADS
+
+/* populate 'chunk' bytes at a time, zero disables prefaulting. */
+L_LIB_API void prefault_init(size_t chunk);
+
+/* returns 0 if the range was queued. */
+L_LIB_API int prefault_queue(uint8_t *addr, size_t len);
+
+/* drop queued ranges that overlap [addr, addr + len). */
+L_LIB_API void prefault_cancel(uint8_t *addr, size_t len);
+
+L_LIB_API void prefault_get_stats(PrefaultStats *stats);
+
+#else
+
+L_INLINE void prefault_init(size_t chunk) { }
+L_INLINE int prefault_queue(uint8_t *addr, size_t len) { return -1; }
+L_INLINE void prefault_cancel(uint8_t *addr, size_t len) { }
+L_INLINE void prefault_get_stats(PrefaultStats *stats) { *stats = (PrefaultStats){ 0 }; }
+
+#endif
+
+#endif /* __PREFAULT_H__ */
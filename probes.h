@@ -0,0 +1,62 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__PROBES_H__)
+#define __PROBES_H__
+
+/*
+ * USDT probes, provider "mmap_lowmem".
+ *
+ * Built on <sys/sdt.h> when it is available (systemtap-sdt-dev), each probe is
+ * a single NOP until perf/bpftrace/stap attaches to it.  Without the header, or
+ * with -DDISABLE_PROBES, the probes compile to nothing.
+ *
+ *   bpftrace -e 'usdt:./libmmap_lowmem.so:mmap_lowmem:mmap_return { @ns = hist(arg2); }'
+ *
+ * Probes:
+ *   mmap_entry(addr, len, prot, flags)
+ *   mmap_return(result, len, ns)
+ *   munmap_entry(addr, len)
+ *   munmap_return(result, len, ns)
+ *   mremap_entry(old_addr, old_len, new_len, flags)
+ *   mremap_return(result, new_len, ns)
+ *   mmap_fallback(addr, len, flags)
+ *   munmap_fallback(addr, len)
+ *   mremap_fallback(old_addr, old_len, new_len)
+ *   palloc_search(len, found, free_segs)     first-fit search, 'found' is NULL on failure.
+ *   palloc_cut(addr, len, free_segs)         space taken from a free segment.
+ *   palloc_coalesce(addr, len, merged, free_segs)
+ *                                            space returned, 'merged' is 1 (with previous
+ *                                            segment), 2 (with next), 3 (both) or 0.
+ *   arena_lock_wait(arena)                   the arena lock was held by another thread,
+ *                                            'arena' is the Arena's address.
+ */
+#if !defined(DISABLE_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SDT_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_SDT_PROBES
+
+#include <sys/sdt.h>
+
+#define LOWMEM_PROBE1(name, a) DTRACE_PROBE1(mmap_lowmem, name, a)
+#define LOWMEM_PROBE2(name, a, b) DTRACE_PROBE2(mmap_lowmem, name, a, b)
+#define LOWMEM_PROBE3(name, a, b, c) DTRACE_PROBE3(mmap_lowmem, name, a, b, c)
+#define LOWMEM_PROBE4(name, a, b, c, d) DTRACE_PROBE4(mmap_lowmem, name, a, b, c, d)
+
+#else
+
+/* the arguments are never evaluated, they only count as used. */
+#define LOWMEM_PROBE1(name, a) do { if(0) { (void)(a); } } while(0)
+#define LOWMEM_PROBE2(name, a, b) do { if(0) { (void)(a); (void)(b); } } while(0)
+#define LOWMEM_PROBE3(name, a, b, c) do { if(0) { (void)(a); (void)(b); (void)(c); } } while(0)
+#define LOWMEM_PROBE4(name, a, b, c, d) do { \
+	if(0) { (void)(a); (void)(b); (void)(c); (void)(d); } \
+} while(0)
+
+#endif
+
+#endif /* __PROBES_H__ */
@@ -0,0 +1,70 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "proc_maps.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static inline int proc_maps_hex(char c) {
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return 0;
+}
+
+int proc_maps_walk(uint8_t *start, uint8_t *end, ProcMapsFn fn, void *data) {
+	char buf[4096];
+	uintptr_t lo = 0;
+	uintptr_t hi = 0;
+	int field = 0; /* 0 = start address, 1 = end address, 2 = rest of the line. */
+	ssize_t len;
+	ssize_t i;
+	int fd;
+
+	fd = open("/proc/self/maps", O_RDONLY|O_CLOEXEC);
+	if(fd < 0) return -1;
+	for(;;) {
+		len = read(fd, buf, sizeof(buf));
+		if(len < 0) {
+			if(errno == EINTR) continue;
+			close(fd);
+			return -1;
+		}
+		if(len == 0) break;
+		/* only the address range at the start of each line is needed, lines can be split over reads. */
+		for(i = 0; i < len; i++) {
+			char c = buf[i];
+			if(c == '\n') {
+				if((uint8_t *)lo >= end) goto done;
+				if((uint8_t *)hi > start) {
+					fn(data, ((uint8_t *)lo > start) ? (uint8_t *)lo : start,
+						((uint8_t *)hi < end) ? (uint8_t *)hi : end);
+				}
+				lo = 0;
+				hi = 0;
+				field = 0;
+			} else if(field == 0) {
+				if(c == '-') {
+					field = 1;
+				} else {
+					lo = (lo << 4) | proc_maps_hex(c);
+				}
+			} else if(field == 1) {
+				if(c == ' ') {
+					field = 2;
+				} else {
+					hi = (hi << 4) | proc_maps_hex(c);
+				}
+			}
+		}
+	}
+done:
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,24 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__PROC_MAPS_H__)
+#define __PROC_MAPS_H__
+
+#include "lcommon.h"
+
+#include <stddef.h>
+
+/*
+ * Reader for /proc/self/maps.  It is called from inside the mmap hooks, so
+ * it only uses open()/read() and a buffer on the stack, no stdio or malloc.
+ * The file is sorted by address, reading stops after the last mapping that
+ * can overlap the range, so checking a low range is cheap.
+ */
+typedef void (*ProcMapsFn)(void *data, uint8_t *start, uint8_t *end);
+
+/* call 'fn' for each mapping that overlaps [start, end), clipped to the range.
+ * returns -1 if the file can't be read. */
+L_LIB_API int proc_maps_walk(uint8_t *start, uint8_t *end, ProcMapsFn fn, void *data);
+
+#endif /* __PROC_MAPS_H__ */
@@ -0,0 +1,286 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "reclaim.h"
+
+#ifdef SUPPORT_THREADS
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "wrap_mmap.h"
+#include "span_cache.h"
+#include "bg_thread.h"
+
+/* upper limit for the number of queued ranges. */
+#define RECLAIM_MAX_RANGES 1024
+/* room in each queue, a forked child puts an unfinished batch back into a full queue. */
+#define RECLAIM_QUEUE_SIZE (2 * RECLAIM_MAX_RANGES)
+
+static ReclaimFn reclaim_fn = NULL;
+static uint64_t reclaim_delay = 0;
+static size_t reclaim_batch_bytes = 0;
+
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_wake;
+static pthread_cond_t reclaim_done;
+/* held while one range is unmapped, so fork() never happens in the middle of one. */
+static pthread_mutex_t reclaim_fork_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* queued ranges, sorted by address. */
+static Span *reclaim_pending = NULL;
+/* ranges the reclaim thread is unmapping. */
+static Span *reclaim_batch = NULL;
+static int reclaim_count = 0;
+static size_t reclaim_bytes = 0;
+static int reclaim_busy = 0;
+/* ranges in the busy batch, and how many of them have been unmapped. */
+static int reclaim_inflight = 0;
+static int reclaim_unmapped = 0;
+
+static BgThread reclaim_worker;
+
+static ReclaimStats reclaim_stats;
+
+static int reclaim_insert(uint8_t *addr, size_t len, int max);
+
+/* the wake condition uses the monotonic clock for the batch delay. */
+static void reclaim_cond_init() {
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&reclaim_wake, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&reclaim_done, NULL);
+}
+
+/* unmap a batch of ranges, called without the lock held. */
+static void reclaim_ranges(Span *spans, int count) {
+	size_t bytes = 0;
+	int i;
+
+	for(i = 0; i < count; i++) {
+		pthread_mutex_lock(&reclaim_fork_lock);
+		reclaim_fn(spans[i].addr, spans[i].len);
+		reclaim_unmapped = i + 1;
+		pthread_mutex_unlock(&reclaim_fork_lock);
+		bytes += spans[i].len;
+	}
+	pthread_mutex_lock(&reclaim_lock);
+	reclaim_stats.batches++;
+	reclaim_stats.unmaps += count;
+	reclaim_stats.bytes += bytes;
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+/* take the queued ranges, the lock must be held. */
+static Span *reclaim_take(int *count) {
+	Span *spans = reclaim_pending;
+
+	*count = reclaim_count;
+	reclaim_pending = reclaim_batch;
+	reclaim_batch = spans;
+	reclaim_count = 0;
+	reclaim_bytes = 0;
+	reclaim_inflight = *count;
+	reclaim_unmapped = 0;
+	return spans;
+}
+
+static void *reclaim_thread(void *data) {
+	struct timespec deadline;
+	Span *spans;
+	int count;
+
+	pthread_mutex_lock(&reclaim_lock);
+	for(;;) {
+		while(reclaim_count == 0) {
+			pthread_cond_wait(&reclaim_wake, &reclaim_lock);
+		}
+		if(reclaim_bytes < reclaim_batch_bytes) {
+			/* give the mutator time to free neighbouring ranges. */
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += reclaim_delay / 1000;
+			deadline.tv_nsec += (reclaim_delay % 1000) * 1000000;
+			if(deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			while(reclaim_count > 0 && reclaim_bytes < reclaim_batch_bytes) {
+				if(pthread_cond_timedwait(&reclaim_wake, &reclaim_lock, &deadline) != 0) break;
+			}
+		}
+		/* reclaim_flush() might be unmapping the other queue. */
+		while(reclaim_busy) {
+			pthread_cond_wait(&reclaim_done, &reclaim_lock);
+		}
+		if(reclaim_count == 0) continue;
+		spans = reclaim_take(&count);
+		reclaim_busy = 1;
+		pthread_mutex_unlock(&reclaim_lock);
+
+		reclaim_ranges(spans, count);
+
+		pthread_mutex_lock(&reclaim_lock);
+		reclaim_busy = 0;
+		reclaim_inflight = 0;
+		pthread_cond_broadcast(&reclaim_done);
+	}
+	return NULL;
+}
+
+static void reclaim_atfork_prepare() {
+	pthread_mutex_lock(&reclaim_lock);
+	pthread_mutex_lock(&reclaim_fork_lock);
+}
+
+static void reclaim_atfork_parent() {
+	pthread_mutex_unlock(&reclaim_fork_lock);
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+static void reclaim_atfork_child() {
+	int i;
+
+	/* the reclaim thread, and any thread that was flushing the queue, don't exist in the child. */
+	pthread_mutex_init(&reclaim_lock, NULL);
+	pthread_mutex_init(&reclaim_fork_lock, NULL);
+	reclaim_cond_init();
+	if(reclaim_busy) {
+		/* queue the ranges of the busy batch that weren't unmapped yet again. */
+		for(i = reclaim_unmapped; i < reclaim_inflight; i++) {
+			if(reclaim_insert(reclaim_batch[i].addr, reclaim_batch[i].len, RECLAIM_QUEUE_SIZE) == 0) {
+				reclaim_bytes += reclaim_batch[i].len;
+			}
+		}
+		reclaim_busy = 0;
+		reclaim_inflight = 0;
+	}
+	bg_thread_forked(&reclaim_worker);
+}
+
+void reclaim_init(ReclaimFn reclaim, uint64_t delay_ms, size_t batch_bytes) {
+	reclaim_fn = reclaim;
+	reclaim_batch_bytes = batch_bytes;
+	if(delay_ms == 0) return;
+	reclaim_cond_init();
+	/* allocate queues directly from the system, we can't call malloc from inside munmap. */
+	reclaim_pending = (Span *)SYS_MMAP(NULL, 2 * RECLAIM_QUEUE_SIZE * sizeof(Span),
+		PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(reclaim_pending == MAP_FAILED) {
+		reclaim_pending = NULL;
+		return;
+	}
+	reclaim_batch = reclaim_pending + RECLAIM_QUEUE_SIZE;
+	bg_thread_init(&reclaim_worker, reclaim_thread, reclaim_atfork_prepare, reclaim_atfork_parent, reclaim_atfork_child);
+	reclaim_delay = delay_ms;
+}
+
+/* insert a range, merging it with its neighbours, the lock must be held. */
+static int reclaim_insert(uint8_t *addr, size_t len, int max) {
+	Span *spans = reclaim_pending;
+	int lo = 0;
+	int hi = reclaim_count;
+	Span *prev;
+	Span *next;
+
+	/* find the first queued range above 'addr'. */
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(spans[mid].addr < addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	prev = (lo > 0) ? (spans + lo - 1) : NULL;
+	next = (lo < reclaim_count) ? (spans + lo) : NULL;
+	/* overlapping ranges are a double unmap, leave them to the caller. */
+	if(prev != NULL && (prev->addr + prev->len) > addr) return -1;
+	if(next != NULL && (addr + len) > next->addr) return -1;
+	if(prev != NULL && (prev->addr + prev->len) == addr) {
+		prev->len += len;
+		if(next != NULL && (addr + len) == next->addr) {
+			prev->len += next->len;
+			reclaim_count--;
+			memmove(next, next + 1, (reclaim_count - lo) * sizeof(Span));
+		}
+		return 0;
+	}
+	if(next != NULL && (addr + len) == next->addr) {
+		next->addr = addr;
+		next->len += len;
+		return 0;
+	}
+	if(reclaim_count >= max) return -1;
+	memmove(spans + lo + 1, spans + lo, (reclaim_count - lo) * sizeof(Span));
+	spans[lo].addr = addr;
+	spans[lo].len = len;
+	reclaim_count++;
+	return 0;
+}
+
+int reclaim_queue(uint8_t *addr, size_t len) {
+	int rc;
+
+	if(reclaim_delay == 0) return -1;
+	if(bg_thread_ensure(&reclaim_worker, &reclaim_lock) != 0) return -1;
+	pthread_mutex_lock(&reclaim_lock);
+	rc = reclaim_insert(addr, len, RECLAIM_MAX_RANGES);
+	if(rc == 0) {
+		reclaim_bytes += len;
+		reclaim_stats.queued++;
+	}
+	if(rc != 0 || reclaim_count == 1 || reclaim_bytes >= reclaim_batch_bytes) {
+		pthread_cond_signal(&reclaim_wake);
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+	return rc;
+}
+
+int reclaim_flush() {
+	Span *spans;
+	int waited = 0;
+	int count;
+
+	if(reclaim_delay == 0) return 0;
+	pthread_mutex_lock(&reclaim_lock);
+	/* wait for the reclaim thread to finish its batch. */
+	while(reclaim_busy) {
+		pthread_cond_wait(&reclaim_done, &reclaim_lock);
+		waited = 1;
+	}
+	spans = reclaim_take(&count);
+	if(count > 0) {
+		/* keep the reclaim thread off the batch until it has been unmapped. */
+		reclaim_busy = 1;
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+	/* ranges unmapped by the reclaim thread while we waited count too. */
+	if(count == 0) return waited;
+
+	reclaim_ranges(spans, count);
+
+	pthread_mutex_lock(&reclaim_lock);
+	reclaim_busy = 0;
+	reclaim_inflight = 0;
+	pthread_cond_broadcast(&reclaim_done);
+	pthread_mutex_unlock(&reclaim_lock);
+	return count;
+}
+
+void reclaim_get_stats(ReclaimStats *stats) {
+	pthread_mutex_lock(&reclaim_lock);
+	*stats = reclaim_stats;
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+#endif
+
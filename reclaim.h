@@ -0,0 +1,52 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__RECLAIM_H__)
+#define __RECLAIM_H__
+
+#include "lcommon.h"
+
+#include <stddef.h>
+
+/*
+ * Deferred unmapping of low-memory ranges.
+ *
+ * Released ranges are queued, adjacent ranges are merged, and a background
+ * thread unmaps them in batches.  A queued range stays reserved in the page
+ * allocator until it has been unmapped.  Only used by the thread-safe build,
+ * the single-threaded build gets no-op stubs.
+ */
+
+/* unmap a range and return it to the page allocator. */
+typedef void (*ReclaimFn)(uint8_t *addr, size_t len);
+
+typedef struct ReclaimStats {
+	uint64_t  queued;   /* munmap calls that were deferred. */
+	uint64_t  batches;  /* batches processed. */
+	uint64_t  unmaps;   /* merged ranges unmapped. */
+	uint64_t  bytes;    /* bytes unmapped. */
+} ReclaimStats;
+
+#ifdef SUPPORT_THREADS
+
+L_LIB_API void reclaim_init(ReclaimFn reclaim, uint64_t delay_ms, size_t batch_bytes);
+
+/* returns 0 if the range was queued, the caller must unmap it otherwise. */
+L_LIB_API int reclaim_queue(uint8_t *addr, size_t len);
+
+/* unmap every queued range now, returns the number of ranges unmapped. */
+L_LIB_API int reclaim_flush();
+
+L_LIB_API void reclaim_get_stats(ReclaimStats *stats);
+
+#else
+
+L_INLINE void reclaim_init(ReclaimFn reclaim, uint64_t delay_ms, size_t batch_bytes) { }
+L_INLINE int reclaim_queue(uint8_t *addr, size_t len) { return -1; }
+L_INLINE int reclaim_flush() { return 0; }
+L_INLINE void reclaim_get_stats(ReclaimStats *stats) { *stats = (ReclaimStats){ 0 }; }
+
+#endif
+
+#endif /* __RECLAIM_H__ */
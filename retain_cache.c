@@ -0,0 +1,271 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "retain_cache.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "wrap_mmap.h"
+#include "span_cache.h"
+
+#ifdef SUPPORT_THREADS
+#include <pthread.h>
+
+static pthread_mutex_t retain_lock = PTHREAD_MUTEX_INITIALIZER;
+#define RETAIN_LOCK() pthread_mutex_lock(&retain_lock)
+#define RETAIN_UNLOCK() pthread_mutex_unlock(&retain_lock)
+#else
+#define RETAIN_LOCK() do { } while(0)
+#define RETAIN_UNLOCK() do { } while(0)
+#endif
+
+/* one class per page count for small spans, then one class per power of two. */
+#define RETAIN_SMALL_CLASSES 16
+#define RETAIN_SMALL_SHIFT 4
+#define RETAIN_CLASSES (RETAIN_SMALL_CLASSES + 16)
+/* upper limit for the number of retained spans. */
+#define RETAIN_MAX_SPANS 512
+/* spans released per eviction pass. */
+#define RETAIN_BATCH 16
+
+typedef struct RetainSpan RetainSpan;
+
+struct RetainSpan {
+	uint8_t    *addr;
+	size_t     len;
+	int        prot;
+	uint64_t   time;     /* when the span was retained, in ms. */
+	RetainSpan *next;    /* size class list, newest first, also links unused spans. */
+	RetainSpan *prev;
+	RetainSpan *lru_next; /* all retained spans, oldest first. */
+	RetainSpan *lru_prev;
+};
+
+static RetainReleaseFn retain_release = NULL;
+static size_t retain_page_shift = 12;
+static size_t retain_max_bytes = 0;
+static uint64_t retain_decay = 0;
+static int retain_lazy = 0;
+
+static RetainSpan *retain_spans = NULL;
+static RetainSpan *retain_unused = NULL;
+static RetainSpan *retain_cls[RETAIN_CLASSES];
+static RetainSpan *retain_lru_head = NULL;
+static RetainSpan *retain_lru_tail = NULL;
+static RetainCacheStats retain_stats;
+
+static uint64_t retain_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static int retain_class(size_t len) {
+	size_t pages = len >> retain_page_shift;
+	int cls;
+
+	if(pages == 0) return -1;
+	if(pages <= RETAIN_SMALL_CLASSES) return pages - 1;
+	cls = RETAIN_SMALL_CLASSES + (63 - __builtin_clzll(pages - 1)) - RETAIN_SMALL_SHIFT;
+	return (cls < RETAIN_CLASSES) ? cls : -1;
+}
+
+static void retain_lru_unlink(RetainSpan *span) {
+	if(span->lru_prev != NULL) {
+		span->lru_prev->lru_next = span->lru_next;
+	} else {
+		retain_lru_head = span->lru_next;
+	}
+	if(span->lru_next != NULL) {
+		span->lru_next->lru_prev = span->lru_prev;
+	} else {
+		retain_lru_tail = span->lru_prev;
+	}
+}
+
+static void retain_remove(RetainSpan *span) {
+	int cls = retain_class(span->len);
+
+	if(span->prev != NULL) {
+		span->prev->next = span->next;
+	} else {
+		retain_cls[cls] = span->next;
+	}
+	if(span->next != NULL) {
+		span->next->prev = span->prev;
+	}
+	retain_lru_unlink(span);
+	retain_stats.bytes -= span->len;
+	span->next = retain_unused;
+	retain_unused = span;
+}
+
+static void retain_insert(uint8_t *addr, size_t len, int prot, uint64_t now) {
+	RetainSpan *span = retain_unused;
+	int cls = retain_class(len);
+
+	retain_unused = span->next;
+	span->addr = addr;
+	span->len = len;
+	span->prot = prot;
+	span->time = now;
+	span->prev = NULL;
+	span->next = retain_cls[cls];
+	if(span->next != NULL) {
+		span->next->prev = span;
+	}
+	retain_cls[cls] = span;
+	span->lru_next = NULL;
+	span->lru_prev = retain_lru_tail;
+	if(retain_lru_tail != NULL) {
+		retain_lru_tail->lru_next = span;
+	} else {
+		retain_lru_head = span;
+	}
+	retain_lru_tail = span;
+	retain_stats.bytes += len;
+}
+
+/* remove old spans, and make room for 'need' more bytes. */
+static int retain_evict(Span *spans, uint64_t now, size_t need) {
+	int count = 0;
+
+	while(retain_lru_head != NULL && count < RETAIN_BATCH) {
+		RetainSpan *span = retain_lru_head;
+		if((retain_stats.bytes + need) <= retain_max_bytes && retain_unused != NULL &&
+				(now - span->time) < retain_decay) {
+			break;
+		}
+		spans[count].addr = span->addr;
+		spans[count].len = span->len;
+		count++;
+		retain_remove(span);
+	}
+	retain_stats.evictions += count;
+	return count;
+}
+
+static void retain_release_spans(Span *spans, int count) {
+	int i;
+
+	for(i = 0; i < count; i++) {
+		retain_release(spans[i].addr, spans[i].len);
+	}
+}
+
+void retain_cache_init(RetainReleaseFn release, size_t page_size, size_t max_bytes,
+	uint64_t decay_ms, int lazy)
+{
+	int i;
+
+	retain_release = release;
+	retain_page_shift = __builtin_ctzll(page_size);
+	retain_decay = decay_ms;
+	retain_lazy = lazy;
+	if(max_bytes == 0) return;
+	retain_spans = (RetainSpan *)SYS_MMAP(NULL, RETAIN_MAX_SPANS * sizeof(RetainSpan),
+		PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(retain_spans == MAP_FAILED) {
+		retain_spans = NULL;
+		return;
+	}
+	for(i = 0; i < RETAIN_MAX_SPANS; i++) {
+		retain_spans[i].next = retain_unused;
+		retain_unused = retain_spans + i;
+	}
+	retain_max_bytes = max_bytes;
+}
+
+uint8_t *retain_cache_get(size_t len, int prot) {
+	Span spans[RETAIN_BATCH];
+	RetainSpan *span;
+	uint8_t *addr = NULL;
+	int count;
+	int cls;
+
+	if(retain_max_bytes == 0) return NULL;
+	cls = retain_class(len);
+	if(cls < 0) return NULL;
+	RETAIN_LOCK();
+	for(span = retain_cls[cls]; span != NULL; span = span->next) {
+		if(span->len == len && span->prot == prot) {
+			addr = span->addr;
+			retain_remove(span);
+			retain_stats.hits++;
+			break;
+		}
+	}
+	count = retain_evict(spans, retain_now(), 0);
+	RETAIN_UNLOCK();
+	retain_release_spans(spans, count);
+	return addr;
+}
+
+int retain_cache_put(uint8_t *addr, size_t len, int prot) {
+	Span spans[RETAIN_BATCH + 1];
+	uint64_t now;
+	int count;
+
+	if(len > retain_max_bytes || retain_class(len) < 0) return -1;
+
+	/* drop the pages, and undo any mprotect() calls. */
+	if(retain_lazy && madvise(addr, len, MADV_FREE) != 0) {
+		retain_lazy = 0;
+	}
+	if(!retain_lazy && madvise(addr, len, MADV_DONTNEED) != 0) return -1;
+	if(mprotect(addr, len, prot) != 0) return -1;
+
+	now = retain_now();
+	RETAIN_LOCK();
+	count = retain_evict(spans, now, len);
+	if(retain_unused != NULL && (retain_stats.bytes + len) <= retain_max_bytes) {
+		retain_insert(addr, len, prot, now);
+		retain_stats.retained++;
+	} else {
+		/* every slot is taken by spans that are too new to evict. */
+		spans[count].addr = addr;
+		spans[count].len = len;
+		count++;
+	}
+	RETAIN_UNLOCK();
+	retain_release_spans(spans, count);
+	return 0;
+}
+
+int retain_cache_flush() {
+	Span spans[RETAIN_BATCH];
+	int total = 0;
+	int count;
+
+	if(retain_max_bytes == 0) return 0;
+	do {
+		count = 0;
+		RETAIN_LOCK();
+		while(retain_lru_head != NULL && count < RETAIN_BATCH) {
+			RetainSpan *span = retain_lru_head;
+			spans[count].addr = span->addr;
+			spans[count].len = span->len;
+			count++;
+			retain_remove(span);
+		}
+		retain_stats.evictions += count;
+		RETAIN_UNLOCK();
+		retain_release_spans(spans, count);
+		total += count;
+	} while(count > 0);
+	return total;
+}
+
+void retain_cache_get_stats(RetainCacheStats *stats) {
+	RETAIN_LOCK();
+	*stats = retain_stats;
+	RETAIN_UNLOCK();
+}
+
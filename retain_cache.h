@@ -0,0 +1,48 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__RETAIN_CACHE_H__)
+#define __RETAIN_CACHE_H__
+
+#include "lcommon.h"
+
+#include <stddef.h>
+
+/*
+ * Cache of unmapped anonymous low-memory spans that are kept mapped.
+ *
+ * Instead of unmapping a private anonymous mapping, its pages are dropped
+ * with madvise() and the span is kept, still mapped, so a later mmap of the
+ * same size and protection can be handed the span without a syscall.
+ *
+ * Spans that are not reused within the decay time, or that don't fit in the
+ * byte limit, are handed back with the release callback.
+ */
+
+/* unmap a span and return it to the page allocator. */
+typedef void (*RetainReleaseFn)(uint8_t *addr, size_t len);
+
+typedef struct RetainCacheStats {
+	uint64_t  retained;  /* munmap calls that kept the span. */
+	uint64_t  hits;      /* mmap calls served from the cache. */
+	uint64_t  evictions; /* spans handed back to the page allocator. */
+	size_t    bytes;     /* bytes currently retained. */
+} RetainCacheStats;
+
+/* 'lazy' uses MADV_FREE, reused spans might not be zero filled. */
+L_LIB_API void retain_cache_init(RetainReleaseFn release, size_t page_size, size_t max_bytes,
+	uint64_t decay_ms, int lazy);
+
+L_LIB_API uint8_t *retain_cache_get(size_t len, int prot);
+
+/* 'addr' must be a whole private anonymous mapping with protection 'prot'.
+ * returns 0 if the span was retained, the caller must unmap it otherwise. */
+L_LIB_API int retain_cache_put(uint8_t *addr, size_t len, int prot);
+
+/* release all retained spans, returns the number of spans released. */
+L_LIB_API int retain_cache_flush();
+
+L_LIB_API void retain_cache_get_stats(RetainCacheStats *stats);
+
+#endif /* __RETAIN_CACHE_H__ */
@@ -0,0 +1,281 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "span_cache.h"
+
+#ifdef SUPPORT_THREADS
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "wrap_mmap.h"
+
+/* one class per page count for small spans. */
+#define SPAN_SMALL_CLASSES 16
+#define SPAN_SMALL_SHIFT 4
+/* then one class per power of two. */
+#define SPAN_CLASSES (SPAN_SMALL_CLASSES + 16)
+/* spans kept per class. */
+#define SPAN_CLASS_DEPTH 8
+/* spans flushed when a class is full. */
+#define SPAN_FLUSH_BATCH (SPAN_CLASS_DEPTH / 2)
+
+typedef struct SpanClass {
+	int       count;
+	Span      span[SPAN_CLASS_DEPTH]; /* oldest span first. */
+} SpanClass;
+
+typedef struct SpanCache SpanCache;
+
+struct SpanCache {
+	SpanCache *next;
+	SpanCache *prev;
+	pthread_mutex_t lock;  /* only contended by span_cache_flush_all(). */
+	size_t    bytes;
+	SpanCacheStats stats;
+	SpanClass cls[SPAN_CLASSES];
+};
+
+static SpanFlushFn span_flush = NULL;
+static size_t span_page_shift = 12;
+static size_t span_max_bytes = 0;
+
+/* list of thread caches, used to collect stats and by span_cache_flush_all(). */
+static pthread_mutex_t span_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static SpanCache *span_list = NULL;
+/* stats from exited threads. */
+static SpanCacheStats span_retired;
+
+static pthread_once_t span_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t span_key;
+
+/* initial-exec, so looking up the cache never calls into the dynamic linker/malloc. */
+static __thread SpanCache *thread_cache __attribute__((tls_model("initial-exec"))) = NULL;
+
+/* counters are only written by their own thread, but summed from others. */
+#define SPAN_STAT_INC(counter) __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+
+static void span_stats_add(SpanCacheStats *dst, const SpanCacheStats *src) {
+	dst->ops += __atomic_load_n(&(src->ops), __ATOMIC_RELAXED);
+	dst->lock_acquires += __atomic_load_n(&(src->lock_acquires), __ATOMIC_RELAXED);
+	dst->hits += __atomic_load_n(&(src->hits), __ATOMIC_RELAXED);
+	dst->flushes += __atomic_load_n(&(src->flushes), __ATOMIC_RELAXED);
+}
+
+static int span_class(size_t len) {
+	size_t pages = len >> span_page_shift;
+	int cls;
+
+	if(pages == 0) return -1;
+	if(pages <= SPAN_SMALL_CLASSES) return pages - 1;
+	cls = SPAN_SMALL_CLASSES + (63 - __builtin_clzll(pages - 1)) - SPAN_SMALL_SHIFT;
+	return (cls < SPAN_CLASSES) ? cls : -1;
+}
+
+static void span_flush_batch(SpanCache *cache, Span *spans, int count) {
+	int i;
+
+	if(count == 0) return;
+	for(i = 0; i < count; i++) {
+		cache->bytes -= spans[i].len;
+	}
+	SPAN_STAT_INC(cache->stats.flushes);
+	span_flush(spans, count);
+}
+
+static int span_flush_all(SpanCache *cache) {
+	Span spans[SPAN_CLASSES * SPAN_CLASS_DEPTH];
+	int count = 0;
+	int i;
+
+	for(i = 0; i < SPAN_CLASSES; i++) {
+		SpanClass *cls = cache->cls + i;
+		memcpy(spans + count, cls->span, cls->count * sizeof(Span));
+		count += cls->count;
+		cls->count = 0;
+	}
+	span_flush_batch(cache, spans, count);
+	return count;
+}
+
+static void span_cache_destroy(void *data) {
+	SpanCache *cache = (SpanCache *)data;
+
+	thread_cache = NULL;
+
+	/* unlink first, so span_cache_flush_all() can't see the cache after it is gone. */
+	pthread_mutex_lock(&span_list_lock);
+	span_stats_add(&span_retired, &(cache->stats));
+	if(cache->prev != NULL) {
+		cache->prev->next = cache->next;
+	} else {
+		span_list = cache->next;
+	}
+	if(cache->next != NULL) {
+		cache->next->prev = cache->prev;
+	}
+	pthread_mutex_unlock(&span_list_lock);
+
+	span_flush_all(cache);
+	pthread_mutex_destroy(&(cache->lock));
+	SYS_MUNMAP(cache, sizeof(SpanCache));
+}
+
+static void span_key_init() {
+	pthread_key_create(&span_key, span_cache_destroy);
+}
+
+static SpanCache *span_cache_new() {
+	SpanCache *cache;
+
+	/* allocate cache directly from the system, we can't call malloc from inside mmap. */
+	cache = (SpanCache *)SYS_MMAP(NULL, sizeof(SpanCache), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(cache == MAP_FAILED) return NULL;
+	pthread_mutex_init(&(cache->lock), NULL);
+
+	pthread_once(&span_key_once, span_key_init);
+	pthread_setspecific(span_key, cache);
+
+	pthread_mutex_lock(&span_list_lock);
+	cache->prev = NULL;
+	cache->next = span_list;
+	if(span_list != NULL) {
+		span_list->prev = cache;
+	}
+	span_list = cache;
+	pthread_mutex_unlock(&span_list_lock);
+
+	thread_cache = cache;
+	return cache;
+}
+
+static inline SpanCache *span_cache_self() {
+	SpanCache *cache = thread_cache;
+	if(L_UNLIKELY(cache == NULL)) {
+		cache = span_cache_new();
+	}
+	return cache;
+}
+
+void span_cache_init(SpanFlushFn flush, size_t page_size, size_t max_bytes) {
+	span_flush = flush;
+	span_page_shift = __builtin_ctzll(page_size);
+	span_max_bytes = max_bytes;
+}
+
+uint8_t *span_cache_get(size_t len) {
+	SpanCache *cache;
+	SpanClass *cls;
+	int idx;
+	int i;
+
+	if(span_max_bytes == 0) return NULL;
+	idx = span_class(len);
+	if(idx < 0) return NULL;
+	cache = span_cache_self();
+	if(cache == NULL) return NULL;
+	cls = cache->cls + idx;
+	pthread_mutex_lock(&(cache->lock));
+	/* newest span first, it is the most likely to still be in the TLB. */
+	for(i = cls->count - 1; i >= 0; i--) {
+		if(cls->span[i].len == len) {
+			uint8_t *addr = cls->span[i].addr;
+			cls->count--;
+			memmove(cls->span + i, cls->span + i + 1, (cls->count - i) * sizeof(Span));
+			cache->bytes -= len;
+			SPAN_STAT_INC(cache->stats.hits);
+			pthread_mutex_unlock(&(cache->lock));
+			return addr;
+		}
+	}
+	pthread_mutex_unlock(&(cache->lock));
+	return NULL;
+}
+
+int span_cache_put(uint8_t *addr, size_t len) {
+	SpanCache *cache;
+	SpanClass *cls;
+	int idx;
+
+	if(len > span_max_bytes) return -1;
+	idx = span_class(len);
+	if(idx < 0) return -1;
+	cache = span_cache_self();
+	if(cache == NULL) return -1;
+	pthread_mutex_lock(&(cache->lock));
+	if((cache->bytes + len) > span_max_bytes) {
+		/* cache is full, return everything to the page allocator. */
+		span_flush_all(cache);
+	}
+	cls = cache->cls + idx;
+	if(cls->count == SPAN_CLASS_DEPTH) {
+		/* flush the oldest spans of this class. */
+		span_flush_batch(cache, cls->span, SPAN_FLUSH_BATCH);
+		cls->count -= SPAN_FLUSH_BATCH;
+		memmove(cls->span, cls->span + SPAN_FLUSH_BATCH, cls->count * sizeof(Span));
+	}
+	cls->span[cls->count].addr = addr;
+	cls->span[cls->count].len = len;
+	cls->count++;
+	cache->bytes += len;
+	pthread_mutex_unlock(&(cache->lock));
+	return 0;
+}
+
+int span_cache_flush() {
+	SpanCache *cache = thread_cache;
+	int count;
+
+	if(cache == NULL) return 0;
+	pthread_mutex_lock(&(cache->lock));
+	count = span_flush_all(cache);
+	pthread_mutex_unlock(&(cache->lock));
+	return count;
+}
+
+int span_cache_flush_all() {
+	SpanCache *cache;
+	int count = 0;
+
+	pthread_mutex_lock(&span_list_lock);
+	for(cache = span_list; cache != NULL; cache = cache->next) {
+		pthread_mutex_lock(&(cache->lock));
+		count += span_flush_all(cache);
+		pthread_mutex_unlock(&(cache->lock));
+	}
+	pthread_mutex_unlock(&span_list_lock);
+	return count;
+}
+
+void span_cache_count_op() {
+	SpanCache *cache;
+
+	/* with the span cache disabled, don't create one just to count. */
+	if(span_max_bytes == 0) return;
+	cache = span_cache_self();
+	if(cache != NULL) SPAN_STAT_INC(cache->stats.ops);
+}
+
+void span_cache_count_lock() {
+	SpanCache *cache = thread_cache;
+	if(cache != NULL) SPAN_STAT_INC(cache->stats.lock_acquires);
+}
+
+void span_cache_get_stats(SpanCacheStats *stats) {
+	SpanCache *cache;
+
+	pthread_mutex_lock(&span_list_lock);
+	*stats = span_retired;
+	for(cache = span_list; cache != NULL; cache = cache->next) {
+		span_stats_add(stats, &(cache->stats));
+	}
+	pthread_mutex_unlock(&span_list_lock);
+}
+
+#endif
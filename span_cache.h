@@ -0,0 +1,69 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__SPAN_CACHE_H__)
+#define __SPAN_CACHE_H__
+
+#include "lcommon.h"
+
+#include <stddef.h>
+
+/*
+ * Per-thread caches of recently freed low-memory spans.
+ *
+ * Spans in a cache are still reserved in the page allocator, so a thread can
+ * reuse them for a same-sized mmap without taking the page allocator lock.
+ * Each cache has its own lock, which is only contended when another thread
+ * flushes every cache.
+ * Only used by the thread-safe build, the single-threaded build gets no-op
+ * stubs.
+ */
+typedef struct Span {
+	uint8_t   *addr;
+	size_t    len;
+} Span;
+
+/* release a batch of spans back to the page allocator. */
+typedef void (*SpanFlushFn)(Span *spans, int count);
+
+typedef struct SpanCacheStats {
+	uint64_t  ops;           /* mmap/munmap/mremap calls in the low region. */
+	uint64_t  lock_acquires; /* page allocator lock acquisitions. */
+	uint64_t  hits;          /* mmap calls served from a span cache. */
+	uint64_t  flushes;       /* batches flushed back to the page allocator. */
+} SpanCacheStats;
+
+#ifdef SUPPORT_THREADS
+
+L_LIB_API void span_cache_init(SpanFlushFn flush, size_t page_size, size_t max_bytes);
+
+L_LIB_API uint8_t *span_cache_get(size_t len);
+
+L_LIB_API int span_cache_put(uint8_t *addr, size_t len);
+
+L_LIB_API int span_cache_flush();
+
+/* flush the caches of all threads, returns the number of spans flushed. */
+L_LIB_API int span_cache_flush_all();
+
+L_LIB_API void span_cache_count_op();
+
+L_LIB_API void span_cache_count_lock();
+
+L_LIB_API void span_cache_get_stats(SpanCacheStats *stats);
+
+#else
+
+L_INLINE void span_cache_init(SpanFlushFn flush, size_t page_size, size_t max_bytes) { }
+L_INLINE uint8_t *span_cache_get(size_t len) { return NULL; }
+L_INLINE int span_cache_put(uint8_t *addr, size_t len) { return -1; }
+L_INLINE int span_cache_flush() { return 0; }
+L_INLINE int span_cache_flush_all() { return 0; }
+L_INLINE void span_cache_count_op() { }
+L_INLINE void span_cache_count_lock() { }
+L_INLINE void span_cache_get_stats(SpanCacheStats *stats) { *stats = (SpanCacheStats){ 0 }; }
+
+#endif
+
+#endif /* __SPAN_CACHE_H__ */
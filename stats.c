@@ -0,0 +1,114 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "stats.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#define STATS_SHARDS 16
+
+#define CACHE_LINE 64
+
+typedef struct StatsShard {
+	StatsOpCounters op[STATS_OPS];
+} __attribute__((aligned(CACHE_LINE))) StatsShard;
+
+static StatsShard stats_shard[STATS_SHARDS];
+
+#ifdef SUPPORT_THREADS
+static __thread int stats_home __attribute__((tls_model("initial-exec"))) = -1;
+static int stats_next_home = 0;
+
+/* threads are handed shards round-robin. */
+static inline StatsShard *stats_self() {
+	int home = stats_home;
+	if(L_UNLIKELY(home < 0)) {
+		home = __atomic_fetch_add(&stats_next_home, 1, __ATOMIC_RELAXED) % STATS_SHARDS;
+		stats_home = home;
+	}
+	return stats_shard + home;
+}
+#else
+#define stats_self() (stats_shard)
+#endif
+
+#define STATS_INC(counter) __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+
+static const char *stats_op_names[STATS_OPS] = {
+	"mmap",
+	"munmap",
+	"mremap",
+};
+
+uint64_t stats_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+uint64_t stats_record(StatsOp op, uint64_t start, int failed) {
+	StatsOpCounters *counters = stats_self()->op + op;
+	uint64_t ns = stats_now() - start;
+	int bucket = (ns > 1) ? (63 - __builtin_clzll(ns)) : 0;
+
+	if(bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
+	STATS_INC(counters->calls);
+	STATS_INC(counters->latency[bucket]);
+	if(failed) {
+		STATS_INC(counters->failures);
+	}
+	return ns;
+}
+
+void stats_fallback(StatsOp op) {
+	STATS_INC(stats_self()->op[op].fallbacks);
+}
+
+void stats_get_ops(StatsOpCounters *ops) {
+	int s;
+	int op;
+	int i;
+
+	memset(ops, 0, STATS_OPS * sizeof(StatsOpCounters));
+	for(s = 0; s < STATS_SHARDS; s++) {
+		for(op = 0; op < STATS_OPS; op++) {
+			StatsOpCounters *src = stats_shard[s].op + op;
+			StatsOpCounters *dst = ops + op;
+			dst->calls += __atomic_load_n(&(src->calls), __ATOMIC_RELAXED);
+			dst->fallbacks += __atomic_load_n(&(src->fallbacks), __ATOMIC_RELAXED);
+			dst->failures += __atomic_load_n(&(src->failures), __ATOMIC_RELAXED);
+			for(i = 0; i < STATS_BUCKETS; i++) {
+				dst->latency[i] += __atomic_load_n(&(src->latency[i]), __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+int stats_format_op(char *buf, size_t size, const char *name, const StatsOpCounters *op) {
+	size_t len;
+	int i;
+
+	len = snprintf(buf, size, "%s: calls=%llu, fallbacks=%llu, failures=%llu, latency_ns:", name,
+		(unsigned long long)op->calls, (unsigned long long)op->fallbacks,
+		(unsigned long long)op->failures);
+	for(i = 0; i < STATS_BUCKETS && len < size; i++) {
+		if(op->latency[i] == 0) continue;
+		len += snprintf(buf + len, size - len, " %llu=%llu", 1ULL << i,
+			(unsigned long long)op->latency[i]);
+	}
+	if(len < size) {
+		len += snprintf(buf + len, size - len, "\n");
+	}
+	return (len < size) ? (int)len : (int)size - 1;
+}
+
+const char *stats_op_name(StatsOp op) {
+	return stats_op_names[op];
+}
+
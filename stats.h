@@ -0,0 +1,61 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__STATS_H__)
+#define __STATS_H__
+
+#include "lcommon.h"
+
+#include <stddef.h>
+
+/*
+ * Always-on counters and latency histograms for the mmap hooks.
+ *
+ * Counters are split into a few cache-line aligned shards, each thread
+ * updates one shard with relaxed atomics, readers sum all shards.
+ */
+typedef enum StatsOp {
+	STATS_MMAP = 0,
+	STATS_MUNMAP,
+	STATS_MREMAP,
+	STATS_OPS,
+} StatsOp;
+
+/* bucket 'i' counts calls that took [2^i, 2^(i+1)) nanoseconds. */
+#define STATS_BUCKETS 32
+
+typedef struct StatsOpCounters {
+	uint64_t  calls;      /* calls handled in the low region. */
+	uint64_t  fallbacks;  /* calls passed straight to the system. */
+	uint64_t  failures;   /* low region calls that failed. */
+	uint64_t  latency[STATS_BUCKETS];
+} StatsOpCounters;
+
+typedef struct LowmemStats {
+	StatsOpCounters op[STATS_OPS];
+	size_t    region_bytes;   /* size of the low region. */
+	size_t    mapped_bytes;   /* bytes in live mappings. */
+	size_t    reserved_bytes; /* bytes taken from the page allocator, includes cached spans. */
+	size_t    free_bytes;
+	size_t    free_segs;      /* number of free fragments. */
+	size_t    largest_free;   /* largest free fragment. */
+} LowmemStats;
+
+/* timestamp, in nanoseconds. */
+L_LIB_API uint64_t stats_now();
+
+/* count a low region call that started at 'start', returns how long it took. */
+L_LIB_API uint64_t stats_record(StatsOp op, uint64_t start, int failed);
+
+L_LIB_API void stats_fallback(StatsOp op);
+
+/* sum the per-operation counters. */
+L_LIB_API void stats_get_ops(StatsOpCounters *ops);
+
+/* format one operation's counters and histogram, returns the length written. */
+L_LIB_API int stats_format_op(char *buf, size_t size, const char *name, const StatsOpCounters *op);
+
+L_LIB_API const char *stats_op_name(StatsOp op);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,89 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "stats_page.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wrap_mmap.h"
+
+#define STATS_PAGE_NAME_MAX 256
+
+static StatsPage *stats_page = NULL;
+static StatsPageFillFn stats_page_fill = NULL;
+static char stats_page_name[STATS_PAGE_NAME_MAX];
+static uint64_t stats_page_interval = 0;
+static uint64_t stats_page_next = 0;
+/* only one thread writes the page at a time. */
+static int stats_page_busy = 0;
+
+int stats_page_init(const char *name, uint64_t interval_ms, StatsPageFillFn fill) {
+	StatsPage *page;
+	int fd;
+
+	if(strlen(name) >= STATS_PAGE_NAME_MAX) return -1;
+	fd = shm_open(name, O_CREAT|O_RDWR|O_TRUNC, 0644);
+	if(fd < 0) return -1;
+	if(ftruncate(fd, sizeof(StatsPage)) != 0) {
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	/* map it directly from the system, it doesn't belong in the low region. */
+	page = (StatsPage *)SYS_MMAP(NULL, sizeof(StatsPage), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(page == MAP_FAILED) {
+		shm_unlink(name);
+		return -1;
+	}
+	page->version = STATS_PAGE_VERSION;
+	page->pid = getpid();
+	strcpy(stats_page_name, name);
+	stats_page_fill = fill;
+	stats_page_interval = interval_ms * 1000000;
+	stats_page = page;
+	stats_page_update();
+	/* readers check the magic last. */
+	__atomic_store_n(&(page->magic), STATS_PAGE_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void stats_page_update() {
+	StatsPage *page = stats_page;
+
+	if(page == NULL) return;
+	if(__atomic_exchange_n(&stats_page_busy, 1, __ATOMIC_ACQUIRE)) return;
+	__atomic_store_n(&(page->seq), page->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	stats_page_fill(page);
+	page->updated_ns = stats_now();
+	__atomic_store_n(&(page->seq), page->seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&stats_page_busy, 0, __ATOMIC_RELEASE);
+}
+
+void stats_page_tick() {
+	uint64_t now = stats_now();
+	uint64_t next = __atomic_load_n(&stats_page_next, __ATOMIC_RELAXED);
+
+	if(now < next) return;
+	/* the thread that moves the deadline does the update. */
+	if(!__atomic_compare_exchange_n(&stats_page_next, &next, now + stats_page_interval, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		return;
+	}
+	stats_page_update();
+}
+
+void stats_page_close() {
+	if(stats_page == NULL) return;
+	stats_page_update();
+	shm_unlink(stats_page_name);
+}
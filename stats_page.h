@@ -0,0 +1,72 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__STATS_PAGE_H__)
+#define __STATS_PAGE_H__
+
+#include "lcommon.h"
+#include "stats.h"
+
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Statistics published to a POSIX shared memory segment.
+ *
+ * The library rewrites the page at most once per interval, from inside a hook
+ * call.  Writes are bracketed by a sequence counter that is odd while the page
+ * is being written, so readers (mmap_lowmem_stat) never take a lock, they just
+ * copy the page again if the counter changed under them.
+ */
+#define STATS_PAGE_MAGIC    0x54534d454d574f4cULL  /* "LOWMEMST" */
+#define STATS_PAGE_VERSION  1
+
+/* the free-space map splits the low region into this many cells. */
+#define STATS_PAGE_CELLS    256
+
+typedef struct StatsPage {
+	uint64_t    magic;
+	uint32_t    version;
+	uint32_t    pid;
+	uint64_t    seq;          /* odd while the page is being written. */
+	uint64_t    updated_ns;   /* CLOCK_MONOTONIC time of the last update. */
+	uint64_t    region_start;
+	uint64_t    cell_bytes;   /* bytes covered by one free-space map cell. */
+	LowmemStats stats;        /* largest_free is 0 if the engine can't tell without a walk. */
+	uint8_t     free_map[STATS_PAGE_CELLS];  /* free fraction of each cell, 0 - 255. */
+} StatsPage;
+
+/* fill the page between the sequence counter updates. */
+typedef void (*StatsPageFillFn)(StatsPage *page);
+
+/* create the shared memory segment 'name', returns -1 on error. */
+L_LIB_API int stats_page_init(const char *name, uint64_t interval_ms, StatsPageFillFn fill);
+
+/* rewrite the page if the interval is up. */
+L_LIB_API void stats_page_tick();
+
+/* rewrite the page now. */
+L_LIB_API void stats_page_update();
+
+/* remove the shared memory segment. */
+L_LIB_API void stats_page_close();
+
+/* copy a consistent snapshot of a page, returns -1 if the writer didn't finish in time. */
+L_INLINE int stats_page_read(const StatsPage *page, StatsPage *snap) {
+	int tries;
+
+	for(tries = 0; tries < 1000; tries++) {
+		uint64_t seq = __atomic_load_n(&(page->seq), __ATOMIC_ACQUIRE);
+		if(seq & 1) continue;
+		memcpy(snap, (const void *)page, sizeof(StatsPage));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&(page->seq), __ATOMIC_RELAXED) == seq) {
+			snap->seq = seq;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+#endif /* __STATS_PAGE_H__ */
@@ -0,0 +1,274 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "trace.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "wrap_mmap.h"
+#include "stats.h"
+
+/* records per thread buffer (160Kbytes). */
+#define TRACE_RECORDS 4096
+
+typedef struct TraceBuffer TraceBuffer;
+struct TraceBuffer {
+	TraceBuffer *next;
+	TraceBuffer *prev;
+	uint16_t    thread;
+	size_t      count;
+#ifdef SUPPORT_THREADS
+	/* only contended while trace_flush() writes the buffer out. */
+	pthread_mutex_t lock;
+#endif
+	TraceRecord rec[TRACE_RECORDS];
+};
+
+static int trace_fd = -1;
+static size_t trace_page_shift = 12;
+static uint64_t trace_start = 0;
+
+static void trace_write(const void *buf, size_t len) {
+	const char *p = (const char *)buf;
+
+	while(len > 0) {
+		ssize_t rc = write(trace_fd, p, len);
+		if(rc <= 0) {
+			if(rc < 0 && errno == EINTR) continue;
+			return;
+		}
+		p += rc;
+		len -= rc;
+	}
+}
+
+static void trace_buffer_flush(TraceBuffer *buf) {
+	if(buf->count == 0) return;
+	trace_write(buf->rec, buf->count * sizeof(TraceRecord));
+	buf->count = 0;
+}
+
+static TraceBuffer *trace_buffer_alloc() {
+	TraceBuffer *buf;
+
+	/* allocate buffer directly from the system, we can't call malloc from inside mmap. */
+	buf = (TraceBuffer *)SYS_MMAP(NULL, sizeof(TraceBuffer), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(buf == MAP_FAILED) return NULL;
+	buf->count = 0;
+#ifdef SUPPORT_THREADS
+	pthread_mutex_init(&(buf->lock), NULL);
+#endif
+	return buf;
+}
+
+/* the child's records would be written twice, once by each process, and interleave with the
+ * parent's in the same file, so tracing stops in a child. */
+static void trace_disable() {
+	if(trace_fd >= 0) {
+		close(trace_fd);
+		trace_fd = -1;
+	}
+}
+
+#ifdef SUPPORT_THREADS
+
+/* list of thread buffers, so they can all be flushed at exit. */
+static pthread_mutex_t trace_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *trace_list = NULL;
+static uint16_t trace_next_thread = 0;
+
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+
+static __thread TraceBuffer *thread_trace __attribute__((tls_model("initial-exec"))) = NULL;
+
+static inline void trace_buffer_lock(TraceBuffer *buf) {
+	pthread_mutex_lock(&(buf->lock));
+}
+
+static inline void trace_buffer_unlock(TraceBuffer *buf) {
+	pthread_mutex_unlock(&(buf->lock));
+}
+
+static void trace_buffer_destroy(void *data) {
+	TraceBuffer *buf = (TraceBuffer *)data;
+
+	thread_trace = NULL;
+	pthread_mutex_lock(&trace_list_lock);
+	trace_buffer_lock(buf);
+	trace_buffer_flush(buf);
+	trace_buffer_unlock(buf);
+	if(buf->prev != NULL) {
+		buf->prev->next = buf->next;
+	} else {
+		trace_list = buf->next;
+	}
+	if(buf->next != NULL) {
+		buf->next->prev = buf->prev;
+	}
+	pthread_mutex_unlock(&trace_list_lock);
+
+	SYS_MUNMAP(buf, sizeof(TraceBuffer));
+}
+
+static void trace_key_init() {
+	pthread_key_create(&trace_key, trace_buffer_destroy);
+}
+
+static TraceBuffer *trace_buffer_new() {
+	TraceBuffer *buf = trace_buffer_alloc();
+
+	if(buf == NULL) return NULL;
+	pthread_once(&trace_key_once, trace_key_init);
+	pthread_setspecific(trace_key, buf);
+
+	pthread_mutex_lock(&trace_list_lock);
+	buf->thread = trace_next_thread++;
+	buf->prev = NULL;
+	buf->next = trace_list;
+	if(trace_list != NULL) {
+		trace_list->prev = buf;
+	}
+	trace_list = buf;
+	pthread_mutex_unlock(&trace_list_lock);
+
+	thread_trace = buf;
+	return buf;
+}
+
+static inline TraceBuffer *trace_self() {
+	TraceBuffer *buf = thread_trace;
+	if(L_UNLIKELY(buf == NULL)) {
+		buf = trace_buffer_new();
+	}
+	return buf;
+}
+
+void trace_flush() {
+	TraceBuffer *buf;
+
+	if(trace_fd < 0) return;
+	pthread_mutex_lock(&trace_list_lock);
+	for(buf = trace_list; buf != NULL; buf = buf->next) {
+		/* the buffer's thread might be adding a record. */
+		trace_buffer_lock(buf);
+		trace_buffer_flush(buf);
+		trace_buffer_unlock(buf);
+	}
+	pthread_mutex_unlock(&trace_list_lock);
+}
+
+static void trace_atfork_prepare() {
+	pthread_mutex_lock(&trace_list_lock);
+}
+
+static void trace_atfork_parent() {
+	pthread_mutex_unlock(&trace_list_lock);
+}
+
+static void trace_atfork_child() {
+	TraceBuffer *buf;
+	TraceBuffer *next;
+
+	trace_disable();
+	/* only the forking thread exists in the child, free the other buffers and drop the parent's records. */
+	for(buf = trace_list; buf != NULL; buf = next) {
+		next = buf->next;
+		if(buf != thread_trace) {
+			SYS_MUNMAP(buf, sizeof(TraceBuffer));
+		}
+	}
+	trace_list = thread_trace;
+	if(thread_trace != NULL) {
+		thread_trace->next = NULL;
+		thread_trace->prev = NULL;
+		thread_trace->count = 0;
+		pthread_mutex_init(&(thread_trace->lock), NULL);
+	}
+	pthread_mutex_init(&trace_list_lock, NULL);
+}
+
+#else
+
+static TraceBuffer *trace_buf = NULL;
+
+static inline TraceBuffer *trace_self() {
+	if(L_UNLIKELY(trace_buf == NULL)) {
+		trace_buf = trace_buffer_alloc();
+		if(trace_buf != NULL) trace_buf->thread = 0;
+	}
+	return trace_buf;
+}
+
+static inline void trace_buffer_lock(TraceBuffer *buf) { }
+
+static inline void trace_buffer_unlock(TraceBuffer *buf) { }
+
+void trace_flush() {
+	if(trace_fd < 0 || trace_buf == NULL) return;
+	trace_buffer_flush(trace_buf);
+}
+
+static void trace_atfork_child() {
+	trace_disable();
+	/* drop the parent's records. */
+	if(trace_buf != NULL) trace_buf->count = 0;
+}
+
+#endif
+
+int trace_init(const char *path, size_t page_size, uint8_t *region_start, size_t region_len) {
+	TraceHeader hdr;
+
+	trace_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0644);
+	if(trace_fd < 0) return -1;
+	trace_page_shift = __builtin_ctzll(page_size);
+	trace_start = stats_now();
+	hdr.magic = TRACE_MAGIC;
+	hdr.version = TRACE_VERSION;
+	hdr.page_size = page_size;
+	hdr.region_start = (uintptr_t)region_start;
+	hdr.region_len = region_len;
+	trace_write(&hdr, sizeof(hdr));
+#ifdef SUPPORT_THREADS
+	pthread_atfork(trace_atfork_prepare, trace_atfork_parent, trace_atfork_child);
+#else
+	pthread_atfork(NULL, NULL, trace_atfork_child);
+#endif
+	return 0;
+}
+
+void trace_record(TraceOp op, uint64_t start, int failed, void *addr, size_t len,
+		void *new_addr, size_t new_len, int prot, int flags) {
+	size_t page_mask = ((size_t)1 << trace_page_shift) - 1;
+	TraceBuffer *buf;
+	TraceRecord *rec;
+
+	if(trace_fd < 0) return;
+	buf = trace_self();
+	if(buf == NULL) return;
+	trace_buffer_lock(buf);
+	rec = buf->rec + buf->count;
+	rec->time = start - trace_start;
+	rec->addr = (uintptr_t)addr;
+	rec->new_addr = (uintptr_t)new_addr;
+	rec->pages = (len + page_mask) >> trace_page_shift;
+	rec->new_pages = (new_len + page_mask) >> trace_page_shift;
+	rec->flags = flags;
+	rec->op = op | (failed ? TRACE_FAILED : 0);
+	rec->prot = prot;
+	rec->thread = buf->thread;
+	if(++buf->count == TRACE_RECORDS) {
+		trace_buffer_flush(buf);
+	}
+	trace_buffer_unlock(buf);
+}
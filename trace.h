@@ -0,0 +1,69 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__TRACE_H__)
+#define __TRACE_H__
+
+#include "lcommon.h"
+
+#include <stddef.h>
+
+/*
+ * Binary trace of the mmap/munmap/mremap calls handled in the low region.
+ *
+ * Each thread appends fixed size records to its own buffer, a full buffer is
+ * written to the trace file with one write() on an O_APPEND fd, so buffers
+ * from different threads never interleave.  Records are only ordered within
+ * a buffer, readers sort them by time (mmap_lowmem_replay does).  A forked
+ * child doesn't trace, the records it inherits are dropped.
+ *
+ * mmap records carry the time the call returned, munmap and mremap the time
+ * the call was made.  So when one thread unmaps a range and another one gets
+ * it from mmap, the munmap always sorts first.
+ *
+ * File layout: one TraceHeader, then TraceRecords.
+ */
+#define TRACE_MAGIC    0x31454341525454ULL  /* "TTRACE1" */
+#define TRACE_VERSION  1
+
+typedef enum TraceOp {
+	TRACE_MMAP = 0,
+	TRACE_MUNMAP,
+	TRACE_MREMAP,
+} TraceOp;
+
+/* or'ed into TraceRecord.op when the call failed. */
+#define TRACE_FAILED   0x80
+
+typedef struct TraceHeader {
+	uint64_t  magic;
+	uint32_t  version;
+	uint32_t  page_size;
+	uint64_t  region_start;
+	uint64_t  region_len;
+} TraceHeader;
+
+typedef struct TraceRecord {
+	uint64_t  time;       /* nanoseconds since the trace started. */
+	uint64_t  addr;       /* mmap: address returned, munmap/mremap: address passed in. */
+	uint64_t  new_addr;   /* mmap: address hint, mremap: address returned. */
+	uint32_t  pages;      /* length, in pages. */
+	uint32_t  new_pages;  /* mremap: new length, in pages. */
+	uint32_t  flags;      /* mmap() or mremap() flags. */
+	uint8_t   op;         /* TraceOp and TRACE_FAILED. */
+	uint8_t   prot;
+	uint16_t  thread;     /* small per-thread number. */
+} TraceRecord;
+
+/* create the trace file 'path', returns -1 on error. */
+L_LIB_API int trace_init(const char *path, size_t page_size, uint8_t *region_start, size_t region_len);
+
+/* append a record for a call that started at 'start' (stats_now() time). */
+L_LIB_API void trace_record(TraceOp op, uint64_t start, int failed, void *addr, size_t len,
+	void *new_addr, size_t new_len, int prot, int flags);
+
+/* write out the buffers of all threads. */
+L_LIB_API void trace_flush();
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,471 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "window.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <link.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#ifdef SUPPORT_THREADS
+#include <pthread.h>
+#endif
+
+#include "wrap_mmap.h"
+#include "proc_maps.h"
+
+#ifdef SUPPORT_THREADS
+#define WINDOW_LOCK(w) pthread_mutex_lock(&((w)->lock))
+#define WINDOW_UNLOCK(w) pthread_mutex_unlock(&((w)->lock))
+#else
+#define WINDOW_LOCK(w) do { } while(0)
+#define WINDOW_UNLOCK(w) do { } while(0)
+#endif
+
+/* a "text" window routes hints this close to the executable's code. */
+#define NEAR_RANGE ((size_t)2 << 30)
+
+struct Window {
+#ifdef SUPPORT_THREADS
+	pthread_mutex_t lock;
+#endif
+	char      name[16];
+	uint8_t   *start;
+	uint8_t   *end;
+	uint8_t   *route_start;  /* mmap hints in this range are placed in the window. */
+	uint8_t   *route_end;
+	PageAlloc *palloc;
+};
+
+static Window windows[WINDOW_MAX];
+static int windows_count = 0;
+
+/* parse a byte size with an optional K/M/G suffix. */
+static size_t window_size(const char *str, char **end) {
+	size_t size = strtoull(str, end, 0);
+	switch(**end) {
+	case 'g': case 'G': size <<= 30; (*end)++; break;
+	case 'm': case 'M': size <<= 20; (*end)++; break;
+	case 'k': case 'K': size <<= 10; (*end)++; break;
+	}
+	return size;
+}
+
+/* find the executable's code from its program headers, no locks or malloc needed. */
+static int window_text(uint8_t **lo, uint8_t **hi) {
+	ElfW(Phdr) *phdr = (ElfW(Phdr) *)getauxval(AT_PHDR);
+	size_t count = getauxval(AT_PHNUM);
+	uintptr_t bias = 0;
+	size_t i;
+
+	if(phdr == NULL) return -1;
+	for(i = 0; i < count; i++) {
+		if(phdr[i].p_type == PT_PHDR) {
+			bias = (uintptr_t)phdr - phdr[i].p_vaddr;
+		}
+	}
+	for(i = 0; i < count; i++) {
+		if(phdr[i].p_type == PT_LOAD && (phdr[i].p_flags & PF_X)) {
+			*lo = (uint8_t *)(bias + phdr[i].p_vaddr);
+			*hi = *lo + phdr[i].p_memsz;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static inline int window_overlaps(uint8_t *start, uint8_t *end, uint8_t *start2, uint8_t *end2) {
+	return (start < end2) && (start2 < end);
+}
+
+/* mark every free page in a range as allocated, each range taken is added to 'claim' (can be NULL).
+ * returns -1 if 'claim' ran out of room, the rest of the range is still taken. */
+static int window_claim(Window *w, uint8_t *addr, size_t len, PageAllocClaim *claim) {
+	uint8_t *end = addr + len;
+	int rc = 0;
+
+	if(addr < w->start) addr = w->start;
+	if(end > w->end) end = w->end;
+	if(addr >= end) return 0;
+	WINDOW_LOCK(w);
+	if(page_alloc_claim(w->palloc, addr, end - addr, claim) != 0) {
+		page_alloc_claim(w->palloc, addr, end - addr, NULL);
+		rc = -1;
+	}
+	WINDOW_UNLOCK(w);
+	return rc;
+}
+
+void window_release(Window *w, uint8_t *addr, size_t len) {
+	uint8_t *end = addr + len;
+	size_t n;
+
+	if(addr < w->start) addr = w->start;
+	if(end > w->end) end = w->end;
+	WINDOW_LOCK(w);
+	while(addr < end) {
+		n = page_alloc_used_at(w->palloc, addr);
+		if(n > 0) {
+			if(n > (size_t)(end - addr)) n = end - addr;
+			page_alloc_release_segment(w->palloc, addr, n);
+		} else {
+			n = page_alloc_free_at(w->palloc, addr);
+			if(n == 0) break;
+		}
+		addr += n;
+	}
+	WINDOW_UNLOCK(w);
+}
+
+static void window_seed(void *data, uint8_t *start, uint8_t *end) {
+	window_claim((Window *)data, start, end - start, NULL);
+}
+
+typedef struct WindowRefresh {
+	Window    *w;
+	uint8_t   *next;  /* end of the last mapping seen. */
+} WindowRefresh;
+
+static void window_refresh_gap(void *data, uint8_t *start, uint8_t *end) {
+	WindowRefresh *r = (WindowRefresh *)data;
+	if(start > r->next) {
+		/* nothing is mapped in the gap before this mapping. */
+		window_release(r->w, r->next, start - r->next);
+	}
+	r->next = end;
+}
+
+/* something we didn't map is inside the allocated range 'seg', keep only that part allocated. */
+static void window_refresh(Window *w, uint8_t *seg, size_t len) {
+	WindowRefresh r = { w, seg };
+
+	if(proc_maps_walk(seg, seg + len, window_refresh_gap, &r) != 0) {
+		/* can't tell what is mapped, keep the whole range. */
+		return;
+	}
+	if(r.next < (seg + len)) {
+		window_release(w, r.next, (seg + len) - r.next);
+	}
+}
+
+/*
+ * give back the pages window_claim() took for a mapping that failed.  'claimed' is what
+ * window_claim() returned, if it couldn't record every range the kernel is asked instead.
+ */
+static void window_unclaim(Window *w, uint8_t *addr, size_t len, PageAllocClaim *claim, int claimed) {
+	size_t i;
+
+	WINDOW_LOCK(w);
+	for(i = 0; i < claim->count; i++) {
+		page_alloc_release_segment(w->palloc, claim->range[i].addr, claim->range[i].len);
+	}
+	WINDOW_UNLOCK(w);
+	page_alloc_claim_free(claim);
+	if(claimed != 0) {
+		window_refresh(w, addr, len);
+	}
+}
+
+static uint8_t *window_get_segment(Window *w, uint8_t *addr, size_t len) {
+	uint8_t *mem;
+
+	if(addr != NULL && (addr < w->start || addr >= w->end)) addr = NULL;
+	WINDOW_LOCK(w);
+	mem = page_alloc_get_segment(w->palloc, addr, len);
+	WINDOW_UNLOCK(w);
+	return mem;
+}
+
+static uint8_t *window_place(void *data, uint8_t *addr, size_t len) {
+	return window_get_segment((Window *)data, addr, len);
+}
+
+static void window_place_refresh(void *data, uint8_t *seg, size_t len) {
+	window_refresh((Window *)data, seg, len);
+}
+
+static int window_add(const char *name, size_t name_len, uint8_t *start, size_t size,
+		uint8_t *route_start, uint8_t *route_end, PageAllocEngine engine, uint8_t *low_start, uint8_t *low_end) {
+	Window *w;
+	int i;
+
+	if(windows_count >= WINDOW_MAX || size == 0) return -1;
+	start = (uint8_t *)((uintptr_t)start & ~(sys_pagesize - 1));
+	size = PAGE_ALIGN(size);
+	if((uintptr_t)start < (uintptr_t)sys_pagesize || (uintptr_t)(start + size) < (uintptr_t)start) return -1;
+	/* windows can't share addresses with the low region or each other. */
+	if(window_overlaps(start, start + size, low_start, low_end)) return -1;
+	for(i = 0; i < windows_count; i++) {
+		if(window_overlaps(start, start + size, windows[i].start, windows[i].end)) return -1;
+	}
+	w = windows + windows_count;
+	if(name_len >= sizeof(w->name)) name_len = sizeof(w->name) - 1;
+	memcpy(w->name, name, name_len);
+	w->name[name_len] = '\0';
+	w->start = start;
+	w->end = start + size;
+	w->route_start = route_start;
+	w->route_end = route_end;
+	w->palloc = page_alloc_new_engine(engine, start, size);
+	if(w->palloc == NULL) return -1;
+#ifdef SUPPORT_THREADS
+	pthread_mutex_init(&(w->lock), NULL);
+#endif
+	/* keep what is already mapped there allocated. */
+	proc_maps_walk(w->start, w->end, window_seed, w);
+	windows_count++;
+	return 0;
+}
+
+int window_init(const char *spec, PageAllocEngine engine, uint8_t *low_start, uint8_t *low_end) {
+	const char *name;
+	const char *at;
+	uint8_t *route_start;
+	uint8_t *route_end;
+	uint8_t *start;
+	uint8_t *text_lo;
+	uint8_t *text_hi;
+	uintptr_t text_start;
+	char *end;
+	size_t size;
+	int text;
+
+	if(spec == NULL) return 0;
+	while(*spec != '\0') {
+		name = spec;
+		at = strchr(spec, '@');
+		if(at == NULL) break;
+		spec = at + 1;
+		text = (strncmp(spec, "text:", 5) == 0);
+		if(text) {
+			start = NULL;
+			end = (char *)spec + 4;
+		} else {
+			start = (uint8_t *)(uintptr_t)strtoull(spec, &end, 0);
+		}
+		if(*end != ':') break;
+		size = window_size(end + 1, &end);
+		if(text) {
+			if(window_text(&text_lo, &text_hi) != 0) break;
+			text_start = (uintptr_t)text_lo & ~(uintptr_t)0xFFFF;
+			if(text_start < (uintptr_t)low_end || (text_start - (uintptr_t)low_end) < size) {
+				/* a non-PIE executable is loaded inside the low region, there is no room below its code. */
+				fprintf(stderr, "mmap_lowmem: can't place window '%.*s' below the code at %p\n",
+					(int)(at - name), name, text_lo);
+				goto next;
+			}
+			/* right below the code, aligned like LuaJIT aligns its mcode hints. */
+			start = (uint8_t *)(text_start - size);
+			route_start = ((size_t)(text_lo - low_end) > NEAR_RANGE) ? text_lo - NEAR_RANGE : low_end;
+			route_end = text_hi + NEAR_RANGE;
+		} else {
+			route_start = start;
+			route_end = start + size;
+		}
+		window_add(name, at - name, start, size, route_start, route_end, engine, low_start, low_end);
+next:
+		if(*end != ',') break;
+		spec = end + 1;
+	}
+	return windows_count;
+}
+
+int window_count() {
+	return windows_count;
+}
+
+void window_set_split(size_t threshold) {
+	int i;
+
+	for(i = 0; i < windows_count; i++) {
+		Window *w = windows + i;
+		WINDOW_LOCK(w);
+		page_alloc_set_split(w->palloc, threshold);
+		WINDOW_UNLOCK(w);
+	}
+}
+
+Window *window_get(int idx) {
+	return (idx >= 0 && idx < windows_count) ? windows + idx : NULL;
+}
+
+const char *window_name(Window *w) {
+	return w->name;
+}
+
+Window *window_route(void *addr) {
+	int i;
+
+	for(i = 0; i < windows_count; i++) {
+		Window *w = windows + i;
+		if((uint8_t *)addr >= w->route_start && (uint8_t *)addr < w->route_end) return w;
+	}
+	return NULL;
+}
+
+Window *window_at(void *addr) {
+	int i;
+
+	for(i = 0; i < windows_count; i++) {
+		Window *w = windows + i;
+		if((uint8_t *)addr >= w->start && (uint8_t *)addr < w->end) return w;
+	}
+	return NULL;
+}
+
+/* allocate 'len' bytes and claim them with placeholder pages, for mremap to move pages to. */
+static uint8_t *window_get_move_target(Window *w, size_t len) {
+	MapPlacer placer = { window_place, window_place_refresh, w };
+	uint8_t *seg = NULL;
+
+	if(sys_mmap_place(&placer, &seg, NULL, len, len, PROT_NONE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED_NOREPLACE, -1, 0) != MAP_FAILED) {
+		return seg;
+	}
+	if(seg != NULL) {
+		window_release(w, seg, len);
+	}
+	return NULL;
+}
+
+void *window_mmap(Window *w, void *addr, size_t length, int prot, int flags, int fd, off64_t offset) {
+	MapPlacer placer = { window_place, window_place_refresh, w };
+	size_t len = PAGE_ALIGN(length);
+	uint8_t *seg = NULL;
+	void *mem;
+	int err;
+
+	if(flags & MAP_FIXED) {
+		PageAllocClaim claim;
+		int claimed;
+
+		/* the caller can replace anything, including mappings that aren't ours. */
+		page_alloc_claim_init(&claim);
+		claimed = window_claim(w, (uint8_t *)addr, len, &claim);
+		mem = SYS_MMAP64(addr, length, prot, flags, fd, offset);
+		if(mem == MAP_FAILED) {
+			err = errno;
+			window_unclaim(w, (uint8_t *)addr, len, &claim, claimed);
+			errno = err;
+			return mem;
+		}
+		page_alloc_claim_free(&claim);
+		return mem;
+	}
+	mem = sys_mmap_place(&placer, &seg, (uint8_t *)addr, len, length, prot,
+		flags | MAP_FIXED_NOREPLACE, fd, offset);
+	if(mem != MAP_FAILED) return mem;
+	if(seg != NULL) {
+		err = errno;
+		window_release(w, seg, len);
+		errno = err;
+		return MAP_FAILED;
+	}
+	/* window is full, let the kernel use the hint. */
+	return SYS_MMAP64(addr, length, prot, flags, fd, offset);
+}
+
+int window_munmap(Window *w, void *addr, size_t length) {
+	int rc = SYS_MUNMAP(addr, length);
+	if(rc == 0) {
+		window_release(w, (uint8_t *)addr, PAGE_ALIGN(length));
+	}
+	return rc;
+}
+
+void *window_mremap(void *old_addr, size_t old_size, size_t new_size, int flags, void *new_addr) {
+	size_t old_len = PAGE_ALIGN(old_size);
+	size_t new_len = PAGE_ALIGN(new_size);
+	Window *w = window_at(old_addr);
+	uint8_t *old_end = (uint8_t *)old_addr + old_len;
+	uint8_t *seg;
+	void *mem;
+
+	if(flags & MREMAP_FIXED) {
+		Window *new_w = window_at(new_addr);
+		PageAllocClaim claim;
+		int claimed = 0;
+		int err;
+
+		page_alloc_claim_init(&claim);
+		if(new_w != NULL) {
+			claimed = window_claim(new_w, (uint8_t *)new_addr, new_len, &claim);
+		}
+		mem = SYS_MREMAP2(old_addr, old_size, new_size, flags, new_addr);
+		if(mem == MAP_FAILED) {
+			err = errno;
+			if(new_w != NULL) {
+				window_unclaim(new_w, (uint8_t *)new_addr, new_len, &claim, claimed);
+			}
+			errno = err;
+			return mem;
+		}
+		page_alloc_claim_free(&claim);
+		if(w != NULL) {
+			/* the kernel has unmapped the old range. */
+			window_release(w, (uint8_t *)old_addr, old_len);
+		}
+		return mem;
+	}
+	if(w == NULL) {
+		return SYS_MREMAP2(old_addr, old_size, new_size, flags, NULL);
+	}
+	if(new_len <= old_len) {
+		mem = SYS_MREMAP2(old_addr, old_size, new_size, flags & ~MREMAP_MAYMOVE, NULL);
+		if(mem != MAP_FAILED && new_len < old_len) {
+			window_release(w, (uint8_t *)old_addr + new_len, old_len - new_len);
+		}
+		return mem;
+	}
+	/* try to grow in-place. */
+	if(old_end < w->end && (size_t)(w->end - old_end) >= (new_len - old_len)) {
+		int rc;
+		WINDOW_LOCK(w);
+		rc = page_alloc_reserve_segment(w->palloc, old_end, new_len - old_len);
+		WINDOW_UNLOCK(w);
+		if(rc == 0) {
+			mem = SYS_MREMAP2(old_addr, old_size, new_size, flags & ~MREMAP_MAYMOVE, NULL);
+			if(mem != MAP_FAILED) return mem;
+			/* something we didn't map is after the old range. */
+			window_refresh(w, old_end, new_len - old_len);
+		}
+	}
+	if(!(flags & MREMAP_MAYMOVE)) {
+		errno = ENOMEM;
+		return MAP_FAILED;
+	}
+	/* move the pages to a new range in the window, without copying them. */
+	seg = window_get_move_target(w, new_len);
+	if(seg == NULL) {
+		/* window is full, let the kernel move it. */
+		mem = SYS_MREMAP2(old_addr, old_size, new_size, flags, NULL);
+		if(mem != MAP_FAILED && mem != old_addr) {
+			window_release(w, (uint8_t *)old_addr, old_len);
+		}
+		return mem;
+	}
+	mem = SYS_MREMAP2(old_addr, old_size, new_size, MREMAP_MAYMOVE|MREMAP_FIXED, seg);
+	if(mem == MAP_FAILED) {
+		SYS_MUNMAP(seg, new_len);
+		window_release(w, seg, new_len);
+		return MAP_FAILED;
+	}
+	window_release(w, (uint8_t *)old_addr, old_len);
+	return mem;
+}
+
+void window_get_stats(Window *w, uint8_t **start, uint8_t **end, PageAllocStats *stats) {
+	*start = w->start;
+	*end = w->end;
+	WINDOW_LOCK(w);
+	page_alloc_get_stats(w->palloc, stats);
+	WINDOW_UNLOCK(w);
+}
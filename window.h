@@ -0,0 +1,66 @@
+/***************************************************************************
+ * Copyright (C) 2012 by Robert G. Jakabosky <bobby@neoawareness.com>      *
+ *                                                                         *
+ ***************************************************************************/
+#if !defined(__WINDOW_H__)
+#define __WINDOW_H__
+
+#include "lcommon.h"
+#include "page_alloc.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Extra managed windows, besides the low 4Gbytes.
+ *
+ * Each window has its own page allocator and lock, and a routing range: an
+ * mmap without MAP_32BIT or MAP_FIXED whose address hint falls inside the
+ * routing range is placed in the window.  MAP_FIXED mmaps, munmap and mremap
+ * inside a window keep its allocator up to date.
+ *
+ * Windows are listed in MMAP_LOWMEM_WINDOWS as "name@base:size", separated
+ * by commas.  'base' is an address, or "text" for a window just below the
+ * executable's code whose routing range is everything within 2Gbytes of that
+ * code (e.g. "mcode@text:64M" for LuaJIT's machine code).
+ *
+ * Windows don't use the span, retain and reclaim caches of the low region.
+ */
+typedef struct Window Window;
+
+/* upper limit for the number of windows. */
+#define WINDOW_MAX 8
+
+/* set up the windows in 'spec', any window overlapping [low_start, low_end) is skipped.
+ * returns the number of windows. */
+L_LIB_API int window_init(const char *spec, PageAllocEngine engine, uint8_t *low_start, uint8_t *low_end);
+
+L_LIB_API int window_count();
+
+/* two-ended placement inside every window, see page_alloc_set_split(). */
+L_LIB_API void window_set_split(size_t threshold);
+
+L_LIB_API Window *window_get(int idx);
+
+L_LIB_API const char *window_name(Window *w);
+
+/* window that serves an mmap with the address hint 'addr', NULL if none. */
+L_LIB_API Window *window_route(void *addr);
+
+/* window that contains 'addr', NULL if none. */
+L_LIB_API Window *window_at(void *addr);
+
+L_LIB_API void *window_mmap(Window *w, void *addr, size_t length, int prot, int flags, int fd, off64_t offset);
+
+L_LIB_API int window_munmap(Window *w, void *addr, size_t length);
+
+/* 'old_addr', or 'new_addr' with MREMAP_FIXED, must be inside a window. */
+L_LIB_API void *window_mremap(void *old_addr, size_t old_size, size_t new_size, int flags, void *new_addr);
+
+/* return a range the kernel has already unmapped, only the allocated parts are released. */
+L_LIB_API void window_release(Window *w, uint8_t *addr, size_t len);
+
+/* 'start'/'end' is the window itself. */
+L_LIB_API void window_get_stats(Window *w, uint8_t **start, uint8_t **end, PageAllocStats *stats);
+
+#endif /* __WINDOW_H__ */
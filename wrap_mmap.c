@@ -10,6 +10,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <dlfcn.h>
+#include <gnu/lib-names.h>
 #include <unistd.h>
 #include <sys/mman.h>
 
@@ -38,6 +39,8 @@ WrapMMAP *wrap_mmap = &(init_wrap_mmap);
 
 WrapMMAP system_mmap;
 
+long sys_pagesize = 4096;
+
 #define INIT wrap_mmap_init()
 
 static mremap_t sys_mremap = NULL;
@@ -72,6 +75,19 @@ void wrap_mmap_init() {
 	sys_mremap = (mremap_t)dlsym(RTLD_NEXT, "mremap");
 	system_mmap.mremap2 = sys_mremap2;
 	system_mmap.munmap = (munmap_t)dlsym(RTLD_NEXT, "munmap");
+	if(system_mmap.mmap == NULL) {
+		/* libc was loaded before us (e.g. we are only a dependency of another library),
+		 * so there is no 'next' definition, take them from libc directly. */
+		void *libc = dlopen(LIBC_SO, RTLD_LAZY | RTLD_NOLOAD);
+		if(libc != NULL) {
+			system_mmap.mmap = (mmap_t)dlsym(libc, "mmap");
+			system_mmap.mmap64 = (mmap_t)dlsym(libc, "mmap64");
+			sys_mremap = (mremap_t)dlsym(libc, "mremap");
+			system_mmap.munmap = (munmap_t)dlsym(libc, "munmap");
+		}
+	}
+
+	sys_pagesize = sysconf(_SC_PAGE_SIZE);
 
 	/* try to initialize lowmem mmap. */
 	wrapper = init_lowmem_mmap();
@@ -83,6 +99,36 @@ void wrap_mmap_init() {
 	INIT_UNLOCK();
 }
 
+int sys_mmap_collided(uint8_t *seg, size_t len, void *mem, int flags) {
+	if(!(flags & MAP_FIXED_NOREPLACE)) return 0;
+	if(mem == MAP_FAILED) return (errno == EEXIST);
+	if(mem == seg) return 0;
+	/* older kernels treat MAP_FIXED_NOREPLACE as a hint. */
+	SYS_MUNMAP(mem, len);
+	return 1;
+}
+
+void *sys_mmap_place(MapPlacer *placer, uint8_t **seg, uint8_t *addr, size_t len,
+		size_t length, int prot, int flags, int fd, off64_t offset) {
+	void *mem;
+	int collided = 0;
+
+	for(;;) {
+		if(*seg == NULL) {
+			*seg = placer->get(placer->data, addr, len);
+			if(*seg == NULL) break;
+		}
+		mem = SYS_MMAP64(*seg, length, prot, flags, fd, offset);
+		if(L_LIKELY(!sys_mmap_collided(*seg, len, mem, flags))) return mem;
+		/* learn what is really mapped there and try another range. */
+		placer->refresh(placer->data, *seg, len);
+		*seg = NULL;
+		if(++collided >= COLLIDE_RETRIES) break;
+	}
+	errno = ENOMEM;
+	return MAP_FAILED;
+}
+
 static void *init_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
 	INIT;
 	return wrap_mmap->mmap(addr, length, prot, flags, fd, offset);
@@ -23,6 +23,9 @@ extern WrapMMAP *wrap_mmap;
 
 extern WrapMMAP system_mmap;
 
+/* look up the system calls and set up the low region, only the first call does anything. */
+void wrap_mmap_init();
+
 #define SYS_MMAP(addr, length, prot, flags, fd, offset) \
 	system_mmap.mmap((addr), (length), (prot), (flags), (fd), (offset))
 
@@ -35,4 +38,37 @@ extern WrapMMAP system_mmap;
 #define SYS_MUNMAP(addr, length) \
 	system_mmap.munmap((addr), (length))
 
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/* system page size, set by wrap_mmap_init(). */
+extern long sys_pagesize;
+
+#define PAGE_ALIGN(len) \
+	(((len) + (sys_pagesize - 1)) & ~(sys_pagesize - 1))
+
+/* times mmap picks another range after finding something it didn't map in the first one. */
+#define COLLIDE_RETRIES 16
+
+/* check if an mmap of 'seg' with MAP_FIXED_NOREPLACE in 'flags' hit a mapping we didn't make. */
+int sys_mmap_collided(uint8_t *seg, size_t len, void *mem, int flags);
+
+/* how sys_mmap_place() gets a free range near 'addr' (can be NULL), and keeps only the part of
+ * one that something else has mapped allocated. */
+typedef struct MapPlacer {
+	uint8_t *(*get)(void *data, uint8_t *addr, size_t len);
+	void (*refresh)(void *data, uint8_t *seg, size_t len);
+	void *data;
+} MapPlacer;
+
+/*
+ * map '*seg' (a range from the placer if it is NULL).  With MAP_FIXED_NOREPLACE in 'flags', a
+ * range something else has mapped is refreshed and another one tried, up to COLLIDE_RETRIES
+ * times.  When the mmap fails '*seg' is the range it failed on, still allocated, or NULL with
+ * errno ENOMEM if no range was left to try.
+ */
+void *sys_mmap_place(MapPlacer *placer, uint8_t **seg, uint8_t *addr, size_t len,
+	size_t length, int prot, int flags, int fd, off64_t offset);
+
 #endif /* __WRAP_MMAP_H__ */